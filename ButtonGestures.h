@@ -0,0 +1,222 @@
+/**
+    ButtonGestures.h:
+    Gestures of the button: click, double click and long press, detected from
+    debounced, timestamped edges. The timing only depends on the timestamps,
+    not on how often the gestures are polled.
+
+    Copyright (C) 2020 by Ernst Sikora
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BUTTON_GESTURES_H
+#define BUTTON_GESTURES_H
+
+#include <stdint.h>
+
+#include "Commands.h"
+
+// Timing of the gestures
+const int64_t BUTTON_DEBOUNCE_TIME = 20000;      // us, edges following an accepted edge within this time are bounces
+const int64_t BUTTON_DOUBLE_CLICK_TIME = 300000; // us, maximum time from the first release to the second press
+const int64_t BUTTON_LONG_PRESS_TIME = 500000;   // us, the button held down longer starts the brightness ramp
+const int64_t BUTTON_RAMP_TIME = 100000;         // us, time between two brightness steps of the ramp
+
+// Edge of the button signal
+typedef struct ButtonEdge {
+    int64_t time = 0; // us since boot
+    bool pressed = false; // State after the edge
+} t_ButtonEdge;
+
+/**
+ * Debouncing of the button: an edge is accepted if it changes the state and if the previous accepted edge is at
+ * least BUTTON_DEBOUNCE_TIME ago. Fast enough for an interrupt handler.
+ */
+class ButtonDebounce
+{
+public:
+    /**
+     * Returns true, if the edge to the given state at the given time (us) is accepted.
+     */
+    bool accept(bool pressed, int64_t time)
+    {
+        if (pressed == pressed_ || time - edgeAt_ < BUTTON_DEBOUNCE_TIME)
+        {
+            return false;
+        }
+
+        pressed_ = pressed;
+        edgeAt_ = time;
+        return true;
+    }
+
+    bool pressed() const
+    {
+        return pressed_;
+    }
+
+private:
+    bool pressed_ = false;
+    int64_t edgeAt_ = INT64_MIN / 2; // us, time of the latest accepted edge
+};
+
+// Phases of the gesture detection
+enum ButtonPhase {BUTTON_IDLE = 0, BUTTON_DOWN = 1, BUTTON_UP_ONCE = 2, BUTTON_DOWN_TWICE = 3, BUTTON_RAMP = 4};
+typedef enum ButtonPhase t_ButtonPhase;
+
+/**
+ * Detects the gestures of the button and translates them into commands:
+ * - click: on/off, i.e. on -> eco -> off. Issued when no second click follows within BUTTON_DOUBLE_CLICK_TIME.
+ * - double click: mode change
+ * - long press: brightness ramp, one step per BUTTON_RAMP_TIME while the button is held down. The direction
+ *   alternates with each long press, starting upwards.
+ * Each command carries the time of the gesture which triggered it, so the delay until it is processed is part of
+ * the latency statistics.
+ */
+class ButtonGestures
+{
+public:
+    /**
+     * Processes a debounced edge. Commands due before the edge must have been taken by next() first.
+     */
+    void edge(bool pressed, int64_t time)
+    {
+        switch (phase_)
+        {
+            case t_ButtonPhase::BUTTON_IDLE:
+                if (pressed)
+                {
+                    phase_ = t_ButtonPhase::BUTTON_DOWN;
+                    downAt_ = time;
+                }
+
+                break;
+
+            case t_ButtonPhase::BUTTON_DOWN:
+                if (!pressed)
+                {
+                    phase_ = t_ButtonPhase::BUTTON_UP_ONCE;
+                    upAt_ = time;
+                }
+
+                break;
+
+            case t_ButtonPhase::BUTTON_UP_ONCE:
+                if (pressed)
+                {
+                    phase_ = t_ButtonPhase::BUTTON_DOWN_TWICE;
+                    downAt_ = time;
+                }
+
+                break;
+
+            case t_ButtonPhase::BUTTON_DOWN_TWICE:
+                if (!pressed)
+                {
+                    phase_ = t_ButtonPhase::BUTTON_IDLE;
+                    pending_ = command(t_CommandId::CMD_MODE_CHANGE, CMD_STATE_ON | CMD_STATE_ECO, time);
+                    pendingValid_ = true;
+                }
+
+                break;
+
+            case t_ButtonPhase::BUTTON_RAMP:
+                if (!pressed)
+                {
+                    phase_ = t_ButtonPhase::BUTTON_IDLE;
+                    rampUp_ = !rampUp_;
+                }
+
+                break;
+        }
+    }
+
+    /**
+     * Returns the next command due at the given time (us), if any. Called repeatedly until it returns false.
+     */
+    bool next(int64_t now, t_Command& cmd)
+    {
+        if (pendingValid_)
+        {
+            cmd = pending_;
+            pendingValid_ = false;
+            return true;
+        }
+
+        switch (phase_)
+        {
+            case t_ButtonPhase::BUTTON_DOWN:
+            case t_ButtonPhase::BUTTON_DOWN_TWICE:
+                if (now - downAt_ < BUTTON_LONG_PRESS_TIME)
+                {
+                    return false;
+                }
+
+                phase_ = t_ButtonPhase::BUTTON_RAMP;
+                rampAt_ = downAt_ + BUTTON_LONG_PRESS_TIME;
+
+                // Fall through - first step of the ramp
+
+            case t_ButtonPhase::BUTTON_RAMP:
+                if (now < rampAt_)
+                {
+                    return false;
+                }
+
+                cmd = command(rampUp_ ? t_CommandId::CMD_BRIGHTNESS_INC : t_CommandId::CMD_BRIGHTNESS_DEC,
+                    CMD_STATE_ON | CMD_STATE_ECO, rampAt_);
+                cmd.repeat = (rampAt_ > downAt_ + BUTTON_LONG_PRESS_TIME);
+                rampAt_ += BUTTON_RAMP_TIME;
+                return true;
+
+            case t_ButtonPhase::BUTTON_UP_ONCE:
+                if (now - upAt_ < BUTTON_DOUBLE_CLICK_TIME)
+                {
+                    return false;
+                }
+
+                phase_ = t_ButtonPhase::BUTTON_IDLE;
+                cmd = command(t_CommandId::CMD_ON_OFF, CMD_STATES_ALL, upAt_);
+                return true;
+
+            default:
+                return false;
+        }
+    }
+
+    t_ButtonPhase phase() const
+    {
+        return phase_;
+    }
+
+private:
+    t_ButtonPhase phase_ = t_ButtonPhase::BUTTON_IDLE;
+    int64_t downAt_ = 0; // us, latest press
+    int64_t upAt_ = 0; // us, release after the first click
+    int64_t rampAt_ = 0; // us, next step of the brightness ramp
+    bool rampUp_ = true; // Direction of the next brightness ramp
+    t_Command pending_; // Command triggered by the latest edge
+    bool pendingValid_ = false;
+
+    static t_Command command(t_CommandId id, uint8_t states, int64_t time)
+    {
+        t_Command cmd;
+        cmd.id = id;
+        cmd.states = states;
+        cmd.timestamp = time;
+        return cmd;
+    }
+};
+
+#endif // BUTTON_GESTURES_H
@@ -0,0 +1,67 @@
+/**
+    ClipFormat.h:
+    Layout of the animation clips stored in the flash data partition, shared by
+    the playback on the lamp and the clip encoder on the PC.
+
+    Copyright (C) 2020 by Ernst Sikora
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CLIPFORMAT_H
+#define CLIPFORMAT_H
+
+#include <stdint.h>
+
+/*
+ * Clip bank, all values little endian:
+ *
+ *   Bank header   magic "LCLP" (u32), version (u16), number of clips (u16), reserved (u32, u32)
+ *   Clip table    per clip: offset from the start of the bank (u32), size (u32)
+ *   Clips         header, palette, frames
+ *
+ *   Clip header   number of leds (u16), number of frames (u16), frame time in ms (u16), palette size (u16),
+ *                 reserved (u32)
+ *   Palette       palette size x red, green, blue (u8)
+ *   Frame         number of runs (u16), then per run: first led (u16), number of leds (u16), palette index per led
+ *
+ * Each frame only contains the runs of leds which differ from the previous frame. The first frame of a clip
+ * contains all leds, i.e. playback can restart from it at any time.
+ */
+const uint32_t CLIP_BANK_MAGIC = 0x504C434C;         // "LCLP"
+const uint16_t CLIP_BANK_VERSION = 1;                // Format version of this sketch
+const uint32_t CLIP_BANK_HEADER_SIZE = 16;           // Bytes, bank header
+const uint32_t CLIP_ENTRY_SIZE = 8;                  // Bytes, clip table entry
+const uint32_t CLIP_HEADER_SIZE = 12;                // Bytes, clip header
+const uint32_t CLIP_COLOR_SIZE = 3;                  // Bytes, palette entry
+const uint32_t CLIP_RUN_HEADER_SIZE = 4;             // Bytes, header of a run within a frame
+const uint16_t CLIP_PALETTE_SIZE_MAX = 256;          // Number of palette entries addressable by an index byte
+
+/**
+ * Reads a 16-bit value, byte-wise as the fields within a clip are not aligned.
+ */
+inline uint16_t clipRead16(const uint8_t* p)
+{
+    return (uint16_t) p[0] | ((uint16_t) p[1] << 8);
+}
+
+/**
+ * Reads an unaligned 32-bit value.
+ */
+inline uint32_t clipRead32(const uint8_t* p)
+{
+    return (uint32_t) clipRead16(p) | ((uint32_t) clipRead16(p + 2) << 16);
+}
+
+#endif // CLIPFORMAT_H
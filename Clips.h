@@ -0,0 +1,324 @@
+/**
+    Clips.h:
+    Playback of pre-rendered animation clips from a flash data partition. The
+    partition is mapped into the address space, the frames are decoded directly
+    from the flash cache.
+
+    Copyright (C) 2020 by Ernst Sikora
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CLIPS_H
+#define CLIPS_H
+
+#include <string.h>
+#include <esp_partition.h>
+
+#include "ClipFormat.h"
+#include "Effect.h"
+
+// Clip playback: maximum number of frames decoded within one update to catch up after a stall
+const uint16_t CLIP_CATCH_UP_MAX = 8;
+
+/**
+ * Bank of animation clips in a flash data partition, see ClipFormat.h. The partition is mapped once and kept
+ * mapped, the clips are read through the flash cache without copying them to RAM.
+ */
+class ClipBank
+{
+public:
+    /**
+     * Maps the data partition with the given label. Returns false, if the partition does not exist or does not
+     * contain a clip bank. Without a clip bank, count() is zero.
+     */
+    bool begin(const char* label)
+    {
+        const esp_partition_t* partition =
+            esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+
+        if (partition == nullptr || partition->size < CLIP_BANK_HEADER_SIZE)
+        {
+            return false;
+        }
+
+        const void* data;
+        spi_flash_mmap_handle_t handle;
+
+        if (esp_partition_mmap(partition, 0, partition->size, ESP_PARTITION_MMAP_DATA, &data, &handle) != ESP_OK)
+        {
+            return false;
+        }
+
+        const uint8_t* bank = (const uint8_t*) data;
+        uint16_t numClips = clipRead16(bank + 6);
+
+        if (clipRead32(bank) != CLIP_BANK_MAGIC || clipRead16(bank + 4) != CLIP_BANK_VERSION ||
+            CLIP_BANK_HEADER_SIZE + (uint32_t) numClips * CLIP_ENTRY_SIZE > partition->size)
+        {
+            spi_flash_munmap(handle);
+            return false;
+        }
+
+        bank_ = bank;
+        size_ = partition->size;
+        numClips_ = numClips;
+
+        return true;
+    }
+
+    /**
+     * Number of clips in the bank.
+     */
+    uint16_t count() const
+    {
+        return numClips_;
+    }
+
+    /**
+     * Returns the clip with the given number and its size in bytes, or nullptr if its table entry points outside
+     * of the partition.
+     */
+    const uint8_t* clip(uint16_t clipNr, uint32_t& size) const
+    {
+        if (clipNr >= numClips_)
+        {
+            return nullptr;
+        }
+
+        const uint8_t* entry = bank_ + CLIP_BANK_HEADER_SIZE + (uint32_t) clipNr * CLIP_ENTRY_SIZE;
+        uint32_t offset = clipRead32(entry);
+        size = clipRead32(entry + 4);
+
+        if (offset > size_ || size > size_ - offset)
+        {
+            return nullptr;
+        }
+
+        return bank_ + offset;
+    }
+
+private:
+    const uint8_t* bank_ = nullptr; // Start of the mapped partition
+    uint32_t size_ = 0; // Bytes, size of the partition
+    uint16_t numClips_ = 0;
+};
+
+/**
+ * Plays the clips of a bank one after the other, on led strips with up to N leds. Playback is time-based: each
+ * update advances the clip by the frame duration of the scheduler, frames are skipped if the clip is faster than
+ * the frame rate. Only the palette index of each led is kept in RAM, the deltas and the palette are read from
+ * flash. Clips longer than the led strip are cut off, the remaining leds of shorter clips stay black.
+ * The bank contents are not trusted: a clip which is inconsistent is stopped and the next clip is played.
+ */
+template <uint16_t N>
+class EffectClip : public Effect
+{
+public:
+    EffectClip(const ClipBank& bank) : Effect("Clip", RENDER_STEP_TIME_MIN), bank_(bank) {}
+
+    void begin(uint16_t numLeds) override
+    {
+        Effect::begin(numLeds);
+        clipNr_ = 0;
+        open();
+    }
+
+    bool update(uint32_t dt) override
+    {
+        bool changed = changed_;
+        changed_ = false;
+
+        if (clip_ == nullptr)
+        {
+            return changed;
+        }
+
+        if (!paused)
+        {
+            elapsed_ += dt;
+        }
+
+        // Do not try to catch up with all frames missed during a long stall
+        if (elapsed_ > (uint32_t) CLIP_CATCH_UP_MAX * frameTime_)
+        {
+            elapsed_ = (uint32_t) CLIP_CATCH_UP_MAX * frameTime_;
+        }
+
+        while (elapsed_ >= frameTime_ && clip_ != nullptr)
+        {
+            elapsed_ -= frameTime_;
+            nextFrame();
+            changed = true;
+        }
+
+        return changed;
+    }
+
+    void render(LedSpan leds) const override
+    {
+        uint16_t ledNr = 0;
+
+        if (clip_ != nullptr)
+        {
+            for (; ledNr < leds.size && ledNr < clipLeds_; ledNr++)
+            {
+                const uint8_t* color = palette_ + indices_[ledNr] * CLIP_COLOR_SIZE;
+                leds[ledNr] = CRGB(color[0], color[1], color[2]);
+            }
+        }
+
+        for (; ledNr < leds.size; ledNr++)
+        {
+            leds[ledNr] = CRGB(0, 0, 0);
+        }
+    }
+
+    bool available() const override
+    {
+        return bank_.count() > 0;
+    }
+
+private:
+    const ClipBank& bank_;
+    const uint8_t* clip_ = nullptr; // Clip being played, nullptr if none of the clips can be played
+    const uint8_t* end_ = nullptr; // End of the clip
+    const uint8_t* palette_ = nullptr;
+    const uint8_t* frame_ = nullptr; // Next frame to be decoded
+    uint16_t clipNr_ = 0;
+    uint16_t clipLeds_ = 0;
+    uint16_t numFrames_ = 0;
+    uint16_t paletteSize_ = 0;
+    uint16_t frameNr_ = 0; // Frame shown
+    uint32_t frameTime_ = 0; // us
+    uint32_t elapsed_ = 0; // us, time since the frame shown was due
+    uint8_t indices_[N]; // Palette index of each led of the frame shown
+
+    /**
+     * Starts the current clip or, if it cannot be played, the next one which can. Stops playback if none can.
+     */
+    void open()
+    {
+        for (uint16_t tries = 0; tries < bank_.count(); tries++)
+        {
+            if (openClip(clipNr_))
+            {
+                return;
+            }
+
+            clipNr_ = (clipNr_ + 1) % bank_.count();
+        }
+
+        clip_ = nullptr;
+        changed_ = true;
+    }
+
+    /**
+     * Checks the header of a clip and decodes its first frame. Returns false, if the clip cannot be played.
+     */
+    bool openClip(uint16_t clipNr)
+    {
+        uint32_t size;
+        const uint8_t* clip = bank_.clip(clipNr, size);
+
+        if (clip == nullptr || size < CLIP_HEADER_SIZE)
+        {
+            return false;
+        }
+
+        clipLeds_ = clipRead16(clip);
+        numFrames_ = clipRead16(clip + 2);
+        frameTime_ = (uint32_t) clipRead16(clip + 4) * 1000;
+        paletteSize_ = clipRead16(clip + 6);
+
+        if (clipLeds_ == 0 || clipLeds_ > N || numFrames_ == 0 || frameTime_ == 0 || paletteSize_ == 0 ||
+            paletteSize_ > CLIP_PALETTE_SIZE_MAX || CLIP_HEADER_SIZE + paletteSize_ * CLIP_COLOR_SIZE > size)
+        {
+            return false;
+        }
+
+        clip_ = clip;
+        end_ = clip + size;
+        palette_ = clip + CLIP_HEADER_SIZE;
+        frame_ = palette_ + paletteSize_ * CLIP_COLOR_SIZE;
+        frameNr_ = 0;
+        elapsed_ = 0;
+        changed_ = true;
+        memset(indices_, 0, sizeof(indices_));
+
+        return decodeFrame();
+    }
+
+    /**
+     * Shows the next frame, continues with the next clip after the last frame or a frame which cannot be decoded.
+     */
+    void nextFrame()
+    {
+        frameNr_++;
+
+        if (frameNr_ >= numFrames_ || !decodeFrame())
+        {
+            clipNr_ = (clipNr_ + 1) % bank_.count();
+            open();
+        }
+    }
+
+    /**
+     * Applies the runs of the next frame to the palette indices. Returns false, if a run lies outside of the clip
+     * or of its leds.
+     */
+    bool decodeFrame()
+    {
+        const uint8_t* p = frame_;
+
+        if (end_ - p < 2)
+        {
+            return false;
+        }
+
+        uint16_t numRuns = clipRead16(p);
+        p += 2;
+
+        for (uint16_t runNr = 0; runNr < numRuns; runNr++)
+        {
+            if (end_ - p < (int32_t) CLIP_RUN_HEADER_SIZE)
+            {
+                return false;
+            }
+
+            uint16_t first = clipRead16(p);
+            uint16_t count = clipRead16(p + 2);
+            p += CLIP_RUN_HEADER_SIZE;
+
+            if ((uint32_t) first + count > clipLeds_ || end_ - p < (int32_t) count)
+            {
+                return false;
+            }
+
+            for (uint16_t i = 0; i < count; i++)
+            {
+                uint8_t index = p[i];
+                indices_[first + i] = (index < paletteSize_) ? index : 0;
+            }
+
+            p += count;
+        }
+
+        frame_ = p;
+
+        return true;
+    }
+};
+
+#endif // CLIPS_H
@@ -0,0 +1,48 @@
+/**
+    Commands.h:
+    User commands passed from the input sources (IR remote, button)
+    to the render task.
+
+    Copyright (C) 2020 by Ernst Sikora
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef COMMANDS_H
+#define COMMANDS_H
+
+#include <stdint.h>
+
+// User commands, independent of the remote control used
+enum CommandId {CMD_NONE = 0, CMD_ON_OFF = 1, CMD_BRIGHTNESS_INC = 2, CMD_BRIGHTNESS_DEC = 3, CMD_MODE_CHANGE = 4,
+                CMD_PLAY_PAUSE = 5, CMD_SLOWER = 6, CMD_FASTER = 7, CMD_LEFT = 8, CMD_RIGHT = 9,
+                CMD_SET_MODE = 10, CMD_SET_BRIGHTNESS = 11, CMD_SET_SPEED = 12}; // CMD_SET_...: see value
+typedef enum CommandId t_CommandId;
+
+// System states in which a command is processed, as bit mask: bit n corresponds to system state n (t_State)
+const uint8_t CMD_STATE_OFF  = 0x01;
+const uint8_t CMD_STATE_ON   = 0x02;
+const uint8_t CMD_STATE_ECO  = 0x04;
+const uint8_t CMD_STATES_ALL = CMD_STATE_OFF | CMD_STATE_ON | CMD_STATE_ECO;
+
+// Command passed from the input task to the render task
+typedef struct Command {
+    t_CommandId id = t_CommandId::CMD_NONE; // Requested action
+    uint8_t states = CMD_STATES_ALL; // System states in which the command is processed
+    bool repeat = false; // Generated by holding down the key of the IR remote
+    uint16_t value = 0; // Value of the CMD_SET_... commands: light mode, brightness or step time (ms)
+    int64_t timestamp = 0; // us since boot, time of reception
+} t_Command;
+
+#endif // COMMANDS_H
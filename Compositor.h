@@ -0,0 +1,364 @@
+/**
+    Compositor.h:
+    Combines several light effects into one frame: each effect is a layer with a
+    blend mode and an opacity. Also cross-fades from one effect to another.
+
+    Copyright (C) 2020 by Ernst Sikora
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef COMPOSITOR_H
+#define COMPOSITOR_H
+
+#include <FastLED.h>
+
+#include "Effect.h"
+#include "PixelKernels.h"
+
+// Blend modes: how a layer is combined with the layers below it
+enum BlendMode {BLEND_NORMAL = 0, BLEND_ADD = 1};
+typedef enum BlendMode t_BlendMode;
+
+// Opacity of a layer which covers the layers below it completely
+const uint16_t LAYER_OPAQUE = 256;
+
+// Layer of a compositor
+typedef struct Layer {
+    Effect* effect = nullptr;
+    t_BlendMode mode = t_BlendMode::BLEND_NORMAL;
+    uint16_t opacity = LAYER_OPAQUE; // 0 ... 256
+} t_Layer;
+
+/**
+ * Renders up to L layers on led strips with up to N leds. The bottom layer is rendered into the frame directly,
+ * each further layer into its own scratch buffer, which is then blended into the frame. During a cross-fade, the
+ * effect fading in replaces the bottom layer and uses the first scratch buffer. The scratch buffers are part of
+ * the compositor, i.e. statically allocated with it.
+ */
+template <uint16_t N, uint8_t L>
+class Compositor
+{
+    static_assert(L > 0, "Compositor needs at least one layer");
+
+public:
+    /**
+     * Removes all layers and sets the bottom layer, e.g. a light mode, without transition.
+     */
+    void set(Effect* effect)
+    {
+        numLayers_ = 0;
+        incoming_ = nullptr;
+        add(effect, t_BlendMode::BLEND_NORMAL, LAYER_OPAQUE);
+    }
+
+    /**
+     * Adds a layer on top. Returns false, if all layers are in use.
+     */
+    bool add(Effect* effect, t_BlendMode mode, uint16_t opacity)
+    {
+        if (numLayers_ >= L)
+        {
+            return false;
+        }
+
+        t_Layer& layer = layers_[numLayers_++];
+        layer.effect = effect;
+        layer.mode = mode;
+        layer.opacity = (opacity > LAYER_OPAQUE) ? LAYER_OPAQUE : opacity;
+        changed_ = true;
+
+        return true;
+    }
+
+    /**
+     * Changes the opacity of a layer (0 ... 256).
+     */
+    void setOpacity(uint8_t layerNr, uint16_t opacity)
+    {
+        if (layerNr < numLayers_)
+        {
+            layers_[layerNr].opacity = (opacity > LAYER_OPAQUE) ? LAYER_OPAQUE : opacity;
+            changed_ = true;
+        }
+    }
+
+    /**
+     * Fades the bottom layer over to another effect within the given duration (us). Both effects are updated and
+     * rendered meanwhile. A cross-fade in progress is completed first.
+     */
+    void crossFade(Effect* effect, uint32_t duration)
+    {
+        if (incoming_ != nullptr)
+        {
+            layers_[0].effect = incoming_;
+        }
+
+        if (numLayers_ == 0 || duration == 0 || layers_[0].effect == effect)
+        {
+            incoming_ = nullptr;
+            layers_[0].effect = effect;
+            numLayers_ = (numLayers_ == 0) ? 1 : numLayers_;
+        }
+        else
+        {
+            incoming_ = effect;
+            fadeTime_ = duration;
+            fadeElapsed_ = 0;
+        }
+
+        changed_ = true;
+    }
+
+    /**
+     * True, while a cross-fade is in progress.
+     */
+    bool crossFading() const
+    {
+        return incoming_ != nullptr;
+    }
+
+    /**
+     * Effect of the bottom layer, i.e. the one fading in during a cross-fade.
+     */
+    Effect* base() const
+    {
+        return (incoming_ != nullptr) ? incoming_ : layers_[0].effect;
+    }
+
+    /**
+     * Updates the effects of all layers and advances a cross-fade by dt (us). Returns true, if a new frame needs
+     * to be rendered.
+     */
+    bool update(uint32_t dt)
+    {
+        bool changed = changed_;
+        changed_ = false;
+
+        for (uint8_t layerNr = 0; layerNr < numLayers_; layerNr++)
+        {
+            changed |= layers_[layerNr].effect->update(dt);
+        }
+
+        if (incoming_ != nullptr)
+        {
+            incoming_->update(dt);
+            fadeElapsed_ += dt;
+            changed = true;
+
+            if (fadeElapsed_ >= fadeTime_)
+            {
+                layers_[0].effect = incoming_;
+                incoming_ = nullptr;
+            }
+        }
+
+        return changed;
+    }
+
+    /**
+     * Renders and combines all layers into the leds.
+     */
+    void render(LedSpan leds)
+    {
+        const uint16_t numLeds = (leds.size > N) ? N : leds.size;
+
+        if (numLayers_ == 0)
+        {
+            pixelFill(leds.data, numLeds, CRGB(0, 0, 0));
+            return;
+        }
+
+        // Bottom layer, blended with black
+        layers_[0].effect->render(leds);
+
+        if (incoming_ != nullptr)
+        {
+            incoming_->render(LedSpan(scratch_[0], numLeds));
+            pixelBlend(leds.data, scratch_[0], numLeds, ((uint64_t) fadeElapsed_ * LAYER_OPAQUE) / fadeTime_);
+        }
+
+        if (layers_[0].opacity < LAYER_OPAQUE)
+        {
+            pixelScale(leds.data, numLeds, layers_[0].opacity == 0 ? 0 : layers_[0].opacity - 1);
+        }
+
+        for (uint8_t layerNr = 1; layerNr < numLayers_; layerNr++)
+        {
+            const t_Layer& layer = layers_[layerNr];
+            CRGB* scratch = scratch_[layerNr];
+
+            if (layer.opacity == 0)
+            {
+                continue;
+            }
+
+            layer.effect->render(LedSpan(scratch, numLeds));
+
+            if (layer.mode == t_BlendMode::BLEND_ADD)
+            {
+                if (layer.opacity < LAYER_OPAQUE)
+                {
+                    pixelScale(scratch, numLeds, layer.opacity - 1);
+                }
+
+                pixelAdd(leds.data, scratch, numLeds);
+            }
+            else
+            {
+                pixelBlend(leds.data, scratch, numLeds, layer.opacity);
+            }
+        }
+    }
+
+private:
+    t_Layer layers_[L];
+    uint8_t numLayers_ = 0;
+    bool changed_ = true;
+
+    // Cross-fade of the bottom layer: effect fading in, duration and time elapsed (us)
+    Effect* incoming_ = nullptr;
+    uint32_t fadeTime_ = 0;
+    uint32_t fadeElapsed_ = 0;
+
+    // Scratch buffers of the layers above the bottom layer, the first one holds the effect fading in
+    alignas(4) CRGB scratch_[L][N];
+};
+
+/**
+ * Light effect made of other effects, each one a layer of a compositor with up to L layers, e.g. sprites added
+ * to a gradient. The speed, direction and pause set by the user apply to all layers. The layer effects must be
+ * separate instances, not the ones of the effect registry. The layered effect steps in lockstep with its layers,
+ * i.e. its position counts their steps. seek() and follow() move each layer by the same number of steps, in
+ * the direction of the layer (a layer which is not reversible always counts up).
+ */
+template <uint16_t N, uint8_t L>
+class EffectLayers : public Effect
+{
+public:
+    EffectLayers(const char* name, uint16_t defaultStepTime) : Effect(name, defaultStepTime) {}
+
+    /**
+     * Adds a layer on top, called once during setup. Returns false, if all layers are in use.
+     */
+    bool add(Effect* effect, t_BlendMode mode, uint16_t opacity)
+    {
+        if (numLayers_ >= L || !compositor_.add(effect, mode, opacity))
+        {
+            return false;
+        }
+
+        effects_[numLayers_++] = effect;
+        return true;
+    }
+
+    void begin(uint16_t numLeds) override
+    {
+        Effect::begin(numLeds);
+        applySettings();
+
+        for (uint8_t layerNr = 0; layerNr < numLayers_; layerNr++)
+        {
+            effects_[layerNr]->begin(numLeds);
+        }
+    }
+
+    bool update(uint32_t dt) override
+    {
+        applySettings();
+
+        // The own step timer runs with the same step time and frame durations as the ones of the layers
+        bool changed = Effect::update(dt);
+
+        return compositor_.update(dt) || changed;
+    }
+
+    void seek(int32_t position) override
+    {
+        applySettings();
+        int32_t steps = (position - position_) * direction();
+
+        for (uint8_t layerNr = 0; layerNr < numLayers_; layerNr++)
+        {
+            Effect* effect = effects_[layerNr];
+            effect->seek(effect->position() + steps * layerDirection(effect));
+        }
+
+        Effect::seek(position);
+    }
+
+    void follow(int32_t position, int32_t nextStepIn) override
+    {
+        applySettings();
+        int32_t steps = (position - position_) * direction();
+
+        for (uint8_t layerNr = 0; layerNr < numLayers_; layerNr++)
+        {
+            Effect* effect = effects_[layerNr];
+            effect->follow(effect->position() + steps * layerDirection(effect), nextStepIn);
+        }
+
+        // The layers have jumped already, if needed
+        if (followTimer(position, nextStepIn))
+        {
+            Effect::seek(position);
+        }
+    }
+
+    void render(LedSpan leds) const override
+    {
+        compositor_.render(leds);
+    }
+
+    bool reversible() const override
+    {
+        for (uint8_t layerNr = 0; layerNr < numLayers_; layerNr++)
+        {
+            if (effects_[layerNr]->reversible())
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+private:
+    mutable Compositor<N, L> compositor_; // Rendering writes its scratch buffers only, not the state of the layers
+    Effect* effects_[L];
+    uint8_t numLayers_ = 0;
+
+    /**
+     * Passes the speed, direction and pause set by the user on to the layers.
+     */
+    void applySettings()
+    {
+        for (uint8_t layerNr = 0; layerNr < numLayers_; layerNr++)
+        {
+            effects_[layerNr]->stepTime = stepTime;
+            effects_[layerNr]->dirLeft = dirLeft;
+            effects_[layerNr]->paused = paused;
+        }
+    }
+
+    /**
+     * Change of the position of a layer with each step, see Effect::direction().
+     */
+    int32_t layerDirection(const Effect* effect) const
+    {
+        return (effect->reversible() && !dirLeft) ? -1 : 1;
+    }
+};
+
+#endif // COMPOSITOR_H
@@ -0,0 +1,180 @@
+/**
+    Dither.h:
+    High-resolution output stage of the led strip: gamma correction and
+    brightness in 16 bit per color channel, quantized to the 8 bit of the leds
+    by temporal dithering.
+
+    Copyright (C) 2020 by Ernst Sikora
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DITHER_H
+#define DITHER_H
+
+#include <math.h>
+#include <FastLED.h>
+
+// Color of a led in linear light, in 1/256 of an 8-bit output code (8.8 fixed-point, 0 ... 255 * 256)
+typedef struct LedLinear {
+    uint16_t r = 0;
+    uint16_t g = 0;
+    uint16_t b = 0;
+} t_LedLinear;
+
+// Output stage: scale factor of limit() which leaves the frame unchanged
+const uint32_t DITHER_LIMIT_NONE = 65536;
+
+// Output stage: remainders of linear values from this output code on are not shown by dithering, one code is less
+// than 1/64 of the value there (8.8 fixed-point)
+const uint16_t DITHER_VISIBLE_MAX = 64 << 8;
+
+/**
+ * Output stage for up to N leds. load() converts a frame of 8-bit colors into linear 16-bit values scaled by a
+ * 16-bit brightness. dither() quantizes them to 8 bit and carries the remainder of each color channel over to
+ * the next transmission, so that on average the leds show the 16-bit value, even at very low brightness.
+ * The sum returned by load() is proportional to the current drawn by the leds, limit() scales the frame down.
+ * fractional() tells whether dithering would show anything else than rounding, i.e. whether it is worth it.
+ */
+template <uint16_t N>
+class TemporalDither
+{
+public:
+    /**
+     * Builds the gamma table and staggers the initial remainders, so that leds of the same color do not
+     * switch between two output codes in the same transmission.
+     */
+    void begin(float gamma)
+    {
+        for (uint16_t i = 0; i < 256; i++)
+        {
+            gamma_[i] = (uint16_t) (powf(i / 255.0f, gamma) * (255 << 8) + 0.5f);
+        }
+
+        for (uint16_t ledNr = 0; ledNr < N; ledNr++)
+        {
+            error_[ledNr][0] = ledNr * 97;
+            error_[ledNr][1] = ledNr * 97 + 85;
+            error_[ledNr][2] = ledNr * 97 + 170;
+        }
+    }
+
+    /**
+     * Converts the colors of numLeds leds to linear light and scales them by brightness (0 ... 65535). Returns the
+     * sum of all color channels (8.8 fixed-point), computed in the same pass. The limit is reset.
+     */
+    uint32_t load(const CRGB* leds, uint16_t numLeds, uint16_t brightness)
+    {
+        uint32_t scale = (uint32_t) brightness + 1;
+        uint32_t sum = 0;
+        uint16_t remainders = 0;
+        numLeds_ = numLeds;
+        limit_ = DITHER_LIMIT_NONE;
+
+        for (uint16_t ledNr = 0; ledNr < numLeds; ledNr++)
+        {
+            t_LedLinear& lin = linear_[ledNr];
+            lin.r = (gamma_[leds[ledNr].r] * scale) >> 16;
+            lin.g = (gamma_[leds[ledNr].g] * scale) >> 16;
+            lin.b = (gamma_[leds[ledNr].b] * scale) >> 16;
+            sum += lin.r + lin.g + lin.b;
+            remainders |= visibleRemainder(lin.r) | visibleRemainder(lin.g) | visibleRemainder(lin.b);
+        }
+
+        fractional_ = (remainders != 0);
+
+        return sum;
+    }
+
+    /**
+     * True, if the loaded frame has a visible remainder below the 8-bit output codes, i.e. if dithering shows it
+     * differently than rounding. A limited frame is always treated as fractional.
+     */
+    bool fractional() const
+    {
+        return fractional_ || (limit_ != DITHER_LIMIT_NONE);
+    }
+
+    /**
+     * Scales the loaded frame by scale / 65536 when it is quantized, e.g. to keep the current within a budget.
+     */
+    void limit(uint32_t scale)
+    {
+        limit_ = (scale > DITHER_LIMIT_NONE) ? DITHER_LIMIT_NONE : scale;
+    }
+
+    /**
+     * Quantizes the loaded frame to 8 bit. The remainder is added to the next transmission.
+     */
+    void dither(CRGB* out)
+    {
+        for (uint16_t ledNr = 0; ledNr < numLeds_; ledNr++)
+        {
+            out[ledNr].r = quantize(limited(linear_[ledNr].r), error_[ledNr][0]);
+            out[ledNr].g = quantize(limited(linear_[ledNr].g), error_[ledNr][1]);
+            out[ledNr].b = quantize(limited(linear_[ledNr].b), error_[ledNr][2]);
+        }
+    }
+
+    /**
+     * Quantizes the loaded frame to the nearest 8-bit values, e.g. if it is transmitted once per frame only,
+     * where dithering would flicker visibly.
+     */
+    void round(CRGB* out) const
+    {
+        for (uint16_t ledNr = 0; ledNr < numLeds_; ledNr++)
+        {
+            out[ledNr].r = (limited(linear_[ledNr].r) + 128) >> 8;
+            out[ledNr].g = (limited(linear_[ledNr].g) + 128) >> 8;
+            out[ledNr].b = (limited(linear_[ledNr].b) + 128) >> 8;
+        }
+    }
+
+private:
+    uint16_t gamma_[256]; // Linear light of an 8-bit color value (8.8 fixed-point)
+    t_LedLinear linear_[N];
+    uint8_t error_[N][3]; // Remainder of each color channel carried over to the next transmission
+    uint16_t numLeds_ = 0;
+    uint32_t limit_ = DITHER_LIMIT_NONE; // Scale factor of the loaded frame (1/65536)
+    bool fractional_ = false; // The loaded frame has a visible remainder
+
+    /**
+     * Remainder of a linear value below its output code, zero if it is not visible.
+     */
+    static uint16_t visibleRemainder(uint16_t value)
+    {
+        return (value < DITHER_VISIBLE_MAX) ? (value & 0xFF) : 0;
+    }
+
+    /**
+     * Linear value scaled by the limit.
+     */
+    uint16_t limited(uint16_t value) const
+    {
+        return ((uint32_t) value * limit_) >> 16;
+    }
+
+    /**
+     * Output code of an 8.8 value plus the remainder of the previous transmission. Values are at most
+     * 255 * 256, so the sum always fits into 8 bit after the shift.
+     */
+    static uint8_t quantize(uint16_t value, uint8_t& error)
+    {
+        uint16_t sum = value + error;
+        error = sum & 0xFF;
+        return sum >> 8;
+    }
+};
+
+#endif // DITHER_H
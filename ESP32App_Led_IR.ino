@@ -20,9 +20,6 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-// External library: JC_Button, https://github.com/JChristensen/JC_Button
-#include <JC_Button.h>
-
 // External library: FastLED, https://github.com/FastLED/FastLED
 #include <FastLED.h> 
 
@@ -30,84 +27,273 @@
 #include <IRrecv.h> 
 #include <IRremoteESP8266.h>
 
+// ESP32 high resolution timer (microseconds since boot)
+#include <esp_timer.h>
+#include <freertos/semphr.h>
+#include <Preferences.h>
+#include <esp_sleep.h>
+#include <driver/gpio.h>
+#include <driver/uart.h>
+#include <WiFi.h>
+#include <esp_wifi.h>
+
+// Lock-free ring buffer for commands from the input task to the render task
+#include "SpscRing.h"
+
+// Operations on whole led buffers
+#include "PixelKernels.h"
+
+// User commands and keymap of the IR remote control
+#include "Commands.h"
+#include "IrKeymap.h"
+
+// Recording and replay of raw input events
+#include "InputTrace.h"
+
+// Button: debouncing and gestures
+#include "ButtonGestures.h"
+
+// Light effects
+#include "Effect.h"
+#include "Effects.h"
+
+// Histograms for frame timing and latency measurements
+#include "Histogram.h"
+
+// Output stage: gamma correction, 16-bit brightness and temporal dithering
+#include "Dither.h"
+
+// Status LED on its own output, independently of the led strip
+#include "StatusLed.h"
+
+// Realtime pixel streaming via Wi-Fi (DDP, E1.31)
+#include "PixelStream.h"
+
+// Animation clips in flash
+#include "Clips.h"
+
+// Layers of light effects and cross-fades
+#include "Compositor.h"
+
+// Procedural light effects: noise, fire, twinkle
+#include "Procedural.h"
+
+// Synchronization of several lamps
+#include "LampSync.h"
+
+// Control via MQTT and HTTP
+#include "NetControl.h"
+
+// Firmware update via Wi-Fi with rollback
+#include "OtaUpdate.h"
+
 // HW: Pin assignments
 const byte PIN_BUTTON = 39; // M5Stack Atom Lite: internal button
 const byte PIN_LEDATOM = 27; // M5Stack Atom Lite: internel Neopixel LED
 const byte PIN_LEDSTRIP = 26; // M5SAtack Atom Lite: Grove connector GPIO pin (yellow cable) -> Neopixel LED strip
+const byte PIN_LEDSTRIP_2 = 25; // M5Stack Atom Lite: header GPIO pin -> second segment of the led strip (optional)
+const byte PIN_LEDSTRIP_3 = 21; // M5Stack Atom Lite: header GPIO pin -> third segment of the led strip (optional)
+const byte PIN_LEDSTRIP_4 = 22; // M5Stack Atom Lite: header GPIO pin -> fourth segment of the led strip (optional)
 const byte PIN_IRRECV = 32; // M5SAtack Atom Lite: Grove connector GPIO pin (white cable) -> IR Receiver
 
-// HW: Neopixel LED strip number of leds
-const byte NUM_LEDS = 29;
+// HW: Neopixel LED strip number of leds, the active length is read from the configuration at startup
+const uint16_t MAX_LEDS = 600; // Capacity of the led buffer
+const uint16_t NUM_LEDS_DEFAULT = 29; // Active length, if not configured
+
+// HW: The led strip is split into consecutive segments of equal length, one per output pin, transmitted in parallel
+const uint8_t NUM_OUTPUTS_MAX = 4; // Number of output pins available (PIN_LEDSTRIP ... PIN_LEDSTRIP_4)
+const uint8_t NUM_OUTPUTS_DEFAULT = 1; // Number of outputs used, if not configured
+
+// Configuration: non-volatile storage namespace and keys
+const char* const CONFIG_NAMESPACE = "lamp";
+const char* const CONFIG_KEY_NUM_LEDS = "numLeds";
+const char* const CONFIG_KEY_NUM_OUTPUTS = "numOutputs";
+const char* const CONFIG_KEY_POWER_BUDGET = "powerBudget";
+const char* const CONFIG_KEY_SETTINGS = "settings";
+const char* const CONFIG_KEY_WIFI_SSID = "wifiSsid";
+const char* const CONFIG_KEY_WIFI_PASS = "wifiPass";
+const char* const CONFIG_KEY_SYNC_ROLE = "syncRole";
+const char* const CONFIG_KEY_CROSS_FADE_TIME = "crossFade";
+const char* const CONFIG_KEY_MQTT_HOST = "mqttHost";
+const char* const CONFIG_KEY_MQTT_TOPIC = "mqttTopic";
+const char* const CONFIG_KEY_UPDATE_PREFIX = "updatePrefix";
+
+// User settings: saved once they have not changed for this time, i.e. a series of IR commands causes one write only
+const uint32_t SETTINGS_SAVE_DELAY = 5000000; // us
+const uint8_t SETTINGS_VERSION = 1; // Stored settings of another version are ignored
 
 // Type declarations
 enum State {OFF = 0, ON = 1, ECO = 2}; // Main system states
 typedef enum State t_State;
 
-enum LightMode {CONSTANT = 0, GRADIENT = 1, CHASE = 2, SPRITE = 3}; // Light effects for LED strip
-typedef enum LightMode t_LightMode;
+enum FadeCurve {LINEAR = 0, GAMMA = 1}; // Easing curves for brightness transitions
+typedef enum FadeCurve t_FadeCurve;
+
+enum SyncRole {STANDALONE = 1, MASTER = 2, FOLLOWER = 3}; // Role within a group of synchronized lamps
+typedef enum SyncRole t_SyncRole;
+
+// Boot phases: time stamps in us since boot, zero if the phase has not been reached yet
+typedef struct BootTiming {
+    int64_t setupStart = 0; // Entry of setup()
+    int64_t setupDone = 0; // Tasks created
+    int64_t inputReady = 0; // IR receiver enabled, i.e. time to interactive
+    int64_t firstFrame = 0; // First frame rendered
+    int64_t startupDone = 0; // Startup animation finished or skipped
+    int64_t firstCommand = 0; // First command processed
+} t_BootTiming;
+
+// User settings restored after power on, stored as one block in non-volatile storage
+typedef struct Settings {
+    uint8_t version = SETTINGS_VERSION;
+    uint8_t state = 0; // System state, see t_State
+    uint8_t effectNr = 0; // Light mode, i.e. index of the active light effect in the registry
+    uint8_t brightness = 0; // Brightness of the led strip set by the user
+    uint16_t stepTime = 0; // ms, speed of the active light effect
+    bool dirLeft = true; // Direction of the active light effect
+} t_Settings;
+
+// Brightness transition of the led strip, advanced by the frame scheduler by one step per frame
+typedef struct Fade {
+    bool active = false; // Transition is running
+    uint8_t startBr = 0; // Brightness at the start of the transition
+    uint8_t endBr = 0; // Brightness at the end of the transition
+    uint32_t duration = 0; // us, total duration of the transition
+    uint32_t elapsed = 0; // us, time elapsed since the start of the transition
+    t_FadeCurve curve = t_FadeCurve::GAMMA; // Easing curve
+    void (*onDone)() = nullptr; // Called once when the end brightness has been reached
+} t_Fade;
 
-// Simple sprite datatype used for light effects of type "SPRITE"
-typedef struct LedSprite {
-    bool active = false; // Only active sprites are shown on the LED strip
-    int8_t activateAt = -1; // Step at which the sprite shall be activated
-    int8_t pos = 0; // Current position of the sprite, i.e. LED number
-    int8_t vel = 0; // Velocity of the sprite, positive or negative
-    CRGB color = CRGB(255, 255, 255); // Color of the sprite
-} t_LedSprite;
 
 // Switch to receive debug messages via serial monitor
 const bool DEBUG_ON = false;
 
+// Switch to collect frame timing statistics, printed on request via serial monitor (send 's' to print, 'r' to reset)
+// The strip length, the number of outputs, the power budget (mA) and the Wi-Fi network (SSID, password) are configured
+// via serial monitor as well (send e.g. 'n120', 'o2', 'p1500', 'wMyWifi' or 'kSecret'), the ESP32 restarts afterwards
+const bool INSTRUMENTATION_ON = true;
+
+// Switch to show the startup animation after power on (IR remote and button are usable while it is shown)
+const bool STARTUP_ANIMATION_ON = true;
+
 // Status LED: color definitions
 const uint8_t COLOR_OFF[3] = {255, 0, 0}; // System state: OFF
 const uint8_t COLOR_ON[3]  = {0, 255, 0}; // System state: ON
 const uint8_t COLOR_ECO[3] = {0, 255, 0}; // System state: ECO
 
-// Status LED and LED strip: Brightness constants
+// Status LED and LED strip: Brightness constants (status LED: fixed per system state)
 const uint8_t BRIGHTNESS_OFF = 8;  // System state: OFF
 const uint8_t BRIGHTNESS_ON  = 20; // System state: ON
 const uint8_t BRIGHTNESS_ECO = 10; // System state: ECO
 
 const uint8_t BRIGHTNESS_MIN  = 2;  // Lowest brightness
-const uint8_t BRIGHTNESS_MAX  = 50; // Highest brightness --> maximum current
+const uint8_t BRIGHTNESS_MAX  = 50; // Highest brightness --> maximum current, see also the power limiter
 const uint8_t BRIGHTNESS_STEP = 2;  // Increment for brightness adjustement via IR remote
 
-// Light effects: Speed constants
-const uint8_t RENDER_NUM_CYCLES_HOLD_MIN = 2;  // Fastest speed of light effects
-const uint8_t RENDER_NUM_CYCLES_HOLD_MAX = 40; // Slowest speed of light effects
-const uint8_t RENDER_NUM_CYCLES_HOLD_STEP = 2; // Increment for speed adjustment via IR remote
-
-// Light effects: Hue spectrum constants
-const uint16_t RENDER_HUE_MAX = 256; // Maximum hue value of HSV color model (FastLED)
-
-// Light effect "Chase" constants
-const uint8_t RENDER_CHASE_NUM_COLORS = 16; // Number of colors from HSV color spectrum
-const uint8_t RENDER_CHASE_HUE_STEP = RENDER_HUE_MAX / RENDER_CHASE_NUM_COLORS; // Hue increment between two colors
-const uint8_t RENDER_CHASE_NUM_CYCLES_HOLD_INIT = 20; // Default speed
-
-// Light effect "Gradient" constants
-const uint8_t RENDER_GRADIENT_NUM_STEPS = 64; // Number of colors from HSV color spectrum
-const uint8_t RENDER_GRADIENT_HUE_STEP = RENDER_HUE_MAX / RENDER_GRADIENT_NUM_STEPS; // Hue increment between two colors
-const uint8_t RENDER_GRADIENT_NUM_CYCLES_HOLD_INIT = 4; // Default speed
-
-// Light effect "Sprite" constants
-const uint8_t RENDER_SPRITES_NUM_CYCLES_HOLD_INIT = 2; // Default speed
-const uint8_t RENDER_SPRITES_SPAWN_RATE = 30; // Probability in percent that a new sprite is spawned within one cycle
-const int RENDER_SPRITES_NUM_SPRITES_MAX = 10; // Maximum number of sprites
-
-// Time constant, i.e. time after which light effects are updated
-const int TIME_CYCLE = 50; // ms
-
-// IR Commands (values depend on the remote control used)
-const uint64_t IR_ON_OFF         = 0xFF30CF; // Stand-By/ON
-const uint64_t IR_BRIGHTNESS_INC = 0xFFF00F; // Volume +
-const uint64_t IR_BRIGHTNESS_DEC = 0xFF708F; // Volume -
-const uint64_t IR_MODE_CHANGE    = 0xFF28D7; // Mode
-const uint64_t IR_PLAY_PAUSE     = 0xFFA857; // Play/Pause
-const uint64_t IR_SLOWER         = 0xFF10EF; // Slower
-const uint64_t IR_FASTER         = 0xFF6897; // Faster
-const uint64_t IR_LEFT           = 0xFFC03F; // Left
-const uint64_t IR_RIGHT          = 0xFFA05F; // Right
+// Output stage: the leds show the 16-bit brightness on average by toggling between two 8-bit values, if there is
+// time to transmit several times per frame and a dark color channel lies between two 8-bit values
+const bool DITHER_ON = true; // Switch for temporal dithering, otherwise output values are rounded
+const float COLOR_GAMMA = 2.2; // Gamma correction of effect colors
+const uint8_t DITHER_SUBFRAMES_MAX = 4; // Maximum number of transmissions per frame
+const uint8_t DITHER_SUBFRAMES_MIN = 3; // Fewer transmissions per frame would flicker visibly
+const uint16_t DITHER_HOLD_OFF = 50; // Number of frames without dithering after a frame missed its deadline
+
+// Brightness transitions: durations
+const uint16_t FADE_TIME_OFF     = 1000; // ms, fade out when switching off
+const uint16_t FADE_TIME_STARTUP = 500;  // ms, fade out at the end of the startup animation
+const uint16_t FADE_TIME_MODE    = 300;  // ms, fade in of the light mode restored at power on
+
+// Cross-fade between two light modes after a change of the light mode
+const uint16_t CROSS_FADE_TIME_DEFAULT = 1000; // ms, if not configured
+const uint16_t CROSS_FADE_TIME_MAX = 10000; // ms, longest configurable duration
+
+// Frame scheduler: target frame rate, i.e. rate at which inputs are processed and the led strip is updated
+const uint16_t FRAME_RATE = 50; // frames per second
+const uint32_t TIME_FRAME = 1000000UL / FRAME_RATE; // us, period of one frame
+
+// Power limiter: estimated current of the led strip (WS2812B at 5 V), the frame is dimmed if it exceeds the budget
+const uint16_t POWER_MA_PER_CHANNEL = 20; // mA, one color channel of one led at full output
+const uint16_t POWER_MA_IDLE_PER_LED = 1; // mA, one led switched off
+const uint16_t POWER_BUDGET_DEFAULT = 2000; // mA, rating of the power supply, if not configured
+const uint16_t POWER_BUDGET_MAX = 60000; // mA, highest configurable budget
+
+// Output stage: share of a frame which may be used for transmissions, the rest is left for rendering
+const uint32_t DITHER_TIME_BUDGET = TIME_FRAME * 3 / 4; // us
+
+// Idle mode (states OFF and ECO): reduced CPU frequency while nothing changes and, after a longer time, light sleep
+// until the next frame deadline, the IR receiver, the button or the serial monitor wakes the ESP32 up
+// Note: the IR command (or serial input) which wakes the ESP32 from light sleep is lost, the next one is processed
+const bool IDLE_SLEEP_ON = true; // Switch for light sleep in idle mode
+const uint16_t IDLE_FRAMES = 10; // Number of frames without changes until the CPU frequency is reduced
+const uint16_t IDLE_SLEEP_FRAMES = 30 * FRAME_RATE; // Number of frames without changes until light sleep is used
+const uint32_t CPU_FREQ_ACTIVE = 240; // MHz
+const uint32_t CPU_FREQ_IDLE = 80; // MHz, lowest frequency with unchanged APB clock, i.e. RMT, timers and UART
+const uint32_t IDLE_SLEEP_TIME_MIN = 3000; // us, remaining time of a frame for which light sleep pays off
+const uint32_t IDLE_WAKEUP_TIME = 1000; // us, wakeup ahead of the frame deadline
+
+// Frame scheduler: a timer wakes up the render task ahead of the frame deadline, the rest is waited for actively
+const uint32_t FRAME_WAKEUP_LEAD = 50; // us, covers the latency of the timer task and the task switch
+const int IDLE_UART_WAKEUP_THRESHOLD = 3; // Number of edges on the serial input which wake the ESP32 up
+
+// Pixel streaming: frames received via Wi-Fi replace the light effect in the states ON and ECO until the stream stops
+const uint32_t STREAM_TIMEOUT = 2000000; // us, the light effect is resumed, if no frame has been received for this time
+const uint32_t NETWORK_POLL_TIME = 100; // ms, maximum time the network task waits for packets
+const uint32_t NETWORK_CONNECT_RETRY_TIME = 500; // ms, polling period while connecting to the Wi-Fi network
+const uint8_t WIFI_SSID_SIZE = 33; // Maximum SSID length plus terminator
+const uint8_t WIFI_PASS_SIZE = 65; // Maximum password length plus terminator
+
+// Network control: MQTT broker (none: HTTP only) and base topic, polling period of the control task
+const uint8_t MQTT_HOST_SIZE = 65; // Maximum host name length plus terminator
+const uint8_t MQTT_TOPIC_SIZE = 33; // Maximum base topic length plus terminator
+const char* const MQTT_TOPIC_DEFAULT = "lamp";
+const uint32_t CONTROL_POLL_TIME = 10; // ms
+
+// Firmware update: self-check of a new image after its boot, a failed self-check boots the previous image again
+const int64_t OTA_SELF_CHECK_TIME = 10000000; // us after boot
+const uint8_t OTA_SELF_CHECK_LATE_MAX = 10; // Maximum percentage of late frames
+
+// Lamp synchronization: the master broadcasts its state periodically and after each command
+const int64_t SYNC_BEACON_TIME = 100000; // us, period of the beacons
+const uint8_t SYNC_CHANNEL = 1; // Wi-Fi channel of the lamps, if no Wi-Fi network is configured
+const int64_t SYNC_SLEW_MAX = 500; // us, maximum shift of the frame schedule of a follower per frame
+
+// Animation clips: label of the flash data partition holding the clip bank, see partitions.csv
+const char* const CLIP_PARTITION_LABEL = "anim";
+
+// Tasks: core assignment, priorities and stack size (bytes)
+const BaseType_t CORE_RENDER = 1; // Led strip effects and transmission to the leds
+const BaseType_t CORE_INPUT  = 0; // Button and IR receiver
+const UBaseType_t TASK_PRIORITY_RENDER = 1;
+const UBaseType_t TASK_PRIORITY_INPUT  = 2;
+const UBaseType_t TASK_PRIORITY_SHOW   = 3; // Transmission to the leds, on the render core, blocked while the RMT sends
+const UBaseType_t TASK_PRIORITY_NETWORK = 1; // Pixel streaming, on the input core (like the Wi-Fi stack)
+const UBaseType_t TASK_PRIORITY_CONTROL = 1; // MQTT and HTTP, on the input core
+const UBaseType_t TASK_PRIORITY_OTA = 0; // Firmware update, on the input core, shares the time with the idle task
+const uint32_t TASK_STACK_SIZE = 4096;
+const uint32_t TASK_STACK_SIZE_CONTROL = 8192; // MQTT client and HTTP server
+const uint32_t TASK_STACK_SIZE_OTA = 8192; // HTTP client
+
+// Input task: polling period of button and IR receiver, i.e. maximum delay until a complete IR frame is decoded
+const uint32_t INPUT_POLL_TIME = 1; // ms
+
+// Commands: capacity of the ring buffer between input task and render task (power of two)
+const uint16_t COMMAND_RING_SIZE = 16;
+
+// Button: capacity of the ring buffer between its interrupt handler and the input task (power of two)
+const uint16_t BUTTON_EDGE_RING_SIZE = 16;
+
+// Input trace: capacity in events, e.g. about a minute of a held IR key
+const uint16_t TRACE_EVENTS_MAX = 512;
+
+// Input trace: serial requests ('t' followed by the number)
+const uint8_t TRACE_STOP = 0;
+const uint8_t TRACE_RECORD = 1;
+const uint8_t TRACE_REPLAY = 2;
+
+// Instrumentation: number of histogram buckets (powers of two of us, i.e. up to about 0.5 s)
+const uint8_t STATS_NUM_BUCKETS = 20;
+
+// Instrumentation: commands not followed by a changed frame within this time are not counted as latency
+const uint32_t STATS_LATENCY_TIMEOUT = 1000000; // us
 
 // IR receiver library parameters
 const uint16_t IR_BUFFER_SIZE = 1024;
@@ -117,667 +303,2513 @@ const uint8_t IR_MSG_TIMEOUT = 15;
 // Object and variable definitions
 // -----------------------------------------------------------------------------
 
-// Internal button
-Button Btn(PIN_BUTTON);
+// Internal button: edges, debounced by the interrupt handler, to the input task. The state of the debouncing is
+// shared with the level check of the input task.
+SpscRing<t_ButtonEdge, BUTTON_EDGE_RING_SIZE> buttonEdges;
+ButtonDebounce buttonDebounce;
+portMUX_TYPE buttonMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Button gestures (input task)
+ButtonGestures buttonGestures;
 
 // IR receiver
 IRrecv IrRecv(PIN_IRRECV, IR_BUFFER_SIZE, IR_MSG_TIMEOUT, true);
 
-// Buffer for decoded IR command
+// Buffer for decoded IR command (input task)
 decode_results irCmd;
 
-// IR command status
-bool irCmdAvailable = false; // True, if new IR code has been received and decoded
+// Key of the last IR command received and decoded (input task), repetitions refer to this key
+const t_IrKey* irKeyLast = nullptr;
+
+// Commands from the input task (producer) to the render task (consumer)
+SpscRing<t_Command, COMMAND_RING_SIZE> commandRing;
 
-// Last IR command received and decoded
-uint64_t irCmdValue = 0;
+// Recorded or replayed input events (input task)
+InputTrace<TRACE_EVENTS_MAX> inputTrace;
 
-// Internal LED controller
+// Internal LED: color set by the render task, transmitted by the show task when it has changed
 CRGB ledAtom[1];
+StatusLed statusLed;
+
+// LED strip framebuffers: effects render into the back buffer (ledStrip) while the front buffer is loaded into the
+// output stage, which quantizes it into the output buffer for each transmission. Word aligned for the pixel kernels.
+alignas(4) CRGB ledBuffers[2][MAX_LEDS];
+CRGB* ledStrip = ledBuffers[0];
+CRGB* ledFront = ledBuffers[1];
+alignas(4) CRGB ledOutput[MAX_LEDS];
+TemporalDither<MAX_LEDS> ledDither;
+
+// LED strip controllers, one per output: only the first numLeds leds are rendered and transmitted
+CLEDController* ledStripCtrl[NUM_OUTPUTS_MAX] = {};
+uint16_t numLeds = NUM_LEDS_DEFAULT;
+uint8_t numOutputs = NUM_OUTPUTS_DEFAULT;
+
+// Pixel streaming: Wi-Fi network, network task started (SSID configured)
+char wifiSsid[WIFI_SSID_SIZE] = "";
+char wifiPass[WIFI_PASS_SIZE] = "";
+bool networkOn = false;
+
+// Network control: MQTT broker and base topic, requests from the control task to the render task
+char mqttHost[MQTT_HOST_SIZE] = "";
+char mqttTopic[MQTT_TOPIC_SIZE] = "";
+NetControl netControl;
+
+// Firmware update: download by the update task, reboot by the input task once the image is ready. The input task
+// requests the final settings from the render task, which hands them over like any other settings to be saved.
+OtaUpdate otaUpdate;
+volatile bool otaRebootRequested = false; // Final settings requested (input task), handed over (render task)
+bool otaRebooting = false; // Reboot started, waiting for the final settings (input task)
+bool otaCheckPending = false; // New image, self-check not passed yet (input task)
+char updatePrefix[OTA_URL_SIZE] = ""; // Requests via MQTT or HTTP need a URL with this prefix (none: serial monitor only)
+
+// Pixel streaming: receive buffers, exchanged with the back buffer of the render task for each frame
+alignas(4) CRGB streamBuffers[2][MAX_LEDS];
+PixelStream<MAX_LEDS> pixelStream;
+
+// Pixel streaming: frames of the stream are shown instead of the light effect (render task)
+bool streamActive = false;
+
+// Animation clips: mapped flash partition, played by the clip effect
+ClipBank clipBank;
+
+// Lamp synchronization: role of this lamp, ESP-NOW transport and shared clock
+t_SyncRole syncRole = t_SyncRole::STANDALONE;
+LampSync lampSync;
+
+// Lamp synchronization: latest state of the master, beacons of the master are being received (follower, render task)
+t_SyncState syncState;
+bool syncFollowing = false;
+
+// Lamp synchronization: deviation of the frame schedule from the master before correction (us, follower)
+int32_t syncPhaseError = 0;
+
+// Lamp synchronization: time of the latest beacon, a beacon is sent with the next frame (master, render task)
+int64_t syncBeaconAt = 0;
+bool syncBeaconDue = false;
+
+// Power limiter: budget of the led strip (mA), estimated current of the frame shown last (mA, written by show task)
+uint16_t powerBudget = POWER_BUDGET_DEFAULT;
+volatile uint16_t powerCurrent = 0;
+
+// Power limiter: number of frames dimmed to stay within the budget (written by show task)
+volatile uint32_t framesPowerLimited = 0;
+
+// Show task: transmits a frame on request of the render task and notifies it, once the front buffer has been loaded
+TaskHandle_t renderTaskHandle = nullptr;
+
+// Frame scheduler: one-shot timer given to the render task at the frame deadline (the task notification of the
+// render task is used by the show task)
+esp_timer_handle_t frameTimer = nullptr;
+SemaphoreHandle_t frameTimerDone = nullptr;
+TaskHandle_t showTaskHandle = nullptr;
+bool showInFlight = false; // Frame handed over and front buffer not yet released (render task)
+volatile bool showRequested = false; // Frame handed over, not yet taken by the show task
+
+// Show task: brightness values, status LED color and latency start (0: none) handed over with the front buffer,
+// parts to be transmitted (led strip, status LED)
+uint16_t showBrightnessStrip = 0;
+uint8_t showBrightnessAtom = BRIGHTNESS_OFF;
+CRGB showColorAtom;
+int64_t showLatencyStart = 0;
+bool showStrip = false;
+bool showAtom = false;
+
+// Output stage: dithering allowed by the render task, i.e. it keeps its deadlines (written by render task)
+volatile bool ditherAllowed = DITHER_ON;
+
+// Output stage: number of transmissions of the current frame (written by show task)
+volatile uint8_t ditherSubframes = 1;
+
+// Output stage: the previous frame was dithered (render task)
+bool ditherShown = false;
+
+// Output stage: remaining number of frames without dithering, because a frame missed its deadline (render task)
+uint16_t ditherHoldOff = 0;
+
+// Show task: transmitting the frame handed over last (written by show task)
+volatile bool showBusy = false;
+
+// Idle mode: something has been shown or a command has been received within the current frame (render task)
+bool frameChanged = false;
+
+// Idle mode: number of consecutive frames without changes, reduced CPU frequency active (render task)
+uint16_t framesStatic = 0;
+bool idleMode = false;
+
+// Idle mode: number of light sleeps, number of wakeups by an input (render task)
+uint32_t idleSleeps = 0;
+uint32_t idleWakeups = 0;
+
+// Light effects, statically allocated
+EffectConstant effectConstant;
+EffectGradient effectGradient;
+EffectChase effectChase;
+EffectSprite effectSprite;
+EffectClip<MAX_LEDS> effectClip(clipBank);
+
+// Light effect made of layers: sprites added to a gradient, the layers are instances of their own
+EffectGradient layerGradient;
+EffectSprite layerSprites;
+EffectLayers<MAX_LEDS, 2> effectSpritesOnGradient("Layered", RENDER_SPRITES_STEP_TIME_INIT);
+
+// Procedural light effects, their state is kept per led
+EffectNoise<MAX_LEDS> effectNoise;
+EffectFire<MAX_LEDS> effectFire;
+EffectTwinkle<MAX_LEDS> effectTwinkle;
+
+// Registry of light effects, the "Mode" key cycles through them in this order, skipping those not available
+Effect* const EFFECTS[] = {&effectConstant, &effectGradient, &effectChase, &effectSprite, &effectClip,
+    &effectSpritesOnGradient, &effectNoise, &effectFire, &effectTwinkle};
+const uint8_t NUM_EFFECTS = sizeof(EFFECTS) / sizeof(EFFECTS[0]);
 
-// LED strip controller
-CRGB ledStrip[NUM_LEDS];
+// Startup animation, shown while the system is switched off after power on
+EffectStartup effectStartup;
+bool startupActive = false;
 
-// Sprite buffer
-t_LedSprite sprites[RENDER_SPRITES_NUM_SPRITES_MAX];
+// Boot phase timing
+t_BootTiming bootTiming;
+
+// User settings: last change not yet saved and its time (render task)
+t_Settings settingsPending;
+int64_t settingsChangedAt = 0;
+bool settingsDirty = false;
+
+// User settings: handed over by the render task to be written by the input task, i.e. outside of the frame loop.
+// settingsToSave and settingsFinal are only written by the render task while settingsSaveRequested is not set.
+t_Settings settingsToSave;
+volatile bool settingsFinal = false; // Settings before the reboot of a firmware update
+volatile bool settingsSaveRequested = false;
 
 // System state
 t_State state = t_State::OFF;
 
-// Light mode
-t_LightMode lightMode = t_LightMode::CHASE;
-uint8_t renderCyclesHold = RENDER_CHASE_NUM_CYCLES_HOLD_INIT;
+// Light mode, i.e. index of the active light effect in the registry
+uint8_t effectNr = 2; // Chase
+
+// Light mode shown, including the cross-fade after a change (render task)
+Compositor<MAX_LEDS, 1> compositor;
+uint16_t crossFadeTime = CROSS_FADE_TIME_DEFAULT; // ms
+
+// Frame scheduler: start time of the current frame, deadline of the next frame (us since boot)
+int64_t frameStart = 0;
+int64_t frameDeadline = 0;
 
-// Cycle counter for led strip effects
-int cycleNr = 0;
+// Frame scheduler: measured duration of the previous frame (us)
+uint32_t frameTime = TIME_FRAME;
 
-// Base hue for led strip effects
-uint8_t hueBase = 0;
+// Frame scheduler: number of frames rendered, number of frames which missed their deadline
+uint32_t frameNr = 0;
+uint32_t framesLate = 0;
 
-// Brightness factor for LED strip
+// Brightness factor for LED strip (set by the user)
 uint8_t brightness = BRIGHTNESS_OFF;
 
+// Brightness factor transmitted to the LED strip in 16 bit (user brightness times 257), i.e. user brightness modified
+// by a running transition
+uint16_t brightnessStrip = 0;
+
+// Brightness factor of the status LED
+uint8_t brightnessAtom = BRIGHTNESS_OFF;
+
+// Brightness transition of the LED strip
+t_Fade fade;
+
 // Refresh of LED strip needed
 bool refreshNeeded = false;
 
-// Color effect paused
-bool paused   = false;
+// A new frame has been drawn into the back buffer since the last call of showLeds()
+bool frameRendered = false;
+
+// Refresh of status LED needed, i.e. system state has changed
+bool atomRefreshNeeded = false;
+
+// Change detection: hash of the frame transmitted last
+uint32_t frameHashShown = 0;
+
+// Change detection: number of frames not transmitted because they were identical to the previous one
+uint32_t framesSkipped = 0;
+
+// Instrumentation: histograms of durations (us), written by the render task (show: show task, decoding: input task)
+// and read by the input task, every access is guarded by statsMux (see recordStats())
+typedef Histogram<STATS_NUM_BUCKETS> t_TimeHistogram;
+
+t_TimeHistogram statsFrameTime; // Period between the start of two frames
+t_TimeHistogram statsFrameLoad; // Processing time of a frame, i.e. without waiting for the next frame
+t_TimeHistogram statsRenderTime; // Update and render of the light effect
+t_TimeHistogram statsShowTime; // Transmission to the led strip
+t_TimeHistogram statsDecodeTime; // Decoding of a received IR frame
+t_TimeHistogram statsLatency; // Reception of a command until the first changed frame has been transmitted
 
-// Color effect direction
-bool dirLeft  = true;
+// Instrumentation: reception time of the oldest command not yet followed by a changed frame
+int64_t statsLatencyStart = 0;
+bool statsLatencyPending = false;
+
+// Instrumentation: reset of all statistics requested via serial monitor, executed by the render task
+volatile bool statsResetRequested = false;
+portMUX_TYPE statsMux = portMUX_INITIALIZER_UNLOCKED;
 
 /**
- * Let the Led library show the set colors.
+ * Instrumentation: counts a value in a histogram. Called by the task which measured it.
  */
-void showLeds()
+void recordStats(t_TimeHistogram& hist, uint32_t value)
 {
-    FastLED.show();
-    refreshNeeded = false;
+    portENTER_CRITICAL(&statsMux);
+    hist.record(value);
+    portEXIT_CRITICAL(&statsMux);
 }
 
 /**
- * Led strip effect: Constant white light e.g. for reading.
+ * Frame scheduler: marks the start of a new frame and measures the time elapsed since the previous one.
  */
-void renderConstant()
+void beginFrame()
 {
-    // Do something only if there is a reason for refreshing such as changed brightness.
-    if (refreshNeeded)
+    int64_t now = esp_timer_get_time();
+    frameTime = (uint32_t) (now - frameStart);
+    frameStart = now;
+
+    // Dithering takes processing time from rendering, it is allowed again after a while without missed deadlines.
+    // In idle mode, frames are transmitted only once, i.e. rounded.
+    if (ditherHoldOff > 0)
     {
-        // Update color of each LED 
-        for (int ledNr = 0; ledNr < NUM_LEDS; ledNr++)
-        {
-            // Update color of the current LED to white.
-            ledStrip[ledNr].setHSV(0, 0, 255);
-        }
-    
-        showLeds();
+        ditherHoldOff--;
+    }
+
+    ditherAllowed = DITHER_ON && (ditherHoldOff == 0) && !idleMode && !otaUpdate.active();
+
+    if (INSTRUMENTATION_ON)
+    {
+        recordStats(statsFrameTime, frameTime);
     }
 }
 
 /**
- * Led strip effect: All leds have the same color.
- * The color cycles through the HSV spectrum according to the set speed.
+ * Frame scheduler: waits until the deadline of the next frame. Deadlines advance in fixed steps of
+ * TIME_FRAME, so the time spent in the loop body is compensated. If a frame overran by more than a
+ * whole period, the schedule is re-synchronized instead of rendering a burst of catch-up frames.
  */
-void renderGradient()
+void waitForNextFrame()
 {
-    // Update colors every n cycles (i.e. n procedure calls). Do not update colors if paused by user.
-    if (cycleNr == 0 && !paused)
+    frameDeadline += TIME_FRAME + syncFrameCorrection();
+
+    int64_t now = esp_timer_get_time();
+
+    if (now >= frameDeadline)
     {
-        refreshNeeded = true;
-        
-        // Update each color of each LED 
-        for (int ledNr = 0; ledNr < NUM_LEDS; ledNr++)
+        framesLate++;
+        ditherHoldOff = DITHER_HOLD_OFF;
+
+        if (now - frameDeadline >= TIME_FRAME)
         {
-            // Update color of the current LED
-            ledStrip[ledNr].setHSV(hueBase, 255, 255);
+            frameDeadline = now;
         }
 
-        // Cycle through color spectrum    
-        hueBase += RENDER_GRADIENT_HUE_STEP;
+        return;
     }
 
-    // Show in case something has changed such as brightness or colors
-    if (refreshNeeded)
+    int64_t remaining = frameDeadline - now;
+
+    // Light sleep would drop the Wi-Fi connection and the packets of other lamps
+    if (remaining > IDLE_SLEEP_TIME_MIN && framesStatic >= IDLE_SLEEP_FRAMES && IDLE_SLEEP_ON && !showBusy && !networkOn &&
+        syncRole == t_SyncRole::STANDALONE)
     {
-        showLeds();
+        lightSleep(remaining - IDLE_WAKEUP_TIME);
     }
 
-    // Increase the cycle number after each procedure call
-    cycleNr = (cycleNr + 1) % renderCyclesHold;
+    waitUntil(frameDeadline);
 }
 
 /**
- * Led strip effect: Each led shows a successive color of the color spectrum.
- * Colors move over time according to the set direction and set speed.
+ * Frame scheduler: blocks the render task until the given time (us). The frame timer wakes it up shortly before,
+ * i.e. the CPU is only kept busy for the last FRAME_WAKEUP_LEAD us.
  */
-void renderChase()
+void waitUntil(int64_t deadline)
 {
-    // Update colors every n cycles (i.e. n procedure calls). Do not update colors if paused by user.
-    if (cycleNr == 0 && !paused)
-    {
-        refreshNeeded = true;
-      
-        // Color of first LED
-        uint8_t hueLed = hueBase;
-                
-        // Update each color of each LED 
-        for (int ledNr = 0; ledNr < NUM_LEDS; ledNr++)
-        {
-            // Update color of the current LED
-            ledStrip[ledNr].setHSV(hueLed, 255, 255);
-    
-            // Color of next LED
-            hueLed += RENDER_CHASE_HUE_STEP;
-        }
+    int64_t remaining = deadline - esp_timer_get_time();
 
-        // Cycle through color spectrum depending on the direction set by the user
-        if (dirLeft)
-        {
-            hueBase += RENDER_CHASE_HUE_STEP;
-        }
-        else
-        {
-            hueBase -= RENDER_CHASE_HUE_STEP;
-        }
-    }
-
-    // Show in case something has changed such as brightness or colors
-    if (refreshNeeded)
+    if (remaining > FRAME_WAKEUP_LEAD)
     {
-        showLeds();
+        esp_timer_start_once(frameTimer, remaining - FRAME_WAKEUP_LEAD);
+        xSemaphoreTake(frameTimerDone, portMAX_DELAY);
     }
 
-    // Increase the cycle number after each procedure call
-    cycleNr = (cycleNr + 1) % renderCyclesHold;
+    while (esp_timer_get_time() < deadline) {}
 }
 
 /**
- * Led strip effect: Sprites appear randomly in the middle of the led strip, move either to the left or right
- * and vanish at the border of the led strip. User can adjust the speed.
+ * Frame scheduler: callback of the frame timer, executed by the timer task.
  */
-void renderSprite()
+void onFrameTimer(void* arg)
 {
-    // Update colors every n cycles (i.e. n procedure calls). Do not update colors if paused by user.
-    if (cycleNr == 0 && !paused)
-    {
-        refreshNeeded = true;
+    xSemaphoreGive(frameTimerDone);
+}
 
-        // Generate a new sprite randomly
-        if (random(0, 100) < RENDER_SPRITES_SPAWN_RATE)
-        {
-            t_LedSprite sp;
-            sp.active = true;
-            sp.activateAt = -1;
-            sp.pos = NUM_LEDS / 2;
-            sp.vel = 2 * random(0, 2) - 1;
-            sp.color = CHSV(random(0, 255), random(128, 255), random(128, 255));
+/**
+ * Idle mode: enters light sleep for the given duration (us) or until the IR receiver or the button become active
+ * or data is received via serial monitor. The led strip keeps showing the frame transmitted last.
+ */
+void lightSleep(uint32_t duration)
+{
+    esp_sleep_enable_timer_wakeup(duration);
+    gpio_wakeup_enable((gpio_num_t) PIN_IRRECV, GPIO_INTR_LOW_LEVEL);
+    gpio_wakeup_enable((gpio_num_t) PIN_BUTTON, GPIO_INTR_LOW_LEVEL);
+    esp_sleep_enable_gpio_wakeup();
+    uart_set_wakeup_threshold(UART_NUM_0, IDLE_UART_WAKEUP_THRESHOLD);
+    esp_sleep_enable_uart_wakeup(UART_NUM_0);
+
+    esp_light_sleep_start();
+    idleSleeps++;
+
+    // GPIO wakeup replaces the interrupt type: edges for the IR receiver and the button
+    gpio_wakeup_disable((gpio_num_t) PIN_IRRECV);
+    gpio_wakeup_disable((gpio_num_t) PIN_BUTTON);
+    gpio_set_intr_type((gpio_num_t) PIN_IRRECV, GPIO_INTR_ANYEDGE);
+    gpio_set_intr_type((gpio_num_t) PIN_BUTTON, GPIO_INTR_ANYEDGE);
+
+    // Stay awake after an input, so that the following IR commands are received
+    if (esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_TIMER)
+    {
+        idleWakeups++;
+        framesStatic = 0;
+    }
+}
 
-            // Insert the new sprite a free position of the sprite array
-            for (int i = 0; i < RENDER_SPRITES_NUM_SPRITES_MAX; i++)
-            {
-                if (sprites[i].active == false)
-                {
-                    sprites[i] = sp;
-                    break;
-                }
-            }
-        }
+/**
+ * Idle mode: counts the frames without changes in the states OFF and ECO and switches the CPU frequency.
+ */
+void updateIdleMode()
+{
+    bool quiet = !frameChanged && !fade.active && !startupActive && (state != t_State::ON);
 
-        // Draw and update all active sprites
-        drawAndUpdateSprites(0);
+    if (!quiet)
+    {
+        framesStatic = 0;
+    }
+    else if (framesStatic < IDLE_SLEEP_FRAMES)
+    {
+        framesStatic++;
     }
 
-    if (refreshNeeded)
+    bool idle = (framesStatic >= IDLE_FRAMES);
+
+    if (idle != idleMode)
     {
-        showLeds();
+        idleMode = idle;
+        setCpuFrequencyMhz(idle ? CPU_FREQ_IDLE : CPU_FREQ_ACTIVE);
     }
 
-    // Increase the cycle number after each procedure call
-    cycleNr = (cycleNr + 1) % renderCyclesHold;
+    frameChanged = false;
 }
 
 /**
- * Fade brightness from start value to end value with a defined delay after each step.
+ * Change detection: FNV-1a hash of all led colors of a framebuffer and of the brightness, i.e. of everything
+ * transmitted to the led strip.
  */
-void fadeBrightness(uint8_t startBr, uint8_t endBr, uint16_t stepDelay)
+uint32_t frameHash(const CRGB* leds, uint16_t br)
 {
-    int8_t brStep;
-    uint8_t numSteps;
+    const uint32_t FNV_PRIME = 16777619UL;
+    uint32_t hash = 2166136261UL;
 
-    // Determine increment and number of steps
-    if (startBr <= endBr)
+    const uint8_t* data = (const uint8_t*) leds;
+
+    for (uint16_t i = 0; i < numLeds * sizeof(CRGB); i++)
     {
-        brStep = 1;
-        numSteps = endBr - startBr + 1;
+        hash = (hash ^ data[i]) * FNV_PRIME;
     }
-    else
+
+    hash = (hash ^ (br & 0xFF)) * FNV_PRIME;
+    hash = (hash ^ (br >> 8)) * FNV_PRIME;
+
+    return hash;
+}
+
+/**
+ * Let the Led library show the output buffer on all outputs of the led strip. The brightness has already been
+ * applied by the output stage. The ESP32 driver of FastLED starts transmitting once every controller has been
+ * handed its data and then clocks out all of them in parallel, one RMT channel each. The status LED is not one of
+ * these controllers, see StatusLed. Called by the show task, which is blocked by the driver until the transmission
+ * is complete. Returns the duration of the transmission (us).
+ */
+uint32_t transmitLeds(int64_t latencyStart)
+{
+    int64_t showStart = esp_timer_get_time();
+
+    for (uint8_t outputNr = 0; outputNr < numOutputs; outputNr++)
     {
-        brStep = -1;
-        numSteps = startBr - endBr + 1;
+        ledStripCtrl[outputNr]->showLeds(255);
     }
 
-    uint8_t curBr = startBr;
+    int64_t showEnd = esp_timer_get_time();
 
-    // Change the brightness gradually    
-    for (uint8_t i = 0; i < numSteps; i++)
+    if (INSTRUMENTATION_ON)
     {
-        FastLED.setBrightness(curBr);
-        FastLED.show();
-        delay(stepDelay);
-        curBr += brStep;
+        recordStats(statsShowTime, (uint32_t) (showEnd - showStart));
+
+        if (latencyStart != 0)
+        {
+            recordStats(statsLatency, (uint32_t) (showEnd - latencyStart));
+        }
     }
+
+    return (uint32_t) (showEnd - showStart);
 }
 
 /**
- * Sets led colors according to positions of all active sprites in the sprite list.
- * Updates the sprites in the sprite list e.g. according to their velocity.
+ * Power limiter: scale factor (1/65536) which keeps the estimated current of a frame within the power budget.
+ * The sum of all color channels (8.8 fixed-point) is computed by the output stage while loading the frame.
  */
-void drawAndUpdateSprites(uint32_t stepNr)
+uint32_t powerLimit(uint32_t sum)
 {
-    clearLedStrip();
+    uint32_t idle = (uint32_t) POWER_MA_IDLE_PER_LED * numLeds;
 
-    // Update sprites
-    for (int k = 0; k < RENDER_SPRITES_NUM_SPRITES_MAX; k++)
+    if (powerBudget <= idle)
     {
-        // Activate sprites based on current step number
-        if (sprites[k].activateAt == stepNr)
-            sprites[k].active = true;
-
-        if (sprites[k].active)
-        {
-            // Set led colors based on active sprites
-            if (sprites[k].pos >= 0 && sprites[k].pos < NUM_LEDS)
-                ledStrip[sprites[k].pos] = sprites[k].color;
+        powerCurrent = idle;
+        return 0;
+    }
 
-            // Move sprites
-            sprites[k].pos += sprites[k].vel;
+    // Current of the color channels and budget left for them, both in 1 / (255 * 256) mA
+    uint64_t current = (uint64_t) sum * POWER_MA_PER_CHANNEL;
+    uint64_t budget = (uint64_t) (powerBudget - idle) * (255 * 256);
 
-            // Deactivate sprites that moved outside the led strip
-            if (sprites[k].pos < 0 || sprites[k].pos >= NUM_LEDS)
-                sprites[k].active = false;
-        }
+    if (current <= budget)
+    {
+        powerCurrent = idle + current / (255 * 256);
+        return DITHER_LIMIT_NONE;
     }
+
+    framesPowerLimited++;
+    powerCurrent = powerBudget;
+
+    return (uint32_t) (budget * DITHER_LIMIT_NONE / current);
 }
 
 /**
- * Set all led colors to black.
+ * Waits until the show task has loaded the front buffer into the output stage, i.e. it may be modified again.
  */
-void clearLedStrip()
+void waitForShow()
 {
-    // Clear all sprites
-    for (int ledNr = 0; ledNr < NUM_LEDS; ledNr++)
+    if (showInFlight)
     {
-        // Update color of the current LED
-        ledStrip[ledNr] = CRGB(0, 0, 0);
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        showInFlight = false;
     }
 }
 
 /**
- * Show an animtion at startup using the sprite functionlity.
+ * Makes the back buffer the front buffer and vice versa. Must not be called before the show task has released
+ * the front buffer.
  */
-void startupAnimation()
+void swapBuffers()
 {
-    // Define a set of sprites
-    sprites[0].active = true;
-    sprites[0].activateAt = 0;
-    sprites[0].pos = NUM_LEDS / 2;
-    sprites[0].vel = 0;
-    sprites[0].color = CRGB(255, 255, 0);
-    
-    sprites[1].active = false;
-    sprites[1].activateAt = 5;
-    sprites[1].pos = NUM_LEDS / 2 - 1;
-    sprites[1].vel = -1;
-    sprites[1].color = CRGB(32, 32, 128);
-    
-    sprites[2].active = false;
-    sprites[2].activateAt = 5;
-    sprites[2].pos = NUM_LEDS / 2 + 1;
-    sprites[2].vel = +1;
-    sprites[2].color = CRGB(32, 32, 128);
-    
-    sprites[3].active = false;
-    sprites[3].activateAt = 10;
-    sprites[3].pos = NUM_LEDS / 2 - 1;
-    sprites[3].vel = -1;
-    sprites[3].color = CRGB(128, 0, 0);
-    
-    sprites[4].active = false;
-    sprites[4].activateAt = 10;
-    sprites[4].pos = NUM_LEDS / 2 + 1;
-    sprites[4].vel = +1;
-    sprites[4].color = CRGB(128, 0, 0);
-
-    sprites[5].active = false;
-    sprites[5].activateAt = 15;
-    sprites[5].pos = NUM_LEDS / 2 - 1;
-    sprites[5].vel = -1;
-    sprites[5].color = CRGB(0, 128, 0);
-    
-    sprites[6].active = false;
-    sprites[6].activateAt = 15;
-    sprites[6].pos = NUM_LEDS / 2 + 1;
-    sprites[6].vel = +1;
-    sprites[6].color = CRGB(0, 128, 0);
+    CRGB* rendered = ledStrip;
+    ledStrip = ledFront;
+    ledFront = rendered;
+}
+
+/**
+ * Hands the frame over to the show task, which transmits it while the render task continues with the next frame.
+ * A newly rendered back buffer becomes the front buffer, otherwise the front buffer is transmitted again, e.g.
+ * with a new brightness. The led strip is only transmitted, if the frame has changed since it was shown last, and
+ * the status LED only, if it has been changed by setStatusLed(). Dithered frames are never skipped, because the
+ * leds show their average only.
+ */
+void showLeds()
+{
+    const CRGB* leds = frameRendered ? ledStrip : ledFront;
+    uint32_t hash = frameHash(leds, brightnessStrip);
+    bool dither = (ditherSubframes > 1) && (brightnessStrip > 0);
+    bool stripChanged = (hash != frameHashShown) || dither || ditherShown;
+
+    if (stripChanged || atomRefreshNeeded)
+    {
+        waitForShow();
+
+        if (frameRendered && stripChanged)
+        {
+            swapBuffers();
+        }
+
+        showStrip = stripChanged;
+        showAtom = atomRefreshNeeded;
+
+        showColorAtom = ledAtom[0];
+        showBrightnessStrip = brightnessStrip;
+        showBrightnessAtom = brightnessAtom;
+
+        // Latency: measured up to the transmission of the led strip, only once per command
+        showLatencyStart = 0;
 
-    // Do the sprite animation
-    for (int stepNr = 0; stepNr < 30; stepNr++)
+        if (INSTRUMENTATION_ON && statsLatencyPending && stripChanged)
+        {
+            showLatencyStart = statsLatencyStart;
+            statsLatencyPending = false;
+        }
+
+        frameChanged = frameChanged || (hash != frameHashShown) || atomRefreshNeeded;
+        frameHashShown = hash;
+        atomRefreshNeeded = false;
+        ditherShown = dither;
+        showInFlight = true;
+        showRequested = true;
+        xTaskNotifyGive(showTaskHandle);
+    }
+    else
     {
-        drawAndUpdateSprites(stepNr);
-        FastLED.show();
-        delay(100);
+        framesSkipped++;
     }
 
-    // Fade out
-    fadeBrightness(brightness, 0, 50);
+    frameRendered = false;
+    refreshNeeded = false;
+}
 
-    // Invalidate all sprites and clear led strip
-    clearSprites();
-    clearLedStrip();
+/**
+ * Sets color and brightness of the status LED, which is transmitted by the show task at the end of the frame.
+ */
+void setStatusLed(const uint8_t color[3], uint8_t br)
+{
+    ledAtom[0].setRGB(color[0], color[1], color[2]);
+    brightnessAtom = br;
+    atomRefreshNeeded = true;
+}
 
-    // Reset led strip to its actual brightness
-    FastLED.setBrightness(brightness);
-    FastLED.show();
+/**
+ * Start a brightness transition from start value to end value with a defined duration (ms).
+ * The transition is advanced by updateFade() once per frame, i.e. it does not block the main loop.
+ * The optional function onDone is called once the end value has been reached.
+ */
+void startFade(uint8_t startBr, uint8_t endBr, uint16_t duration, t_FadeCurve curve, void (*onDone)())
+{
+    fade.active = true;
+    fade.startBr = startBr;
+    fade.endBr = endBr;
+    fade.duration = (uint32_t) duration * 1000;
+    fade.elapsed = 0;
+    fade.curve = curve;
+    fade.onDone = onDone;
+
+    brightnessStrip = brightness16(startBr);
+    refreshNeeded = true;
 }
 
 /**
- * Helper function that invalidates all sprites in the sprite array.
+ * Cancel a running brightness transition. The function onDone is not called.
  */
-void clearSprites()
+void stopFade()
 {
-    // Set all sprites to inactive
-    for (int i = 0; i < RENDER_SPRITES_NUM_SPRITES_MAX; i++)
-    {
-        sprites[i].active = false;
-        sprites[i].activateAt = -1;
-    }
+    fade.active = false;
 }
 
-// -----------------------------------------------------------------------------
-// Setup routine
-// -----------------------------------------------------------------------------
+/**
+ * 16-bit brightness of the led strip (0 ... 65535) corresponding to a brightness of 0 ... 255.
+ */
+uint16_t brightness16(uint8_t br)
+{
+    return (uint16_t) br * 257;
+}
 
-void setup()
+/**
+ * 16-bit brightness of the running transition according to the time elapsed and the easing curve. The output
+ * stage shows intermediate values between two 8-bit brightness levels, so low brightness fades do not step.
+ */
+uint16_t fadeBrightness()
 {
-    delay(1000);
-    
-    if (DEBUG_ON)
+    if (fade.elapsed >= fade.duration)
     {
-        Serial.begin(115200);
-        Serial.print("RENDER_HUE_MAX = ");
-        Serial.println(RENDER_HUE_MAX);
-        Serial.print("RENDER_CHASE_HUE_STEP = ");
-        Serial.println(RENDER_CHASE_HUE_STEP);
-        Serial.print("RENDER_GRADIENT_HUE_STEP = ");
-        Serial.println(RENDER_GRADIENT_HUE_STEP);
+        return brightness16(fade.endBr);
     }
-  
-    Btn.begin();  // initialize the button object
-    
-    FastLED.addLeds<NEOPIXEL, PIN_LEDATOM>(ledAtom, 1);
-    FastLED.addLeds<NEOPIXEL, PIN_LEDSTRIP>(ledStrip, NUM_LEDS);
-    FastLED.clear();
-    FastLED.setBrightness(brightness);
-    ledAtom[0].setRGB(COLOR_OFF[0], COLOR_OFF[1], COLOR_OFF[2]);
-    FastLED.show();
-
-    startupAnimation();
-    
-    IrRecv.enableIRIn(); // Switch on IR receiver after initialization
-}
 
-// -----------------------------------------------------------------------------
-// Main routine
-// -----------------------------------------------------------------------------
+    // Progress of the transition: 0 ... 1
+    float progress = (float) fade.elapsed / fade.duration;
 
-void loop() {
+    float startVal = brightness16(fade.startBr);
+    float endVal = brightness16(fade.endBr);
 
-    /* ---------- Process power on/off commands ---------- */
-    
-    // Read the button state
-    Btn.read();
+    // Gamma corrected: interpolate the perceived brightness, approximated by the square root of the led brightness
+    if (fade.curve == t_FadeCurve::GAMMA)
+    {
+        startVal = sqrtf(startVal * 65535);
+        endVal = sqrtf(endVal * 65535);
+    }
 
-    bool irCmdOnOff = false;
+    float curVal = startVal + (endVal - startVal) * progress;
 
-    // Determine the IR command state
-    irCmdAvailable = IrRecv.decode(&irCmd);
+    if (fade.curve == t_FadeCurve::GAMMA)
+    {
+        curVal = curVal * curVal / 65535;
+    }
+
+    return (uint16_t) (curVal + 0.5f);
+}
 
-    if (irCmdAvailable)
+/**
+ * Advance a running brightness transition by the duration of the current frame.
+ */
+void updateFade()
+{
+    if (!fade.active)
     {
-        if (irCmd.repeat) // Is it a repetition of the previous IR command?
-        {
-            // Is repetition of the previous command allowed?
-            bool irCmdRepeatable = (irCmdValue == IR_BRIGHTNESS_DEC) || (irCmdValue == IR_BRIGHTNESS_INC) ||
-                 (irCmdValue == IR_SLOWER) || (irCmdValue == IR_FASTER);
+        return;
+    }
 
-            if (!irCmdRepeatable)
-            {
-                irCmdAvailable = false;
-                irCmdValue = 0x0;
-            }
-        }
-        else {
-            // No repetition: retrieve the IR command
-            irCmdValue = irCmd.value;
-            irCmdOnOff = (irCmdValue == IR_ON_OFF);
-        }
-        
-        IrRecv.resume();
+    fade.elapsed += frameTime;
 
-        if (DEBUG_ON)
+    brightnessStrip = fadeBrightness();
+    refreshNeeded = true;
+
+    if (fade.elapsed >= fade.duration)
+    {
+        fade.active = false;
+
+        if (fade.onDone != nullptr)
         {
-            Serial.print("IR: ");
-            Serial.println((unsigned long) irCmd.value, HEX);
+            fade.onDone();
         }
     }
-    
-    // Process events "button released" or "IR on/off" respectively
-    if (Btn.wasReleased() || irCmdOnOff)
-    {
-        switch (state)
-        {
-            case t_State::OFF:
-                if (DEBUG_ON)
-                    Serial.println("Switching to state 'ON'");
-                
-                // Switch on
-                state = t_State::ON;
+}
 
-                FastLED.clear();
-                brightness = BRIGHTNESS_ON;
-                FastLED.setBrightness(brightness);
-                ledAtom[0].setRGB(COLOR_ON[0], COLOR_ON[1], COLOR_ON[2]);
+/**
+ * Called at the end of the fade out when switching off: clears the led strip and sets the status led.
+ */
+void switchOffLeds()
+{
+    clearLedStrip();
+    brightness = BRIGHTNESS_OFF;
+    brightnessStrip = brightness16(brightness);
+    setStatusLed(COLOR_OFF, BRIGHTNESS_OFF);
+    refreshNeeded = true;
+}
 
-                refreshNeeded = true;
-                paused = false;
-                cycleNr = 0;
-                hueBase = 0;
+/**
+ * Set all led colors of the back buffer to black.
+ */
+void clearLedStrip()
+{
+    pixelFill(ledStrip, numLeds, CRGB(0, 0, 0));
 
-                break;
+    frameRendered = true;
+}
 
-            case t_State::ON:
-                if (DEBUG_ON)
-                    Serial.println("Switching to state 'ECO'");
-            
-                // Switch to Eco
-                state = t_State::ECO;
+/**
+ * Starts the startup animation. It is rendered by the render task like a light effect.
+ */
+void startStartupAnimation()
+{
+    effectStartup.begin(numLeds);
+    startupActive = true;
+}
 
-                FastLED.clear();
-                brightness = BRIGHTNESS_ECO;
-                FastLED.setBrightness(brightness);
-                ledAtom[0].setRGB(COLOR_ECO[0], COLOR_ECO[1], COLOR_ECO[2]);
+/**
+ * Advances the startup animation by one frame and starts the fade out after its last step.
+ */
+void updateStartupAnimation()
+{
+    if (effectStartup.update(frameTime) || refreshNeeded)
+    {
+        effectStartup.render(LedSpan(ledStrip, numLeds));
+        frameRendered = true;
+        refreshNeeded = true;
+    }
 
-                refreshNeeded = true;
-                paused = false;
-                cycleNr = 0;
-                hueBase = 0;
+    if (effectStartup.finished() && !fade.active)
+    {
+        startFade(brightness, 0, FADE_TIME_STARTUP, t_FadeCurve::GAMMA, endStartupAnimation);
+    }
+}
 
-                break;
-        
-            case t_State::ECO:
-                if (DEBUG_ON)
-                    Serial.println("Switching to state 'OFF'");
-            
-                // Switch off
-                state = t_State::OFF;
+/**
+ * Called at the end of the fade out of the startup animation or when the user skips it.
+ */
+void endStartupAnimation()
+{
+    startupActive = false;
+    bootTiming.startupDone = esp_timer_get_time();
 
-                fadeBrightness(brightness, 0, 50);
+    // Clear led strip
+    clearLedStrip();
 
-                FastLED.clear();
-                brightness = BRIGHTNESS_OFF;
-                FastLED.setBrightness(brightness);
-                ledAtom[0].setRGB(COLOR_OFF[0], COLOR_OFF[1], COLOR_OFF[2]);
-                FastLED.show();
-                break;
-        }
-    }
+    // Reset led strip to its actual brightness
+    brightnessStrip = brightness16(brightness);
+    refreshNeeded = true;
+}
 
-    // Update LED strip colors while system is in state ON or ECO
-    if (state == t_State::ON || state == t_State::ECO)
-    {
-        /* ---------- Process IR commands for color effects ---------- */
-        if (irCmdAvailable) {
-          
-            switch (irCmdValue) {
-              
-                case IR_BRIGHTNESS_INC:
-                   brightness += BRIGHTNESS_STEP;
-                   if (brightness > BRIGHTNESS_MAX) brightness = BRIGHTNESS_MAX;
-                   FastLED.setBrightness(brightness);
-                   refreshNeeded = true;
-
-                   if (DEBUG_ON)
-                   {
-                      Serial.print("Brightness+: ");
-                      Serial.println(brightness);
-                   }
-                   
-                   break;
-                
-                case IR_BRIGHTNESS_DEC:
-                   brightness -= BRIGHTNESS_STEP;
-                   if (brightness < BRIGHTNESS_MIN) brightness = BRIGHTNESS_MIN;
-                   FastLED.setBrightness(brightness);
-                   refreshNeeded = true;
-
-                   if (DEBUG_ON)
-                   {
-                      Serial.print("Brightness-: ");
-                      Serial.println(brightness);
-                   }
-                   
-                   break;
-
-                case IR_SLOWER:
-                   renderCyclesHold += RENDER_NUM_CYCLES_HOLD_STEP;
-                   if (renderCyclesHold > RENDER_NUM_CYCLES_HOLD_MAX) renderCyclesHold = RENDER_NUM_CYCLES_HOLD_MAX;
-
-                   if (DEBUG_ON)
-                   {
-                      Serial.print("Speed-: ");
-                      Serial.println(0.001 * renderCyclesHold * TIME_CYCLE);
-                   }
-                   
-                   break;
-
-                case IR_FASTER:
-                   renderCyclesHold -= RENDER_NUM_CYCLES_HOLD_STEP;
-                   if (renderCyclesHold < RENDER_NUM_CYCLES_HOLD_MIN) renderCyclesHold = RENDER_NUM_CYCLES_HOLD_MIN;
-                   paused = false;
-
-                   if (DEBUG_ON)
-                   {
-                      Serial.print("Speed+: ");
-                      Serial.println(0.001 * renderCyclesHold * TIME_CYCLE);
-                   }
-                   
-                   break;
-
-                case IR_LEFT:
-                   if (lightMode == t_LightMode::CHASE && (!dirLeft || paused))
-                   {                   
-                      dirLeft = true;
-                      paused = false;
-                      cycleNr = 0;
-
-                      if (DEBUG_ON)
-                      {
-                          Serial.println("Direction L");
-                      }
-                   }
-                   
-                   break;
-
-                case IR_RIGHT:
-                   if (lightMode == t_LightMode::CHASE && (dirLeft || paused))
-                   {                   
-                      dirLeft = false;
-                      paused = false;
-                      cycleNr = 0;
-
-                      if (DEBUG_ON)
-                      {
-                          Serial.println("Direction R");
-                      }
-                   }
-                   
-                   break;
+/**
+ * Prints the time stamps of the boot phases (ms since boot).
+ */
+void printBootTiming()
+{
+    Serial.print("Boot: setup ");
+    Serial.print((long) (bootTiming.setupStart / 1000));
+    Serial.print(", tasks ");
+    Serial.print((long) (bootTiming.setupDone / 1000));
+    Serial.print(", input ready ");
+    Serial.print((long) (bootTiming.inputReady / 1000));
+    Serial.print(", first frame ");
+    Serial.print((long) (bootTiming.firstFrame / 1000));
+    Serial.print(", startup done ");
+    Serial.println((long) (bootTiming.startupDone / 1000));
+}
+
+/**
+ * Prints count, mean, maximum and percentiles of a histogram of durations as one line. The histogram is copied
+ * first, because the other tasks keep recording meanwhile.
+ */
+void printHistogram(const char* name, const t_TimeHistogram& histShared)
+{
+    portENTER_CRITICAL(&statsMux);
+    t_TimeHistogram hist = histShared;
+    portEXIT_CRITICAL(&statsMux);
+
+    Serial.print(name);
+    Serial.print(": n ");
+    Serial.print(hist.count());
+    Serial.print(", mean ");
+    Serial.print(hist.mean());
+    Serial.print(" us, max ");
+    Serial.print(hist.max());
+    Serial.print(" us, p50 < ");
+    Serial.print((unsigned long) hist.percentile(50));
+    Serial.print(" us, p99 < ");
+    Serial.print((unsigned long) hist.percentile(99));
+    Serial.println(" us");
+}
+
+/**
+ * Prints all statistics. Called by the input task, i.e. no formatting on the render path.
+ */
+void printStats()
+{
+    printBootTiming();
+    printHistogram("Frame time", statsFrameTime);
+    printHistogram("Frame load", statsFrameLoad);
+    printHistogram("Render", statsRenderTime);
+    printHistogram("Show", statsShowTime);
+    printHistogram("IR decode", statsDecodeTime);
+    printHistogram("Latency", statsLatency);
+
+    Serial.print("Frames: ");
+    Serial.print(frameNr);
+    Serial.print(", late ");
+    Serial.print(framesLate);
+    Serial.print(", skipped ");
+    Serial.print(framesSkipped);
+    Serial.print(", commands dropped ");
+    Serial.println(commandRing.dropped());
+
+    Serial.print("Power: ");
+    Serial.print(powerCurrent);
+    Serial.print(" mA of ");
+    Serial.print(powerBudget);
+    Serial.print(" mA, frames limited ");
+    Serial.println(framesPowerLimited);
+
+    if (networkOn)
+    {
+        Serial.print("Stream: packets ");
+        Serial.print(pixelStream.packets());
+        Serial.print(", lost ");
+        Serial.print(pixelStream.packetsLost());
+        Serial.print(", frames ");
+        Serial.print(pixelStream.frames());
+        Serial.print(", late ");
+        Serial.println(pixelStream.framesLate());
+
+        Serial.print("Control: MQTT ");
+        Serial.print(netControl.mqttConnected() ? "connected" : "not connected");
+        Serial.print(", requests ");
+        Serial.print(netControl.requests);
+        Serial.print(", invalid ");
+        Serial.print(netControl.invalid);
+        Serial.print(", commands dropped ");
+        Serial.print(netControl.dropped());
+        Serial.print(", states published ");
+        Serial.println(netControl.published);
+
+        if (otaUpdate.state() != t_OtaState::OTA_IDLE)
+        {
+            static const char* const OTA_STATES[] = {"idle", "requested", "downloading", "ready", "failed"};
+            Serial.print("OTA: ");
+            Serial.print(OTA_STATES[otaUpdate.state()]);
+            Serial.print(", ");
+            Serial.print(otaUpdate.written());
+            Serial.print(" of ");
+            Serial.print(otaUpdate.size());
+            Serial.print(" bytes ");
+            Serial.println(otaUpdate.error());
+        }
+    }
+
+    if (syncRole != t_SyncRole::STANDALONE)
+    {
+        Serial.print("Sync: ");
+        Serial.print(syncRole == t_SyncRole::MASTER ? "master" : (syncFollowing ? "following" : "no master"));
+        Serial.print(", phase error ");
+        Serial.print(syncPhaseError);
+        Serial.print(" us, packets sent ");
+        Serial.print(lampSync.packetsSent);
+        Serial.print(", received ");
+        Serial.print(lampSync.packetsReceived);
+        Serial.print(", send errors ");
+        Serial.println(lampSync.sendErrors);
+    }
+
+    Serial.print("Idle: ");
+    Serial.print(idleMode ? "yes" : "no");
+    Serial.print(", light sleeps ");
+    Serial.print(idleSleeps);
+    Serial.print(", wakeups by input ");
+    Serial.println(idleWakeups);
+}
+
+/**
+ * Resets all statistics. Called by the render task.
+ */
+void resetStats()
+{
+    portENTER_CRITICAL(&statsMux);
+    statsFrameTime.reset();
+    statsFrameLoad.reset();
+    statsRenderTime.reset();
+    statsShowTime.reset();
+    statsDecodeTime.reset();
+    statsLatency.reset();
+    portEXIT_CRITICAL(&statsMux);
+
+    statsLatencyPending = false;
+    framesLate = 0;
+    framesSkipped = 0;
+    framesPowerLimited = 0;
+    statsResetRequested = false;
+}
+
+/**
+ * Reads the active length of the led strip, the number of outputs, the power budget and the Wi-Fi network from the
+ * configuration.
+ */
+void loadConfig()
+{
+    Preferences config;
+    config.begin(CONFIG_NAMESPACE, true);
+    numLeds = config.getUShort(CONFIG_KEY_NUM_LEDS, NUM_LEDS_DEFAULT);
+    numOutputs = config.getUChar(CONFIG_KEY_NUM_OUTPUTS, NUM_OUTPUTS_DEFAULT);
+    powerBudget = config.getUShort(CONFIG_KEY_POWER_BUDGET, POWER_BUDGET_DEFAULT);
+    config.getString(CONFIG_KEY_WIFI_SSID, wifiSsid, WIFI_SSID_SIZE);
+    config.getString(CONFIG_KEY_WIFI_PASS, wifiPass, WIFI_PASS_SIZE);
+    uint8_t role = config.getUChar(CONFIG_KEY_SYNC_ROLE, t_SyncRole::STANDALONE);
+    crossFadeTime = config.getUShort(CONFIG_KEY_CROSS_FADE_TIME, CROSS_FADE_TIME_DEFAULT);
+    config.getString(CONFIG_KEY_MQTT_HOST, mqttHost, MQTT_HOST_SIZE);
+    config.getString(CONFIG_KEY_MQTT_TOPIC, mqttTopic, MQTT_TOPIC_SIZE);
+    config.getString(CONFIG_KEY_UPDATE_PREFIX, updatePrefix, OTA_URL_SIZE);
+    config.end();
+
+    if (mqttTopic[0] == '\0')
+    {
+        strcpy(mqttTopic, MQTT_TOPIC_DEFAULT);
+    }
+
+    if (role >= t_SyncRole::STANDALONE && role <= t_SyncRole::FOLLOWER)
+    {
+        syncRole = (t_SyncRole) role;
+    }
+
+    if (powerBudget == 0)
+    {
+        powerBudget = POWER_BUDGET_DEFAULT;
+    }
+
+    if (crossFadeTime > CROSS_FADE_TIME_MAX)
+    {
+        crossFadeTime = CROSS_FADE_TIME_DEFAULT;
+    }
+
+    if (numLeds == 0 || numLeds > MAX_LEDS)
+    {
+        numLeds = NUM_LEDS_DEFAULT;
+    }
+
+    if (numOutputs == 0 || numOutputs > NUM_OUTPUTS_MAX)
+    {
+        numOutputs = NUM_OUTPUTS_DEFAULT;
+    }
+
+    // Each output drives at least one led
+    if (numOutputs > numLeds)
+    {
+        numOutputs = numLeds;
+    }
+}
+
+/**
+ * Stores a new configuration value (1 ... maxValue) and restarts, so that all effects and the led controllers
+ * start with the new configuration. Invalid values are ignored.
+ */
+void configureValue(const char* key, long value, long maxValue)
+{
+    if (value <= 0 || value > maxValue)
+    {
+        Serial.print("Invalid value of ");
+        Serial.print(key);
+        Serial.print(", maximum: ");
+        Serial.println(maxValue);
+        return;
+    }
+
+    Preferences config;
+    config.begin(CONFIG_NAMESPACE, false);
+
+    if (strcmp(key, CONFIG_KEY_NUM_OUTPUTS) == 0 || strcmp(key, CONFIG_KEY_SYNC_ROLE) == 0)
+    {
+        config.putUChar(key, (uint8_t) value);
+    }
+    else
+    {
+        config.putUShort(key, (uint16_t) value);
+    }
+
+    config.end();
+
+    Serial.print(key);
+    Serial.print(": ");
+    Serial.print(value);
+    Serial.println(", restarting");
+    Serial.flush();
+
+    ESP.restart();
+}
+
+/**
+ * Stores a new configuration text, e.g. the Wi-Fi network, and restarts. Texts longer than maxLength are ignored.
+ */
+void configureText(const char* key, String value, uint8_t maxLength)
+{
+    value.trim();
+
+    if (value.length() > maxLength)
+    {
+        Serial.print("Invalid value of ");
+        Serial.print(key);
+        Serial.print(", maximum length: ");
+        Serial.println(maxLength);
+        return;
+    }
+
+    Preferences config;
+    config.begin(CONFIG_NAMESPACE, false);
+    config.putString(key, value.c_str());
+    config.end();
+
+    Serial.print(key);
+    Serial.println(" set, restarting");
+    Serial.flush();
+
+    ESP.restart();
+}
+
+/**
+ * Current user settings.
+ */
+t_Settings currentSettings()
+{
+    t_Settings settings;
+    settings.state = state;
+    settings.effectNr = effectNr;
+    settings.brightness = brightness;
+    settings.stepTime = EFFECTS[effectNr]->stepTime;
+    settings.dirLeft = EFFECTS[effectNr]->dirLeft;
+    return settings;
+}
+
+/**
+ * True, if both user settings are the same.
+ */
+bool settingsEqual(const t_Settings& a, const t_Settings& b)
+{
+    return a.state == b.state && a.effectNr == b.effectNr && a.brightness == b.brightness &&
+        a.stepTime == b.stepTime && a.dirLeft == b.dirLeft;
+}
+
+/**
+ * Restores the user settings saved last. Invalid or missing settings are ignored, i.e. the defaults are kept.
+ */
+void loadSettings()
+{
+    t_Settings settings;
+
+    Preferences config;
+    config.begin(CONFIG_NAMESPACE, true);
+    size_t length = config.getBytes(CONFIG_KEY_SETTINGS, &settings, sizeof(settings));
+    config.end();
+
+    bool valid = (length == sizeof(settings)) && (settings.version == SETTINGS_VERSION) &&
+        (settings.state <= t_State::ECO) && (settings.effectNr < NUM_EFFECTS) &&
+        EFFECTS[settings.effectNr]->available() &&
+        (settings.stepTime >= RENDER_STEP_TIME_MIN) && (settings.stepTime <= RENDER_STEP_TIME_MAX) &&
+        (settings.state == t_State::OFF ||
+            (settings.brightness >= BRIGHTNESS_MIN && settings.brightness <= BRIGHTNESS_MAX));
+
+    if (valid)
+    {
+        state = (t_State) settings.state;
+        effectNr = settings.effectNr;
+        brightness = (state == t_State::OFF) ? BRIGHTNESS_OFF : settings.brightness;
+        EFFECTS[effectNr]->stepTime = settings.stepTime;
+        EFFECTS[effectNr]->dirLeft = settings.dirLeft;
+    }
+
+    settingsPending = currentSettings();
+
+    if (DEBUG_ON)
+    {
+        Serial.print("Settings restored: ");
+        Serial.println(valid ? "yes" : "no");
+    }
+}
+
+/**
+ * Render task: hands the user settings over to be saved, once they have not changed for a while.
+ */
+void updateSettings()
+{
+    t_Settings settings = currentSettings();
+
+    if (!settingsEqual(settings, settingsPending))
+    {
+        settingsPending = settings;
+        settingsChangedAt = frameStart;
+        settingsDirty = true;
+    }
+    else if (settingsDirty && !settingsSaveRequested && (frameStart - settingsChangedAt >= SETTINGS_SAVE_DELAY))
+    {
+        settingsToSave = settingsPending;
+        settingsSaveRequested = true;
+        settingsDirty = false;
+    }
+}
+
+/**
+ * Render task: hands the current user settings over as the final ones, once the input task has requested them
+ * for the reboot into a new firmware image and the previous settings have been saved.
+ */
+void handOverFinalSettings()
+{
+    if (otaRebootRequested && !settingsSaveRequested)
+    {
+        settingsToSave = currentSettings();
+        settingsFinal = true;
+        settingsDirty = false;
+        otaRebootRequested = false;
+        settingsSaveRequested = true;
+    }
+}
+
+/**
+ * Input task: writes the user settings handed over by the render task. Flash writes stall both cores for a
+ * moment, so they are rare and never done within the frame loop itself. Returns true, if these were the final
+ * settings before a reboot.
+ */
+bool saveSettings()
+{
+    t_Settings settings = settingsToSave;
+    bool final = settingsFinal;
+    settingsFinal = false;
+    settingsSaveRequested = false;
+
+    Preferences config;
+    config.begin(CONFIG_NAMESPACE, false);
+    config.putBytes(CONFIG_KEY_SETTINGS, &settings, sizeof(settings));
+    config.end();
+
+    if (DEBUG_ON)
+    {
+        Serial.println("Settings saved");
+    }
+
+    return final;
+}
+
+/**
+ * Registers the controller of one output of the led strip with the Led library. The pin is a template
+ * parameter of FastLED, hence the selection by output number.
+ */
+CLEDController* addStripOutput(uint8_t outputNr, CRGB* leds, uint16_t count)
+{
+    switch (outputNr)
+    {
+        case 0:
+            return &FastLED.addLeds<NEOPIXEL, PIN_LEDSTRIP>(leds, count);
+        case 1:
+            return &FastLED.addLeds<NEOPIXEL, PIN_LEDSTRIP_2>(leds, count);
+        case 2:
+            return &FastLED.addLeds<NEOPIXEL, PIN_LEDSTRIP_3>(leds, count);
+        default:
+            return &FastLED.addLeds<NEOPIXEL, PIN_LEDSTRIP_4>(leds, count);
+    }
+}
+
+/**
+ * Splits the led strip into consecutive segments, one per output, whose lengths differ by one led at most.
+ * Effects render into the whole led strip, i.e. they are not aware of the segments.
+ */
+void addStripOutputs()
+{
+    uint16_t firstLed = 0;
+
+    for (uint8_t outputNr = 0; outputNr < numOutputs; outputNr++)
+    {
+        // Remaining leds divided by the remaining outputs, rounded up
+        uint8_t outputsLeft = numOutputs - outputNr;
+        uint16_t count = (numLeds - firstLed + outputsLeft - 1) / outputsLeft;
+
+        ledStripCtrl[outputNr] = addStripOutput(outputNr, &ledOutput[firstLed], count);
+
+        // Dithering is done by the output stage
+        ledStripCtrl[outputNr]->setDither(DISABLE_DITHER);
+        firstLed += count;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Main routines: input processing and rendering
+// -----------------------------------------------------------------------------
+
+/**
+ * Translates a raw input event into a command for the render task. Live events are recorded while a trace is
+ * recorded and ignored while a trace is replayed, i.e. the replay is not disturbed by the user.
+ */
+void handleInput(const t_InputEvent& ev, int64_t timestamp, bool live)
+{
+    if (live && inputTrace.replaying())
+    {
+        return;
+    }
+
+    if (live)
+    {
+        inputTrace.record(ev, timestamp);
+    }
+
+    t_Command cmd;
+    cmd.timestamp = timestamp;
+
+    if (ev.source != t_InputSource::INPUT_IR)
+    {
+        // Gestures completed before the edge come first, e.g. a click whose double click time has passed
+        updateGestures(timestamp);
+        buttonGestures.edge(ev.source == t_InputSource::INPUT_BUTTON_DOWN, timestamp);
+        updateGestures(timestamp);
+    }
+    else if (inputCommand(ev, irKeyLast, cmd))
+    {
+        commandRing.push(cmd);
+    }
+}
+
+/**
+ * Passes the commands of the button gestures due at the given time (us) to the render task.
+ */
+void updateGestures(int64_t now)
+{
+    t_Command cmd;
+
+    while (buttonGestures.next(now, cmd))
+    {
+        commandRing.push(cmd);
+    }
+}
+
+/**
+ * Button interrupt (any edge): takes the time and the state of the button, unless the edge is a bounce. Spurious
+ * interrupts, which GPIO 39 may receive while Wi-Fi is active, do not change the state and are ignored.
+ */
+void IRAM_ATTR onButtonEdge()
+{
+    t_ButtonEdge edge;
+    edge.time = esp_timer_get_time();
+    edge.pressed = (digitalRead(PIN_BUTTON) == LOW);
+
+    portENTER_CRITICAL_ISR(&buttonMux);
+
+    if (buttonDebounce.accept(edge.pressed, edge.time))
+    {
+        buttonEdges.push(edge);
+    }
+
+    portEXIT_CRITICAL_ISR(&buttonMux);
+}
+
+/**
+ * Input task: takes the button edges from the interrupt handler. The level check adds an edge, if the state of the
+ * button differs from the debounced state, i.e. if an edge has been missed: during light sleep (the wakeup
+ * replaces the interrupt) or since the last edge of a bounce was inside the debounce time.
+ */
+void readButton()
+{
+    t_ButtonEdge edge;
+
+    while (buttonEdges.pop(edge))
+    {
+        t_InputEvent ev;
+        ev.source = edge.pressed ? t_InputSource::INPUT_BUTTON_DOWN : t_InputSource::INPUT_BUTTON_UP;
+        handleInput(ev, edge.time, true);
+    }
+
+    edge.time = esp_timer_get_time();
+    edge.pressed = (digitalRead(PIN_BUTTON) == LOW);
+
+    portENTER_CRITICAL(&buttonMux);
+    bool missed = (buttonEdges.size() == 0) && buttonDebounce.accept(edge.pressed, edge.time);
+    portEXIT_CRITICAL(&buttonMux);
+
+    if (missed)
+    {
+        t_InputEvent ev;
+        ev.source = edge.pressed ? t_InputSource::INPUT_BUTTON_DOWN : t_InputSource::INPUT_BUTTON_UP;
+        handleInput(ev, edge.time, true);
+    }
+}
+
+/**
+ * Starts or stops recording or replaying the input trace, requested via serial monitor. The statistics are reset
+ * when a replay starts, so they show the frame times of the replay only.
+ */
+void controlTrace(long request)
+{
+    int64_t now = esp_timer_get_time();
+
+    if (request == TRACE_RECORD)
+    {
+        inputTrace.startRecording(now);
+        irKeyLast = nullptr;
+        Serial.println("Trace: recording");
+    }
+    else if (request == TRACE_REPLAY)
+    {
+        inputTrace.startReplay(now);
+        irKeyLast = nullptr;
+
+        if (INSTRUMENTATION_ON)
+        {
+            statsResetRequested = true;
+        }
+
+        Serial.print("Trace: replaying ");
+        Serial.print(inputTrace.size());
+        Serial.println(" events");
+    }
+    else // TRACE_STOP
+    {
+        bool wasRecording = inputTrace.recording();
+        inputTrace.stop(now);
+
+        Serial.print("Trace: stopped, ");
+        Serial.print(inputTrace.size());
+        Serial.print(" events");
+
+        if (wasRecording)
+        {
+            Serial.print(", dropped ");
+            Serial.print(inputTrace.dropped());
+        }
+
+        Serial.println();
+    }
+}
+
+/**
+ * Prints the input trace via serial monitor: a line "trace <events> <duration in us>", one line per event and
+ * a line "end". The output can be loaded again by loadTrace(), e.g. after a firmware update.
+ */
+void dumpTrace()
+{
+    char text[INPUT_EVENT_TEXT_SIZE];
+
+    Serial.print("trace ");
+    Serial.print(inputTrace.size());
+    Serial.print(" ");
+    Serial.println((unsigned long) inputTrace.duration());
+
+    for (uint16_t i = 0; i < inputTrace.size(); i++)
+    {
+        inputTrace.format(inputTrace[i], text, sizeof(text));
+        Serial.println(text);
+    }
+
+    Serial.println("end");
+}
+
+/**
+ * Loads an input trace printed by dumpTrace() via serial monitor, i.e. the lines after the request up to "end".
+ */
+void loadTrace()
+{
+    Serial.readStringUntil('\n'); // Rest of the request
+    inputTrace.clear(0);
+
+    while (true)
+    {
+        String line = Serial.readStringUntil('\n');
+        line.trim();
+
+        if (line.length() == 0 || line == "end")
+        {
+            break;
+        }
+
+        // Header line: number of events and duration
+        unsigned long duration = 0;
+
+        if (sscanf(line.c_str(), "trace %*u %lu", &duration) == 1)
+        {
+            inputTrace.clear(duration);
+            continue;
+        }
+
+        t_InputEvent ev;
+
+        if (!inputTrace.parse(line.c_str(), ev) || !inputTrace.append(ev))
+        {
+            Serial.println("Trace: invalid or too many events");
+            break;
+        }
+    }
+
+    Serial.print("Trace: loaded ");
+    Serial.print(inputTrace.size());
+    Serial.println(" events");
+}
+
+/**
+ * Input task: decodes button and IR receiver events as soon as they are complete and passes them
+ * as typed commands to the render task.
+ */
+void inputTask(void* param)
+{
+    IrRecv.enableIRIn(); // Switch on IR receiver, its timer interrupt is handled on the core of this task
+
+    // Button interrupt on the core of this task, the Atom Lite has an external pull-up (GPIO 39 has none)
+    pinMode(PIN_BUTTON, INPUT);
+    attachInterrupt(digitalPinToInterrupt(PIN_BUTTON), onButtonEdge, CHANGE);
+    bootTiming.inputReady = esp_timer_get_time();
+
+    while (true)
+    {
+        // Button edges and gestures, e.g. the next step of a brightness ramp
+        readButton();
+        updateGestures(esp_timer_get_time());
+
+        // Determine the IR command state
+        int64_t decodeStart = esp_timer_get_time();
+
+        if (IrRecv.decode(&irCmd))
+        {
+            int64_t timestamp = esp_timer_get_time();
+
+            if (INSTRUMENTATION_ON)
+            {
+                recordStats(statsDecodeTime, (uint32_t) (timestamp - decodeStart));
+            }
+
+            t_InputEvent ev;
+            ev.source = t_InputSource::INPUT_IR;
+            ev.repeat = irCmd.repeat;
+            ev.code = irCmd.value;
+            handleInput(ev, timestamp, true);
+
+            IrRecv.resume();
+
+            if (DEBUG_ON)
+            {
+                Serial.print("IR: ");
+                Serial.println((unsigned long) irCmd.value, HEX);
+            }
+        }
+
+        // Replay of a recorded input trace
+        if (inputTrace.replaying())
+        {
+            int64_t now = esp_timer_get_time();
+            t_InputEvent ev;
+
+            while (inputTrace.next(now, ev))
+            {
+                handleInput(ev, now, false);
+            }
+
+            if (!inputTrace.replaying())
+            {
+                Serial.println("Trace: replay done");
+
+                if (INSTRUMENTATION_ON)
+                {
+                    printStats();
+                }
+            }
+        }
+
+        // Statistics and configuration requested via serial monitor
+        if (Serial.available() > 0)
+        {
+            int request = Serial.read();
+
+            if (INSTRUMENTATION_ON && request == 's')
+            {
+                printStats();
+            }
+            else if (INSTRUMENTATION_ON && request == 'r')
+            {
+                statsResetRequested = true;
+            }
+            else if (request == 'n')
+            {
+                configureValue(CONFIG_KEY_NUM_LEDS, Serial.parseInt(), MAX_LEDS);
+            }
+            else if (request == 'o')
+            {
+                configureValue(CONFIG_KEY_NUM_OUTPUTS, Serial.parseInt(), NUM_OUTPUTS_MAX);
+            }
+            else if (request == 'p')
+            {
+                configureValue(CONFIG_KEY_POWER_BUDGET, Serial.parseInt(), POWER_BUDGET_MAX);
+            }
+            else if (request == 'w')
+            {
+                configureText(CONFIG_KEY_WIFI_SSID, Serial.readStringUntil('\n'), WIFI_SSID_SIZE - 1);
+            }
+            else if (request == 'k')
+            {
+                configureText(CONFIG_KEY_WIFI_PASS, Serial.readStringUntil('\n'), WIFI_PASS_SIZE - 1);
+            }
+            else if (request == 'y')
+            {
+                configureValue(CONFIG_KEY_SYNC_ROLE, Serial.parseInt(), t_SyncRole::FOLLOWER);
+            }
+            else if (request == 'x')
+            {
+                configureValue(CONFIG_KEY_CROSS_FADE_TIME, Serial.parseInt(), CROSS_FADE_TIME_MAX);
+            }
+            else if (request == 'm')
+            {
+                configureText(CONFIG_KEY_MQTT_HOST, Serial.readStringUntil('\n'), MQTT_HOST_SIZE - 1);
+            }
+            else if (request == 'q')
+            {
+                configureText(CONFIG_KEY_MQTT_TOPIC, Serial.readStringUntil('\n'), MQTT_TOPIC_SIZE - 1);
+            }
+            else if (request == 'v')
+            {
+                configureText(CONFIG_KEY_UPDATE_PREFIX, Serial.readStringUntil('\n'), OTA_URL_SIZE - 1);
+            }
+            else if (request == 'z')
+            {
+                requestUpdate(Serial.readStringUntil('\n'), false);
+            }
+            else if (request == 't')
+            {
+                controlTrace(Serial.parseInt());
+            }
+            else if (request == 'd')
+            {
+                dumpTrace();
+            }
+            else if (request == 'u')
+            {
+                loadTrace();
+            }
+        }
+
+        // Firmware update ready: the render task hands over the final settings, the reboot follows their saving
+        if (otaUpdate.state() == t_OtaState::OTA_READY && !otaRebooting)
+        {
+            otaRebooting = true;
+            otaRebootRequested = true;
+        }
+
+        // User settings which have not changed for a while, or the final ones before a reboot into a new image
+        if (settingsSaveRequested && saveSettings())
+        {
+            Serial.println("OTA: rebooting");
+            Serial.flush();
+            ESP.restart();
+        }
+
+        // Firmware update: self-check after booting a new image
+        checkUpdate();
+
+        vTaskDelay(pdMS_TO_TICKS(INPUT_POLL_TIME));
+    }
+}
+
+/**
+ * Switches to a light effect of the registry, starting with its default speed. The previous light mode keeps
+ * running while it is cross-faded.
+ */
+void selectEffect(uint8_t nr)
+{
+    refreshNeeded = true;
+
+    effectNr = nr;
+    Effect* effect = EFFECTS[effectNr];
+    effect->resetSpeed();
+    effect->begin(numLeds);
+
+    compositor.crossFade(effect, (uint32_t) crossFadeTime * 1000);
+
+    if (DEBUG_ON)
+    {
+        Serial.print("Light mode: ");
+        Serial.println(effect->name());
+    }
+}
+
+/**
+ * Processes a single command: switches the system state and adjusts the light effects.
+ */
+void processCommand(const t_Command& cmd)
+{
+    // Ignore commands which are not accepted in the current system state
+    if ((cmd.states & (1 << state)) == 0)
+    {
+        return;
+    }
+
+    if (bootTiming.firstCommand == 0)
+    {
+        bootTiming.firstCommand = esp_timer_get_time();
+    }
+
+    // Latency is measured from the oldest command until the next changed frame
+    if (INSTRUMENTATION_ON && !statsLatencyPending)
+    {
+        statsLatencyStart = cmd.timestamp;
+        statsLatencyPending = true;
+    }
+
+    // Active light effect
+    Effect* effect = EFFECTS[effectNr];
+
+    /* ---------- Process power on/off commands ---------- */
+
+    // Process events "button released" or "IR on/off" respectively
+    if (cmd.id == t_CommandId::CMD_ON_OFF)
+    {
+        switch (state)
+        {
+            case t_State::OFF:
+                if (DEBUG_ON)
+                    Serial.println("Switching to state 'ON'");
                 
-                case IR_MODE_CHANGE:
-
-                    refreshNeeded = true;
-                    paused = false;
-                    
-                    switch (lightMode) {
-                        case t_LightMode::CONSTANT:
-                            lightMode = t_LightMode::GRADIENT;
-                            renderCyclesHold = RENDER_GRADIENT_NUM_CYCLES_HOLD_INIT;
-                            cycleNr = 0;
-                            hueBase = 0;
-                            break;
-                    
-                        case t_LightMode::GRADIENT:
-                            lightMode = t_LightMode::CHASE;
-                            renderCyclesHold = RENDER_CHASE_NUM_CYCLES_HOLD_INIT;
-                            cycleNr = 0;
-                            hueBase = 0;
-                            break;
+                // Switch on
+                state = t_State::ON;
+
+                // Skip the startup animation, cancel a running fade out
+                stopFade();
+
+                if (startupActive)
+                {
+                    endStartupAnimation();
+                }
+
+                clearLedStrip();
+                brightness = BRIGHTNESS_ON;
+                brightnessStrip = brightness16(brightness);
+                setStatusLed(COLOR_ON, BRIGHTNESS_ON);
+
+                refreshNeeded = true;
+                effect->begin(numLeds);
+                compositor.set(effect);
+
+                break;
+
+            case t_State::ON:
+                if (DEBUG_ON)
+                    Serial.println("Switching to state 'ECO'");
+            
+                // Switch to Eco
+                state = t_State::ECO;
+
+                clearLedStrip();
+                brightness = BRIGHTNESS_ECO;
+                brightnessStrip = brightness16(brightness);
+                setStatusLed(COLOR_ECO, BRIGHTNESS_ECO);
+
+                refreshNeeded = true;
+                effect->begin(numLeds);
+                compositor.set(effect);
+
+                break;
+        
+            case t_State::ECO:
+                if (DEBUG_ON)
+                    Serial.println("Switching to state 'OFF'");
+            
+                // Switch off after fading out
+                state = t_State::OFF;
+
+                startFade(brightness, 0, FADE_TIME_OFF, t_FadeCurve::GAMMA, switchOffLeds);
+                break;
+        }
+    }
+
+    // Process commands for color effects (accepted in states ON and ECO only, see keymap)
+    switch (cmd.id) {
       
-                        case t_LightMode::CHASE:
-                            lightMode = t_LightMode::SPRITE;
-                            renderCyclesHold = RENDER_SPRITES_NUM_CYCLES_HOLD_INIT;
-                            cycleNr = 0;
-                            break;
-
-                        case t_LightMode::SPRITE:
-                            lightMode = t_LightMode::CONSTANT;
-                            break;
-                    }
-
-                    if (DEBUG_ON)
-                    {
-                        Serial.print("Light mode: ");
-                        Serial.println(lightMode);
-                    }
-                    
-                    break;
+        case t_CommandId::CMD_BRIGHTNESS_INC:
+           brightness += BRIGHTNESS_STEP;
+           if (brightness > BRIGHTNESS_MAX) brightness = BRIGHTNESS_MAX;
+           stopFade();
+           brightnessStrip = brightness16(brightness);
+           refreshNeeded = true;
+
+           if (DEBUG_ON)
+           {
+              Serial.print("Brightness+: ");
+              Serial.println(brightness);
+           }
+           
+           break;
+        
+        case t_CommandId::CMD_BRIGHTNESS_DEC:
+           brightness -= BRIGHTNESS_STEP;
+           if (brightness < BRIGHTNESS_MIN) brightness = BRIGHTNESS_MIN;
+           stopFade();
+           brightnessStrip = brightness16(brightness);
+           refreshNeeded = true;
+
+           if (DEBUG_ON)
+           {
+              Serial.print("Brightness-: ");
+              Serial.println(brightness);
+           }
+           
+           break;
+
+        case t_CommandId::CMD_SLOWER:
+           effect->stepTime += RENDER_STEP_TIME_STEP;
+           if (effect->stepTime > RENDER_STEP_TIME_MAX) effect->stepTime = RENDER_STEP_TIME_MAX;
+
+           if (DEBUG_ON)
+           {
+              Serial.print("Speed-: ");
+              Serial.println(0.001 * effect->stepTime);
+           }
+           
+           break;
+
+        case t_CommandId::CMD_FASTER:
+           effect->stepTime -= RENDER_STEP_TIME_STEP;
+           if (effect->stepTime < RENDER_STEP_TIME_MIN) effect->stepTime = RENDER_STEP_TIME_MIN;
+           effect->paused = false;
+
+           if (DEBUG_ON)
+           {
+              Serial.print("Speed+: ");
+              Serial.println(0.001 * effect->stepTime);
+           }
+           
+           break;
+
+        case t_CommandId::CMD_LEFT:
+           if (effect->reversible() && (!effect->dirLeft || effect->paused))
+           {                   
+              effect->dirLeft = true;
+              effect->paused = false;
+              effect->stepNow();
+
+              if (DEBUG_ON)
+              {
+                  Serial.println("Direction L");
+              }
+           }
+           
+           break;
+
+        case t_CommandId::CMD_RIGHT:
+           if (effect->reversible() && (effect->dirLeft || effect->paused))
+           {                   
+              effect->dirLeft = false;
+              effect->paused = false;
+              effect->stepNow();
+
+              if (DEBUG_ON)
+              {
+                  Serial.println("Direction R");
+              }
+           }
+           
+           break;
+        
+        case t_CommandId::CMD_MODE_CHANGE:
+            {
+                // Next available effect of the registry
+                uint8_t nr = effectNr;
+
+                do
+                {
+                    nr = (nr + 1) % NUM_EFFECTS;
+                }
+                while (!EFFECTS[nr]->available());
+
+                selectEffect(nr);
+            }
+
+            break;
+
+        case t_CommandId::CMD_SET_MODE:
+            if (cmd.value < NUM_EFFECTS && cmd.value != effectNr && EFFECTS[cmd.value]->available())
+            {
+                selectEffect(cmd.value);
+            }
+
+            break;
+
+        case t_CommandId::CMD_SET_BRIGHTNESS:
+            brightness = constrain(cmd.value, BRIGHTNESS_MIN, BRIGHTNESS_MAX);
+            stopFade();
+            brightnessStrip = brightness16(brightness);
+            refreshNeeded = true;
+
+            if (DEBUG_ON)
+            {
+                Serial.print("Brightness: ");
+                Serial.println(brightness);
+            }
+
+            break;
+
+        case t_CommandId::CMD_SET_SPEED:
+            effect->stepTime = constrain(cmd.value, RENDER_STEP_TIME_MIN, RENDER_STEP_TIME_MAX);
+            effect->paused = false;
+
+            if (DEBUG_ON)
+            {
+                Serial.print("Speed: ");
+                Serial.println(effect->stepTime);
+            }
+
+            break;
+
+        case t_CommandId::CMD_PLAY_PAUSE:
+            if (effect->pausable())
+            {
+                effect->paused = !effect->paused;
+            }
+
+            if (DEBUG_ON)
+            {
+                Serial.print("Pause: ");
+                Serial.println(effect->paused);
+            }
+            
+            break;
+
+        default:
+            break;
+    }
+}
+
+/**
+ * Network task: connects to the Wi-Fi network and receives the pixel stream.
+ */
+void networkTask(void* param)
+{
+    WiFi.mode(WIFI_STA);
+    WiFi.setAutoReconnect(true);
+    WiFi.begin(wifiSsid, wifiPass);
+
+    while (WiFi.status() != WL_CONNECTED)
+    {
+        vTaskDelay(pdMS_TO_TICKS(NETWORK_CONNECT_RETRY_TIME));
+    }
+
+    if (DEBUG_ON)
+    {
+        Serial.print("Wi-Fi connected: ");
+        Serial.println(WiFi.localIP().toString());
+    }
+
+    if (!pixelStream.begin(streamBuffers[0], streamBuffers[1], numLeds))
+    {
+        Serial.println("Pixel stream: sockets not available");
+        vTaskDelete(nullptr);
+    }
+
+    while (true)
+    {
+        pixelStream.poll(NETWORK_POLL_TIME);
+    }
+}
+
+/**
+ * Control task: serves the MQTT client and the HTTP server of the network control, once connected to the Wi-Fi
+ * network. A task of its own, since connecting to the broker blocks.
+ */
+void controlTask(void* param)
+{
+    while (WiFi.status() != WL_CONNECTED)
+    {
+        vTaskDelay(pdMS_TO_TICKS(NETWORK_CONNECT_RETRY_TIME));
+    }
+
+    netControl.begin(mqttHost, mqttTopic);
+    char url[OTA_URL_SIZE];
+
+    while (true)
+    {
+        netControl.poll(esp_timer_get_time());
+
+        if (netControl.takeUpdate(url, sizeof(url)))
+        {
+            requestUpdate(url, true);
+        }
+
+        vTaskDelay(pdMS_TO_TICKS(CONTROL_POLL_TIME));
+    }
+}
+
+/**
+ * Firmware update: starts the download of a new image from the given URL (HTTP), requested via serial monitor, MQTT
+ * or HTTP (remote). The lamp keeps running during the download and reboots once the image has been verified.
+ * Remote requests need a URL starting with the configured prefix, because the image itself is not authenticated.
+ */
+void requestUpdate(String url, bool remote)
+{
+    url.trim();
+
+    if (remote && (updatePrefix[0] == '\0' || strncmp(url.c_str(), updatePrefix, strlen(updatePrefix)) != 0))
+    {
+        Serial.println("OTA: remote update rejected, URL does not start with the configured prefix");
+        return;
+    }
+
+    if (!networkOn || !otaUpdate.request(url.c_str()))
+    {
+        Serial.println("OTA: update not possible (no Wi-Fi, update running or URL too long)");
+        return;
+    }
+
+    Serial.print("OTA: downloading ");
+    Serial.println(url);
+}
+
+/**
+ * Update task: downloads and writes the image of a requested firmware update.
+ */
+void otaTask(void* param)
+{
+    otaUpdate.run();
+}
+
+/**
+ * Input task: self-check of a new image, once it has been running for a while. The frames must keep up with the
+ * frame schedule and the Wi-Fi network must be reachable, i.e. the next update is possible. Otherwise, the previous
+ * image is booted again.
+ */
+void checkUpdate()
+{
+    int64_t now = esp_timer_get_time();
+
+    if (!otaCheckPending || now < OTA_SELF_CHECK_TIME)
+    {
+        return;
+    }
+
+    otaCheckPending = false;
+
+    uint32_t framesExpected = (uint32_t) ((now - bootTiming.firstFrame) / TIME_FRAME);
+    bool framesOk = (frameNr + framesExpected * OTA_SELF_CHECK_LATE_MAX / 100 >= framesExpected) &&
+        (framesLate <= frameNr * OTA_SELF_CHECK_LATE_MAX / 100);
+    bool networkOk = !networkOn || (WiFi.status() == WL_CONNECTED);
+
+    if (framesOk && networkOk)
+    {
+        OtaUpdate::confirm();
+        Serial.println("OTA: self-check passed");
+    }
+    else
+    {
+        Serial.println("OTA: self-check failed, rolling back");
+        Serial.flush();
+        OtaUpdate::rollback();
+    }
+}
+
+/**
+ * Network control: reports the state of the lamp, published by the control task if it has changed.
+ */
+void reportControlState()
+{
+    const Effect* effect = EFFECTS[effectNr];
+
+    t_ControlState control;
+    control.state = state;
+    control.effectNr = effectNr;
+    control.effectName = effect->name();
+    control.brightness = brightness;
+    control.stepTime = effect->stepTime;
+    control.paused = effect->paused;
+
+    netControl.setState(control);
+}
+
+/**
+ * Pixel streaming: takes a new frame of the stream into the back buffer. The light effect is restarted once the
+ * stream has stopped or timed out.
+ */
+void updateStream(Effect* effect)
+{
+    if (!networkOn)
+    {
+        return;
+    }
+
+    if (pixelStream.take(ledStrip))
+    {
+        if (!streamActive && DEBUG_ON)
+        {
+            Serial.println("Pixel stream started");
+        }
+
+        streamActive = true;
+        frameRendered = true;
+        refreshNeeded = true;
+    }
+    else if (streamActive && (pixelStream.terminated() || frameStart - pixelStream.lastFrameAt() > STREAM_TIMEOUT))
+    {
+        streamActive = false;
+        effect->begin(numLeds);
+        compositor.set(effect);
+
+        if (DEBUG_ON)
+        {
+            Serial.println("Pixel stream stopped");
+        }
+    }
+    else if (streamActive)
+    {
+        // No new frame: the latest one is shown again, if needed, e.g. with a new brightness
+        frameRendered = false;
+    }
+}
+
+/**
+ * Lamp synchronization: starts ESP-NOW. Without a Wi-Fi network, the lamps meet on a fixed channel, otherwise on
+ * the channel of the network, i.e. all lamps of a group must use the same network.
+ */
+void beginSync()
+{
+    WiFi.mode(WIFI_STA);
+
+    if (!networkOn)
+    {
+        esp_wifi_set_channel(SYNC_CHANNEL, WIFI_SECOND_CHAN_NONE);
+    }
+
+    if (!lampSync.begin(syncRole == t_SyncRole::MASTER))
+    {
+        Serial.println("Lamp sync: ESP-NOW not available");
+        syncRole = t_SyncRole::STANDALONE;
+    }
+}
+
+/**
+ * Lamp synchronization: processes a command. A follower forwards its local commands to the master instead, the
+ * master processes the commands of all lamps and repeats them, so that all lamps process them.
+ */
+void dispatchCommand(const t_Command& cmd, bool local)
+{
+    if (local && syncFollowing)
+    {
+        lampSync.sendCommand(cmd);
+        return;
+    }
+
+    processCommand(cmd);
+
+    if (syncRole == t_SyncRole::MASTER)
+    {
+        lampSync.sendCommand(cmd);
+        syncBeaconDue = true;
+    }
+}
+
+/**
+ * Lamp synchronization: shift of the frame schedule of a follower towards the frame schedule of the master,
+ * limited per frame. Both schedules are periodic, i.e. only the phase difference within a frame counts.
+ */
+int64_t syncFrameCorrection()
+{
+    if (!syncFollowing)
+    {
+        return 0;
+    }
+
+    int64_t error = (lampSync.toLocal(syncState.frameDeadline) - frameDeadline) % (int64_t) TIME_FRAME;
+
+    if (error >= (int64_t) TIME_FRAME / 2)
+    {
+        error -= TIME_FRAME;
+    }
+    else if (error < -(int64_t) TIME_FRAME / 2)
+    {
+        error += TIME_FRAME;
+    }
+
+    syncPhaseError = (int32_t) error;
+
+    return constrain(error, -SYNC_SLEW_MAX, SYNC_SLEW_MAX);
+}
+
+/**
+ * Lamp synchronization: takes over the latest state of the master. A state which differs from the own one, e.g.
+ * after a lost command, is adopted, unless commands of the master are still waiting to be processed.
+ */
+void updateFollower()
+{
+    syncFollowing = lampSync.following();
+
+    if (!lampSync.takeState(syncState) || !syncFollowing || lampSync.commandsPending())
+    {
+        return;
+    }
+
+    // System state: switching on and off in the usual order, including the transitions
+    t_Command onOff;
+    onOff.id = t_CommandId::CMD_ON_OFF;
+    onOff.timestamp = frameStart;
+
+    for (uint8_t tries = 0; tries < 3 && state != syncState.state; tries++)
+    {
+        processCommand(onOff);
+    }
+
+    if (state == t_State::OFF)
+    {
+        return;
+    }
+
+    if (syncState.effectNr != effectNr && syncState.effectNr < NUM_EFFECTS && EFFECTS[syncState.effectNr]->available())
+    {
+        effectNr = syncState.effectNr;
+        EFFECTS[effectNr]->begin(numLeds);
+        compositor.crossFade(EFFECTS[effectNr], (uint32_t) crossFadeTime * 1000);
+        refreshNeeded = true;
+    }
+
+    if (syncState.brightness != brightness && !fade.active)
+    {
+        brightness = syncState.brightness;
+        brightnessStrip = brightness16(brightness);
+        refreshNeeded = true;
+    }
+
+    Effect* effect = EFFECTS[effectNr];
+    effect->stepTime = syncState.stepTime;
+    effect->dirLeft = syncState.dirLeft;
+    effect->paused = syncState.paused;
+}
+
+/**
+ * Lamp synchronization: evaluates the light effect of a follower at the shared time, i.e. it performs the steps
+ * of the master, derived from the latest beacon and the time elapsed since.
+ */
+void followMaster(Effect* effect)
+{
+    int64_t nextStepIn = lampSync.toLocal(syncState.nextStepAt) - frameDeadline;
+    int32_t position = syncState.position;
+
+    if (!syncState.paused && nextStepIn <= 0 && syncState.stepTime > 0)
+    {
+        int64_t stepTime = (int64_t) syncState.stepTime * 1000;
+        int64_t steps = -nextStepIn / stepTime + 1;
+
+        position += ((effect->reversible() && !syncState.dirLeft) ? -1 : 1) * (int32_t) steps;
+        nextStepIn += steps * stepTime;
+    }
+
+    effect->follow(position, (int32_t) nextStepIn);
+}
+
+/**
+ * Lamp synchronization: the master broadcasts its clock, frame schedule and effect state periodically and after
+ * commands. Times refer to the nominal frame schedule, i.e. they do not depend on the jitter of the frame start.
+ */
+void publishSync()
+{
+    if (!syncBeaconDue && frameStart - syncBeaconAt < SYNC_BEACON_TIME)
+    {
+        return;
+    }
+
+    const Effect* effect = EFFECTS[effectNr];
+
+    t_SyncState sync;
+    sync.frameDeadline = frameDeadline;
+    sync.nextStepAt = frameDeadline + TIME_FRAME + effect->nextStepIn();
+    sync.position = effect->position();
+    sync.stepTime = effect->stepTime;
+    sync.state = state;
+    sync.effectNr = effectNr;
+    sync.brightness = brightness;
+    sync.dirLeft = effect->dirLeft;
+    sync.paused = effect->paused;
+
+    lampSync.publish(sync);
+    syncBeaconAt = frameStart;
+    syncBeaconDue = false;
+}
+
+/**
+ * Show task: loads the front buffer into the output stage whenever the render task hands over a frame, releases
+ * the front buffer and transmits the frame. If several transmissions fit into the time budget of a frame, they
+ * are spread evenly over the frame and dithered. A changed status LED is transmitted after the led strip, i.e.
+ * while the led driver is not active. The task waits for the led driver or the next transmission most of the
+ * time, so the render task runs meanwhile on the same core.
+ */
+void showTask(void* param)
+{
+    uint32_t transmitTime = TIME_FRAME; // us, duration of the previous transmission
+
+    while (true)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        showBusy = true;
+        showRequested = false;
+
+        int64_t loadStart = esp_timer_get_time();
+        bool strip = showStrip;
+        bool atom = showAtom;
+
+        if (strip)
+        {
+            uint32_t sum = ledDither.load(ledFront, numLeds, showBrightnessStrip);
+            ledDither.limit(powerLimit(sum));
+        }
+
+        CRGB colorAtom = showColorAtom;
+        uint8_t brAtom = showBrightnessAtom;
+        int64_t latencyStart = showLatencyStart;
+
+        xTaskNotifyGive(renderTaskHandle);
+
+        // Number of transmissions of this frame, none if only the status LED has changed
+        uint8_t subframes = strip ? 1 : 0;
+
+        // Without a visible remainder, dithering would transmit the same codes again, the frame is rounded once
+        if (strip && ditherAllowed && transmitTime > 0 && ledDither.fractional())
+        {
+            uint32_t fitting = DITHER_TIME_BUDGET / transmitTime;
+
+            if (fitting >= DITHER_SUBFRAMES_MIN)
+            {
+                subframes = (fitting > DITHER_SUBFRAMES_MAX) ? DITHER_SUBFRAMES_MAX : fitting;
+            }
+        }
+
+        if (strip)
+        {
+            ditherSubframes = subframes;
+        }
+
+        for (uint8_t subframeNr = 0; subframeNr < subframes; subframeNr++)
+        {
+            if (subframeNr > 0)
+            {
+                // Wait for the start of the next transmission, unless the next frame has been handed over already
+                int64_t remaining = loadStart + (int64_t) subframeNr * (TIME_FRAME / subframes) - esp_timer_get_time();
+
+                if (remaining >= 1000)
+                {
+                    vTaskDelay(pdMS_TO_TICKS(remaining / 1000));
+                }
 
-                case IR_PLAY_PAUSE:
-                    if ( (lightMode == t_LightMode::GRADIENT) || (lightMode == t_LightMode::CHASE) || (lightMode == t_LightMode::SPRITE))
-                    {
-                        paused = !paused;
-                    }
-
-                    if (DEBUG_ON)
-                    {
-                        Serial.print("Pause: ");
-                        Serial.println(paused);
-                    }
-                    
+                if (showRequested)
+                {
                     break;
+                }
+            }
+
+            if (subframes > 1)
+            {
+                ledDither.dither(ledOutput);
+            }
+            else
+            {
+                ledDither.round(ledOutput);
             }
+
+            transmitTime = transmitLeds((subframeNr == 0) ? latencyStart : 0);
         }
 
-        // Update colors of led strip according the active color effect and user settings
-        switch (lightMode) {
-            case t_LightMode::CONSTANT:
-                renderConstant();
-                break;
-        
-            case t_LightMode::GRADIENT:
-                renderGradient();
-                break;
-  
-            case t_LightMode::CHASE:
-                renderChase();
-                break;
+        if (atom)
+        {
+            statusLed.show(colorAtom, brAtom);
+        }
 
-            case t_LightMode::SPRITE:
-                renderSprite();
-                break;
+        showBusy = false;
+
+        // A firmware update writes to flash after the transmission, i.e. while the RMT is not active
+        otaUpdate.frameShown();
+    }
+}
+
+/**
+ * Render task: processes input events and updates the led strip once per frame.
+ */
+void renderTask(void* param)
+{
+    // Start the frame scheduler
+    frameStart = esp_timer_get_time();
+    frameDeadline = frameStart;
+    bootTiming.firstFrame = frameStart;
+
+    while (true)
+    {
+        beginFrame();
+
+        // Process all commands received since the previous frame
+        t_Command cmd;
+
+        while (commandRing.pop(cmd))
+        {
+            dispatchCommand(cmd, true);
+            frameChanged = true;
+        }
+
+        // Commands received via MQTT or HTTP
+        while (networkOn && netControl.receiveCommand(cmd))
+        {
+            dispatchCommand(cmd, true);
+            frameChanged = true;
+        }
+
+        // Commands and state of other lamps
+        while (syncRole != t_SyncRole::STANDALONE && lampSync.receiveCommand(cmd))
+        {
+            dispatchCommand(cmd, false);
+            frameChanged = true;
+        }
+
+        if (syncRole == t_SyncRole::FOLLOWER)
+        {
+            updateFollower();
+        }
+
+        // Advance a running brightness transition
+        updateFade();
+
+        // Update LED strip colors while system is in state ON or ECO
+        if (state == t_State::ON || state == t_State::ECO)
+        {
+            Effect* effect = EFFECTS[effectNr];
+
+            int64_t renderStart = esp_timer_get_time();
+
+            updateStream(effect);
+
+            if (syncFollowing)
+            {
+                followMaster(effect);
+            }
+
+            // Render a new frame only if the effect has changed or something else requires a refresh such as brightness
+            if (streamActive)
+            {
+                // Streamed frames are rendered by the network task
+            }
+            else if (compositor.update(frameTime) || refreshNeeded)
+            {
+                compositor.render(LedSpan(ledStrip, numLeds));
+                frameRendered = true;
+                refreshNeeded = true;
+            }
+
+            if (INSTRUMENTATION_ON)
+            {
+                recordStats(statsRenderTime, (uint32_t) (esp_timer_get_time() - renderStart));
+            }
+        }
+        else if (startupActive)
+        {
+            updateStartupAnimation();
+        }
+
+        // Show pending changes, e.g. of a brightness transition while the system is switched off or of the status LED.
+        // Dithered frames are transmitted with each frame.
+        if (refreshNeeded || atomRefreshNeeded || ditherShown)
+        {
+            showLeds();
+        }
+
+        updateIdleMode();
+        updateSettings();
+
+        if (syncRole == t_SyncRole::MASTER)
+        {
+            publishSync();
+        }
+
+        if (networkOn)
+        {
+            reportControlState();
+        }
+
+        // Firmware update ready: final settings for the input task, which reboots into the new image
+        handOverFinalSettings();
+
+        if (INSTRUMENTATION_ON)
+        {
+            int64_t now = esp_timer_get_time();
+            recordStats(statsFrameLoad, (uint32_t) (now - frameStart));
+
+            // A command which did not change the frame in time does not count as latency
+            if (statsLatencyPending && (now - statsLatencyStart > STATS_LATENCY_TIMEOUT))
+            {
+                statsLatencyPending = false;
+            }
+
+            if (statsResetRequested)
+            {
+                resetStats();
+            }
         }
 
-    } // State is ON or ECO
+        frameNr++;
+
+        waitForNextFrame(); // Pause until the deadline of the next frame
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Setup routine
+// -----------------------------------------------------------------------------
+
+void setup()
+{
+    bootTiming.setupStart = esp_timer_get_time();
+
+    // Serial monitor: configuration, statistics and debug messages
+    Serial.begin(115200);
+
+    if (DEBUG_ON)
+    {
+        Serial.print("RENDER_HUE_MAX = ");
+        Serial.println(RENDER_HUE_MAX);
+        Serial.print("RENDER_CHASE_HUE_STEP = ");
+        Serial.println(RENDER_CHASE_HUE_STEP);
+        Serial.print("RENDER_GRADIENT_HUE_STEP = ");
+        Serial.println(RENDER_GRADIENT_HUE_STEP);
+    }
   
-    delay(TIME_CYCLE); // Pause before next pass through loop
+    loadConfig();
+
+    // Firmware update: a new image has to pass its self-check, a new image crashing repeatedly is rolled back here
+    otaCheckPending = OtaUpdate::bootCheck();
+
+    if (otaCheckPending)
+    {
+        Serial.println("OTA: new image, self-check pending");
+    }
+
+    if (DEBUG_ON)
+    {
+        Serial.print("Number of leds: ");
+        Serial.print(numLeds);
+        Serial.print(", outputs: ");
+        Serial.println(numOutputs);
+    }
+
+    // Clips are mapped before the settings are restored, the clip effect is only available with a clip bank
+    clipBank.begin(CLIP_PARTITION_LABEL);
+
+    if (DEBUG_ON)
+    {
+        Serial.print("Animation clips: ");
+        Serial.println(clipBank.count());
+    }
+
+    // State and light mode of the previous session
+    loadSettings();
+
+    // Layers of the layered light mode
+    effectSpritesOnGradient.add(&layerGradient, t_BlendMode::BLEND_NORMAL, LAYER_OPAQUE);
+    effectSpritesOnGradient.add(&layerSprites, t_BlendMode::BLEND_ADD, LAYER_OPAQUE);
+
+    EFFECTS[effectNr]->begin(numLeds);
+    compositor.set(EFFECTS[effectNr]);
+    
+    // Status LED and led strip outputs, each with its own brightness
+    statusLed.begin(PIN_LEDATOM);
+    addStripOutputs();
+    ledDither.begin(COLOR_GAMMA);
+
+    // Shown with the first frame
+    clearLedStrip();
+    refreshNeeded = true;
+
+    if (state == t_State::OFF)
+    {
+        setStatusLed(COLOR_OFF, BRIGHTNESS_OFF);
+
+        // Startup animation is rendered by the render task, i.e. IR remote and button are usable from the first frame
+        if (STARTUP_ANIMATION_ON)
+        {
+            startStartupAnimation();
+        }
+    }
+    else
+    {
+        // Switched on before power off: fade in the restored light mode
+        if (state == t_State::ON)
+        {
+            setStatusLed(COLOR_ON, BRIGHTNESS_ON);
+        }
+        else
+        {
+            setStatusLed(COLOR_ECO, BRIGHTNESS_ECO);
+        }
+
+        startFade(0, brightness, FADE_TIME_MODE, t_FadeCurve::GAMMA, nullptr);
+        bootTiming.startupDone = esp_timer_get_time();
+    }
+
+    // Pixel streaming only if a Wi-Fi network has been configured
+    networkOn = (wifiSsid[0] != '\0');
+
+    if (syncRole != t_SyncRole::STANDALONE)
+    {
+        beginSync();
+    }
+
+    // Frame timer of the render task
+    esp_timer_create_args_t frameTimerArgs;
+    frameTimerArgs.callback = onFrameTimer;
+    frameTimerArgs.arg = nullptr;
+    frameTimerArgs.dispatch_method = ESP_TIMER_TASK;
+    frameTimerArgs.name = "frame";
+    frameTimerDone = xSemaphoreCreateBinary();
+    esp_timer_create(&frameTimerArgs, &frameTimer);
+
+    // Rendering and transmission to the leds on one core, button, IR receiver and network on the other one
+    xTaskCreatePinnedToCore(showTask, "show", TASK_STACK_SIZE, nullptr, TASK_PRIORITY_SHOW, &showTaskHandle, CORE_RENDER);
+    xTaskCreatePinnedToCore(renderTask, "render", TASK_STACK_SIZE, nullptr, TASK_PRIORITY_RENDER, &renderTaskHandle, CORE_RENDER);
+    xTaskCreatePinnedToCore(inputTask, "input", TASK_STACK_SIZE, nullptr, TASK_PRIORITY_INPUT, nullptr, CORE_INPUT);
+
+    if (networkOn)
+    {
+        xTaskCreatePinnedToCore(networkTask, "network", TASK_STACK_SIZE, nullptr, TASK_PRIORITY_NETWORK, nullptr, CORE_INPUT);
+        xTaskCreatePinnedToCore(controlTask, "control", TASK_STACK_SIZE_CONTROL, nullptr, TASK_PRIORITY_CONTROL, nullptr,
+            CORE_INPUT);
+        xTaskCreatePinnedToCore(otaTask, "ota", TASK_STACK_SIZE_OTA, nullptr, TASK_PRIORITY_OTA, nullptr, CORE_INPUT);
+    }
+
+    bootTiming.setupDone = esp_timer_get_time();
+}
+
+// -----------------------------------------------------------------------------
+// Main routine
+// -----------------------------------------------------------------------------
+
+void loop() {
+
+    // All work is done by the render task and the input task
+    vTaskDelete(nullptr);
 }
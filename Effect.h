@@ -0,0 +1,257 @@
+/**
+    Effect.h:
+    Interface of the light effects shown on the led strip.
+
+    Copyright (C) 2020 by Ernst Sikora
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef EFFECT_H
+#define EFFECT_H
+
+#include <FastLED.h>
+
+// Light effects: Speed constants, i.e. time between two steps of an effect
+const uint16_t RENDER_STEP_TIME_MIN  = 100;  // ms, fastest speed of light effects
+const uint16_t RENDER_STEP_TIME_MAX  = 2000; // ms, slowest speed of light effects
+const uint16_t RENDER_STEP_TIME_STEP = 100;  // ms, increment for speed adjustment via IR remote
+
+/**
+ * View on a contiguous range of leds, e.g. the led strip.
+ */
+struct LedSpan
+{
+    CRGB* data; // First led
+    uint16_t size; // Number of leds
+
+    LedSpan(CRGB* data, uint16_t size) : data(data), size(size) {}
+
+    CRGB& operator[](uint16_t ledNr) const
+    {
+        return data[ledNr];
+    }
+};
+
+/**
+ * Light effect for the led strip. Each effect keeps its own state, advances it in update() and draws it in render().
+ * Effects are statically allocated and listed in the effect registry of the sketch, they must not use the heap.
+ */
+class Effect
+{
+public:
+    bool paused = false; // Effect does not step while paused by the user
+    bool dirLeft = true; // Direction of movement set by the user (effects which are reversible only)
+    uint16_t stepTime; // ms, time between two steps of the effect, i.e. its speed
+
+    Effect(const char* name, uint16_t defaultStepTime) :
+        stepTime(defaultStepTime), name_(name), defaultStepTime_(defaultStepTime) {}
+
+    virtual ~Effect() {}
+
+    /**
+     * Name of the effect, e.g. for debug messages.
+     */
+    const char* name() const
+    {
+        return name_;
+    }
+
+    /**
+     * Restarts the effect on a led strip with the given number of leds. The initial state is rendered with the next
+     * update, the first step follows after the step time. The speed and direction set by the user are kept.
+     */
+    virtual void begin(uint16_t numLeds)
+    {
+        numLeds_ = numLeds;
+        stepTimer_ = (int32_t) stepTime * 1000;
+        position_ = 0;
+        paused = false;
+        changed_ = true;
+    }
+
+    /**
+     * Advances the effect by dt (us), i.e. the duration of the current frame. Returns true, if the effect has changed
+     * and a new frame needs to be rendered.
+     */
+    virtual bool update(uint32_t dt)
+    {
+        bool changed = changed_;
+        changed_ = false;
+
+        if (stepDue(dt))
+        {
+            position_ += direction();
+            step();
+            changed = true;
+        }
+
+        return changed;
+    }
+
+    /**
+     * Draws the current state of the effect into the leds. Must not change the state of the effect.
+     */
+    virtual void render(LedSpan leds) const = 0;
+
+    /**
+     * True, if the effect can be paused by the user.
+     */
+    virtual bool pausable() const
+    {
+        return true;
+    }
+
+    /**
+     * True, if the effect can be shown, e.g. false if the data it depends on is missing.
+     */
+    virtual bool available() const
+    {
+        return true;
+    }
+
+    /**
+     * True, if the direction of the effect can be changed by the user.
+     */
+    virtual bool reversible() const
+    {
+        return false;
+    }
+
+    /**
+     * Lets the effect perform its next step with the next update, e.g. after the user changed the direction.
+     */
+    void stepNow()
+    {
+        stepTimer_ = 0;
+    }
+
+    /**
+     * Number of steps performed since begin(), steps to the right count negative. Identifies the state of effects
+     * which are a function of their steps, see seek().
+     */
+    int32_t position() const
+    {
+        return position_;
+    }
+
+    /**
+     * Time (us) from the end of the current frame until the next step.
+     */
+    int32_t nextStepIn() const
+    {
+        return stepTimer_;
+    }
+
+    /**
+     * Jumps to the state after the given number of steps. Effects whose state is not a function of their steps
+     * only take over the position.
+     */
+    virtual void seek(int32_t position)
+    {
+        position_ = position;
+        changed_ = true;
+    }
+
+    /**
+     * Keeps the effect in step with another clock, called before update(): position is the number of steps the
+     * effect shall have performed by now, the next step is due in nextStepIn (us). One step ahead is performed
+     * by update() as usual, larger deviations jump.
+     */
+    virtual void follow(int32_t position, int32_t nextStepIn)
+    {
+        if (followTimer(position, nextStepIn))
+        {
+            seek(position);
+        }
+    }
+
+    /**
+     * Resets the speed to the default of the effect.
+     */
+    void resetSpeed()
+    {
+        stepTime = defaultStepTime_;
+    }
+
+protected:
+    uint16_t numLeds_ = 0; // Length of the led strip
+    bool changed_ = true; // A new frame is needed irrespective of the step timer, e.g. after begin()
+    int32_t position_ = 0; // Steps since begin(), see position()
+
+    /**
+     * Change of the position with each step: -1 while moving to the right (reversible effects only), otherwise 1.
+     */
+    int32_t direction() const
+    {
+        return (reversible() && !dirLeft) ? -1 : 1;
+    }
+
+    /**
+     * Sets the step timer for follow(), before a jump, i.e. seek() already sees the new timer. Returns true, if the
+     * effect has to jump to the position.
+     */
+    bool followTimer(int32_t position, int32_t nextStepIn)
+    {
+        int32_t ahead = position - position_;
+
+        if (ahead == direction() && !paused)
+        {
+            stepTimer_ = 0;
+            return false;
+        }
+
+        stepTimer_ = nextStepIn;
+        return ahead != 0;
+    }
+
+    /**
+     * Performs one step of the effect, called each time the step timer expires.
+     */
+    virtual void step() {}
+
+    /**
+     * Advances the step timer by dt (us). Returns true, if the effect shall perform its next step.
+     * The timer does not expire while the effect is paused.
+     */
+    bool stepDue(uint32_t dt)
+    {
+        bool due = (stepTimer_ <= 0) && !paused;
+
+        if (due)
+        {
+            stepTimer_ += (int32_t) stepTime * 1000;
+
+            // Do not try to catch up with steps missed during a long stall
+            if (stepTimer_ <= 0)
+            {
+                stepTimer_ = (int32_t) stepTime * 1000;
+            }
+        }
+
+        if (stepTimer_ > 0)
+        {
+            stepTimer_ -= (int32_t) dt;
+        }
+
+        return due;
+    }
+
+private:
+    const char* name_;
+    uint16_t defaultStepTime_;
+    int32_t stepTimer_ = 0; // us, time remaining until the next step, zero or less means "now"
+};
+
+#endif // EFFECT_H
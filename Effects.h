@@ -0,0 +1,398 @@
+/**
+    Effects.h:
+    Light effects shown on the led strip: constant white light, gradient,
+    chase and sprites.
+
+    Copyright (C) 2020 by Ernst Sikora
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef EFFECTS_H
+#define EFFECTS_H
+
+#include <string.h>
+#include <FastLED.h>
+
+#include "Effect.h"
+#include "PixelKernels.h"
+#include "SpritePool.h"
+
+// Light effects: Hue spectrum constants
+const uint16_t RENDER_HUE_MAX = 256; // Maximum hue value of HSV color model (FastLED)
+
+// Light effect "Gradient" constants
+const uint8_t RENDER_GRADIENT_NUM_STEPS = 64; // Number of colors from HSV color spectrum
+const uint8_t RENDER_GRADIENT_HUE_STEP = RENDER_HUE_MAX / RENDER_GRADIENT_NUM_STEPS; // Hue increment between two colors
+static_assert((RENDER_GRADIENT_NUM_STEPS & (RENDER_GRADIENT_NUM_STEPS - 1)) == 0, "Number of gradient colors must be a power of two");
+const uint16_t RENDER_GRADIENT_STEP_TIME_INIT = 200; // ms, default speed
+
+// Light effect "Chase" constants
+const uint8_t RENDER_CHASE_NUM_COLORS = 16; // Number of colors from HSV color spectrum
+const uint8_t RENDER_CHASE_HUE_STEP = RENDER_HUE_MAX / RENDER_CHASE_NUM_COLORS; // Hue increment between two colors
+static_assert((RENDER_CHASE_NUM_COLORS & (RENDER_CHASE_NUM_COLORS - 1)) == 0, "Number of chase colors must be a power of two");
+const uint16_t RENDER_CHASE_STEP_TIME_INIT = 1000; // ms, default speed
+
+// Light effect "Sprite" constants
+const uint16_t RENDER_SPRITES_STEP_TIME_INIT = 100; // ms, default speed
+const uint8_t RENDER_SPRITES_SPAWN_RATE = 30; // Probability in percent that a new sprite is spawned within one cycle
+const uint16_t RENDER_SPRITES_NUM_SPRITES_MAX = 128; // Maximum number of sprites
+
+// Startup animation constants
+const uint16_t RENDER_STARTUP_STEP_TIME_INIT = 100; // ms, default speed
+const int16_t RENDER_STARTUP_NUM_STEPS = 30; // Number of steps until the animation is finished
+const uint16_t RENDER_STARTUP_NUM_SPRITES_MAX = 8; // Maximum number of sprites
+
+
+/**
+ * Fills the leds with successive palette colors, starting with color startIdx at the first led
+ * and wrapping around at the end of the palette. Copies whole runs of palette colors at once.
+ */
+inline void blitPalette(LedSpan leds, const CRGB* palette, uint8_t numColors, uint8_t startIdx)
+{
+    uint16_t ledNr = 0;
+    uint8_t colorNr = startIdx;
+
+    while (ledNr < leds.size)
+    {
+        uint16_t run = numColors - colorNr;
+
+        if (run > leds.size - ledNr)
+        {
+            run = leds.size - ledNr;
+        }
+
+        memcpy(&leds[ledNr], &palette[colorNr], run * sizeof(CRGB));
+
+        ledNr += run;
+        colorNr = 0;
+    }
+}
+
+/**
+ * Pseudo-random number derived from a step number (integer hash). Effects which use it instead of random() do the
+ * same at the same position, i.e. they are a function of their steps and run identically on synchronized lamps.
+ */
+inline uint32_t stepRandom(int32_t position)
+{
+    uint32_t x = (uint32_t) position;
+    x ^= x >> 16;
+    x *= 0x7FEB352DUL;
+    x ^= x >> 15;
+    x *= 0x846CA68BUL;
+    x ^= x >> 16;
+    return x;
+}
+
+/**
+ * Led strip effect: Constant white light e.g. for reading.
+ */
+class EffectConstant : public Effect
+{
+public:
+    EffectConstant() : Effect("Constant", RENDER_STEP_TIME_MAX) {}
+
+    bool update(uint32_t /*dt*/) override
+    {
+        // Static effect: a new frame is needed after begin() only
+        bool changed = changed_;
+        changed_ = false;
+        return changed;
+    }
+
+    void render(LedSpan leds) const override
+    {
+        pixelFill(leds.data, leds.size, CRGB(255, 255, 255));
+    }
+
+    bool pausable() const override
+    {
+        return false;
+    }
+};
+
+/**
+ * Led strip effect: All leds have the same color.
+ * The color cycles through the HSV spectrum according to the set speed.
+ */
+class EffectGradient : public Effect
+{
+public:
+    EffectGradient() : Effect("Gradient", RENDER_GRADIENT_STEP_TIME_INIT)
+    {
+        // Precompute the palette (fully saturated, full value), so rendering copies colors instead of converting HSV
+        for (uint8_t i = 0; i < RENDER_GRADIENT_NUM_STEPS; i++)
+        {
+            palette_[i].setHSV(i * RENDER_GRADIENT_HUE_STEP, 255, 255);
+        }
+    }
+
+    void begin(uint16_t numLeds) override
+    {
+        Effect::begin(numLeds);
+        colorBase_ = 0;
+    }
+
+    void render(LedSpan leds) const override
+    {
+        pixelFill(leds.data, leds.size, palette_[colorBase_]);
+    }
+
+    void seek(int32_t position) override
+    {
+        Effect::seek(position);
+        step();
+    }
+
+protected:
+    void step() override
+    {
+        // Cycle through color spectrum, one color per step
+        colorBase_ = position_ & (RENDER_GRADIENT_NUM_STEPS - 1);
+    }
+
+private:
+    CRGB palette_[RENDER_GRADIENT_NUM_STEPS];
+    uint8_t colorBase_ = 0; // Index of the palette color shown
+};
+
+/**
+ * Led strip effect: Each led shows a successive color of the color spectrum.
+ * Colors move over time according to the set direction and set speed.
+ */
+class EffectChase : public Effect
+{
+public:
+    EffectChase() : Effect("Chase", RENDER_CHASE_STEP_TIME_INIT)
+    {
+        // Precompute the palette (fully saturated, full value), so rendering copies colors instead of converting HSV
+        for (uint8_t i = 0; i < RENDER_CHASE_NUM_COLORS; i++)
+        {
+            palette_[i].setHSV(i * RENDER_CHASE_HUE_STEP, 255, 255);
+        }
+    }
+
+    void begin(uint16_t numLeds) override
+    {
+        Effect::begin(numLeds);
+        colorBase_ = 0;
+    }
+
+    void render(LedSpan leds) const override
+    {
+        // Successive palette colors, starting with the color of the first LED
+        blitPalette(leds, palette_, RENDER_CHASE_NUM_COLORS, colorBase_);
+    }
+
+    bool reversible() const override
+    {
+        return true;
+    }
+
+    void seek(int32_t position) override
+    {
+        Effect::seek(position);
+        step();
+    }
+
+protected:
+    void step() override
+    {
+        // Cycle through color spectrum, the position counts down while moving to the right
+        colorBase_ = position_ & (RENDER_CHASE_NUM_COLORS - 1);
+    }
+
+private:
+    CRGB palette_[RENDER_CHASE_NUM_COLORS];
+    uint8_t colorBase_ = 0; // Index of the palette color of the first led
+};
+
+/**
+ * Led strip effect: Sprites appear randomly in the middle of the led strip, move either to the left or right
+ * and vanish at the border of the led strip. User can adjust the speed. Sprites move smoothly, i.e. by a fraction
+ * of their velocity in each frame. Sprites are spawned as a function of the step number, i.e. the same sequence
+ * starts whenever the effect is begun, and move by one led per step.
+ */
+class EffectSprite : public Effect
+{
+public:
+    EffectSprite() : Effect("Sprite", RENDER_SPRITES_STEP_TIME_INIT) {}
+
+    void begin(uint16_t numLeds) override
+    {
+        Effect::begin(numLeds);
+        sprites_.clear();
+    }
+
+    bool update(uint32_t dt) override
+    {
+        // New sprites are spawned with each step
+        bool changed = Effect::update(dt);
+
+        if (!paused && sprites_.numActive() > 0)
+        {
+            // Fraction of a step elapsed within this frame (1/256)
+            uint32_t scale = ((uint32_t) dt << SPRITE_FRAC_BITS) / ((uint32_t) stepTime * 1000);
+
+            sprites_.move(numLeds_, scale > 0xFFFF ? 0xFFFF : scale);
+            changed = true;
+        }
+
+        return changed;
+    }
+
+    void render(LedSpan leds) const override
+    {
+        sprites_.draw(leds);
+    }
+
+    /**
+     * Rebuilds the sprites from the spawns of the steps before, i.e. of the sprites which are still on the led
+     * strip at the given position, moved as far as the time elapsed in the current step (see nextStepIn()).
+     * Synced lamps show the same sprites right after a jump.
+     */
+    void seek(int32_t position) override
+    {
+        Effect::seek(position);
+        sprites_.clear();
+
+        int32_t stepTimeUs = (int32_t) stepTime * 1000;
+        int32_t remaining = nextStepIn();
+        remaining = (remaining < 0) ? 0 : ((remaining > stepTimeUs) ? stepTimeUs : remaining);
+        int32_t elapsed = (int32_t) (((int64_t) (stepTimeUs - remaining) << SPRITE_FRAC_BITS) / stepTimeUs);
+
+        int32_t ageMax = numLeds_ / 2 + 1; // Sprites spawned earlier have left the led strip
+        int32_t first = (position - ageMax + 1 > 1) ? position - ageMax + 1 : 1;
+
+        for (int32_t stepNr = first; stepNr <= position; stepNr++)
+        {
+            spawn(stepNr, ((position - stepNr) << SPRITE_FRAC_BITS) + elapsed);
+        }
+    }
+
+protected:
+    void step() override
+    {
+        spawn(position_, 0);
+    }
+
+private:
+    SpritePool<RENDER_SPRITES_NUM_SPRITES_MAX> sprites_;
+
+    /**
+     * Generates the sprite of a step randomly, determined by the step number (see stepRandom), and moves it by
+     * its age, i.e. the steps performed since then (1/256 steps).
+     */
+    void spawn(int32_t stepNr, int32_t age)
+    {
+        uint32_t r = stepRandom(stepNr);
+
+        if (r % 100 < RENDER_SPRITES_SPAWN_RATE)
+        {
+            uint32_t c = stepRandom(r);
+
+            t_LedSprite sp;
+            sp.vel = ((r & 0x80000000UL) ? 1 : -1) * SPRITE_ONE_LED;
+            sp.pos = (((int32_t) numLeds_ / 2) << SPRITE_FRAC_BITS) + ((sp.vel * age) >> SPRITE_FRAC_BITS);
+            sp.color = CHSV(c % 255, 128 + (c >> 8) % 127, 128 + (c >> 16) % 127);
+
+            sprites_.spawn(sp);
+        }
+    }
+};
+
+/**
+ * Startup animation: sprites appear in the middle of the led strip in a scripted sequence and move outwards.
+ * Not part of the effect registry, shown once after power on while the system is still switched off.
+ */
+class EffectStartup : public Effect
+{
+public:
+    EffectStartup() : Effect("Startup", RENDER_STARTUP_STEP_TIME_INIT) {}
+
+    void begin(uint16_t numLeds) override
+    {
+        Effect::begin(numLeds);
+
+        const int16_t center = numLeds / 2;
+
+        // Define a set of sprites: activation step, position, velocity, color
+        sprites_.clear();
+        addSprite(0,  center,      0, CRGB(255, 255, 0));
+        addSprite(5,  center - 1, -1, CRGB(32, 32, 128));
+        addSprite(5,  center + 1, +1, CRGB(32, 32, 128));
+        addSprite(10, center - 1, -1, CRGB(128, 0, 0));
+        addSprite(10, center + 1, +1, CRGB(128, 0, 0));
+        addSprite(15, center - 1, -1, CRGB(0, 128, 0));
+        addSprite(15, center + 1, +1, CRGB(0, 128, 0));
+
+        stepNr_ = 0;
+        finished_ = false;
+        sprites_.activate(stepNr_);
+    }
+
+    void render(LedSpan leds) const override
+    {
+        sprites_.draw(leds);
+    }
+
+    bool pausable() const override
+    {
+        return false;
+    }
+
+    /**
+     * True, once the last step of the animation has been shown for one step time.
+     */
+    bool finished() const
+    {
+        return finished_;
+    }
+
+protected:
+    void step() override
+    {
+        if (stepNr_ + 1 < RENDER_STARTUP_NUM_STEPS)
+        {
+            sprites_.move(numLeds_, SPRITE_ONE_LED);
+            stepNr_++;
+            sprites_.activate(stepNr_);
+        }
+        else
+        {
+            finished_ = true;
+        }
+    }
+
+private:
+    SpritePool<RENDER_STARTUP_NUM_SPRITES_MAX> sprites_;
+    int16_t stepNr_ = 0;
+    bool finished_ = false;
+
+    /**
+     * Schedules a sprite for activation at the given step, position and velocity in whole leds.
+     */
+    void addSprite(int16_t activateAt, int16_t pos, int16_t vel, CRGB color)
+    {
+        t_LedSprite sp;
+        sp.activateAt = activateAt;
+        sp.pos = (int32_t) pos << SPRITE_FRAC_BITS;
+        sp.vel = vel * SPRITE_ONE_LED;
+        sp.color = color;
+
+        sprites_.schedule(sp);
+    }
+};
+
+#endif // EFFECTS_H
@@ -0,0 +1,138 @@
+/**
+    Histogram.h:
+    Fixed-size histogram with power-of-two buckets for timing measurements.
+
+    Copyright (C) 2020 by Ernst Sikora
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+/**
+ * Histogram of unsigned values, e.g. durations in us, with NUM_BUCKETS power-of-two buckets: bucket 0 counts
+ * the value 0, bucket b counts values from 2^(b-1) to 2^b - 1, the last bucket also counts all larger values.
+ * Recording is a few instructions and never allocates, so it can be used on the render path.
+ */
+template <uint8_t NUM_BUCKETS>
+class Histogram
+{
+    static_assert(NUM_BUCKETS >= 2 && NUM_BUCKETS <= 33, "Histogram needs 2 ... 33 buckets");
+
+public:
+    Histogram()
+    {
+        reset();
+    }
+
+    /**
+     * Counts a value.
+     */
+    void record(uint32_t value)
+    {
+        uint8_t bucket = (value == 0) ? 0 : 32 - __builtin_clz(value);
+
+        if (bucket >= NUM_BUCKETS)
+        {
+            bucket = NUM_BUCKETS - 1;
+        }
+
+        counts_[bucket]++;
+        count_++;
+        sum_ += value;
+
+        if (value > max_)
+        {
+            max_ = value;
+        }
+    }
+
+    /**
+     * Removes all values.
+     */
+    void reset()
+    {
+        for (uint8_t i = 0; i < NUM_BUCKETS; i++)
+        {
+            counts_[i] = 0;
+        }
+
+        count_ = 0;
+        sum_ = 0;
+        max_ = 0;
+    }
+
+    /**
+     * Number of values counted by a bucket.
+     */
+    uint32_t bucketCount(uint8_t bucket) const
+    {
+        return counts_[bucket];
+    }
+
+    /**
+     * Smallest value which is not counted by a bucket anymore, i.e. its exclusive upper limit.
+     */
+    static uint64_t bucketLimit(uint8_t bucket)
+    {
+        return (uint64_t) 1 << bucket;
+    }
+
+    uint32_t count() const
+    {
+        return count_;
+    }
+
+    uint32_t max() const
+    {
+        return max_;
+    }
+
+    uint32_t mean() const
+    {
+        return (count_ > 0) ? (uint32_t) (sum_ / count_) : 0;
+    }
+
+    /**
+     * Upper limit of the bucket which contains the given percentile (0 ... 100) of all values.
+     */
+    uint64_t percentile(uint8_t percent) const
+    {
+        uint64_t threshold = ((uint64_t) count_ * percent + 99) / 100;
+        uint64_t sum = 0;
+
+        for (uint8_t i = 0; i < NUM_BUCKETS; i++)
+        {
+            sum += counts_[i];
+
+            if (sum >= threshold && sum > 0)
+            {
+                return bucketLimit(i);
+            }
+        }
+
+        return 0;
+    }
+
+private:
+    uint32_t counts_[NUM_BUCKETS];
+    uint32_t count_;
+    uint64_t sum_;
+    uint32_t max_;
+};
+
+#endif // HISTOGRAM_H
@@ -0,0 +1,292 @@
+/**
+    InputTrace.h:
+    Recording and replay of raw input events (IR codes, button edges), e.g. to
+    reproduce timing problems and to compare frame time histograms between
+    firmware versions with the same user input.
+
+    Copyright (C) 2020 by Ernst Sikora
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef INPUT_TRACE_H
+#define INPUT_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "Commands.h"
+#include "IrKeymap.h"
+
+// Sources of raw input events
+enum InputSource {INPUT_IR = 1, INPUT_BUTTON_DOWN = 2, INPUT_BUTTON_UP = 3};
+typedef enum InputSource t_InputSource;
+
+// Raw input event, i.e. before the translation into a command
+typedef struct InputEvent {
+    uint32_t time = 0; // us since the start of the recording
+    t_InputSource source = t_InputSource::INPUT_IR;
+    bool repeat = false; // IR: repetition code sent while a key is held down
+    uint64_t code = 0; // IR: received code
+} t_InputEvent;
+
+// Length of an event as text (see InputTrace::format()), including the terminating zero
+const uint8_t INPUT_EVENT_TEXT_SIZE = 48;
+
+/**
+ * Translates a raw IR event into a command. Repetitions refer to the IR key received last (irKeyLast), which
+ * is updated. Returns false, if the event does not trigger a command, e.g. an unknown IR code. Button edges are
+ * translated by the gesture detection (see ButtonGestures.h).
+ */
+inline bool inputCommand(const t_InputEvent& ev, const t_IrKey*& irKeyLast, t_Command& cmd)
+{
+    if (ev.source != t_InputSource::INPUT_IR)
+    {
+        return false;
+    }
+
+    const t_IrKey* irKey = nullptr;
+
+    if (ev.repeat) // Is it a repetition of the previous IR command?
+    {
+        // Is repetition of the previous command allowed?
+        if (irKeyLast != nullptr && irKeyLast->repeatable)
+        {
+            irKey = irKeyLast;
+            cmd.repeat = true;
+        }
+    }
+    else
+    {
+        // No repetition: look up the IR command in the keymap
+        irKey = irKeyLookup(ev.code);
+        irKeyLast = irKey;
+    }
+
+    if (irKey == nullptr)
+    {
+        return false;
+    }
+
+    cmd.id = irKey->id;
+    cmd.states = irKey->states;
+    return true;
+}
+
+/**
+ * Trace of up to N raw input events with their time relative to the start of the recording. Either records
+ * events or replays them, i.e. returns each event as soon as its time has come. Used by a single task only.
+ */
+template <uint16_t N>
+class InputTrace
+{
+public:
+    /**
+     * Clears the trace and starts recording at the given time (us).
+     */
+    void startRecording(int64_t now)
+    {
+        size_ = 0;
+        dropped_ = 0;
+        duration_ = 0;
+        start_ = now;
+        recording_ = true;
+        replaying_ = false;
+    }
+
+    /**
+     * Starts replaying the trace at the given time (us). The replay ends after the duration of the recording.
+     */
+    void startReplay(int64_t now)
+    {
+        next_ = 0;
+        start_ = now;
+        recording_ = false;
+        replaying_ = true;
+    }
+
+    /**
+     * Stops recording or replaying at the given time (us).
+     */
+    void stop(int64_t now)
+    {
+        if (recording_)
+        {
+            duration_ = (uint32_t) (now - start_);
+        }
+
+        recording_ = false;
+        replaying_ = false;
+    }
+
+    bool recording() const
+    {
+        return recording_;
+    }
+
+    bool replaying() const
+    {
+        return replaying_;
+    }
+
+    /**
+     * Adds an event received at the given time (us) while recording. Events beyond the capacity are dropped.
+     */
+    void record(t_InputEvent ev, int64_t timestamp)
+    {
+        if (!recording_)
+        {
+            return;
+        }
+
+        ev.time = (uint32_t) (timestamp - start_);
+
+        if (!append(ev))
+        {
+            dropped_++;
+        }
+    }
+
+    /**
+     * Returns the next event of the replay, if its time has come. The replay ends, when the duration of the trace
+     * has passed.
+     */
+    bool next(int64_t now, t_InputEvent& ev)
+    {
+        if (!replaying_)
+        {
+            return false;
+        }
+
+        uint32_t elapsed = (uint32_t) (now - start_);
+
+        if (next_ < size_ && events_[next_].time <= elapsed)
+        {
+            ev = events_[next_++];
+            return true;
+        }
+
+        if (next_ >= size_ && elapsed >= duration_)
+        {
+            replaying_ = false;
+        }
+
+        return false;
+    }
+
+    /**
+     * Clears the trace before events are loaded, e.g. a trace received via the serial monitor.
+     */
+    void clear(uint32_t duration)
+    {
+        stop(start_);
+        size_ = 0;
+        dropped_ = 0;
+        duration_ = duration;
+    }
+
+    /**
+     * Adds an event at the end of the trace. Returns false, if the trace is full.
+     */
+    bool append(const t_InputEvent& ev)
+    {
+        if (size_ >= N)
+        {
+            return false;
+        }
+
+        events_[size_++] = ev;
+
+        if (ev.time > duration_)
+        {
+            duration_ = ev.time;
+        }
+
+        return true;
+    }
+
+    /**
+     * Number of events in the trace.
+     */
+    uint16_t size() const
+    {
+        return size_;
+    }
+
+    /**
+     * Number of events not recorded, since the trace was full.
+     */
+    uint32_t dropped() const
+    {
+        return dropped_;
+    }
+
+    /**
+     * us, duration of the recording.
+     */
+    uint32_t duration() const
+    {
+        return duration_;
+    }
+
+    const t_InputEvent& operator[](uint16_t i) const
+    {
+        return events_[i];
+    }
+
+    /**
+     * Writes an event as one line of text: time (us), source, repeat flag and code (hex).
+     */
+    static void format(const t_InputEvent& ev, char* text, size_t size)
+    {
+        snprintf(text, size, "%lu %u %u %08lX%08lX", (unsigned long) ev.time, (unsigned) ev.source,
+            ev.repeat ? 1u : 0u, (unsigned long) (ev.code >> 32), (unsigned long) (ev.code & 0xFFFFFFFFUL));
+    }
+
+    /**
+     * Reads an event from one line of text written by format(). Returns false, if the line is malformed.
+     */
+    static bool parse(const char* text, t_InputEvent& ev)
+    {
+        unsigned long time = 0;
+        unsigned source = 0;
+        unsigned repeat = 0;
+        char code[17] = {0};
+
+        if (sscanf(text, "%lu %u %u %16s", &time, &source, &repeat, code) != 4 ||
+            source < t_InputSource::INPUT_IR || source > t_InputSource::INPUT_BUTTON_UP)
+        {
+            return false;
+        }
+
+        ev.time = time;
+        ev.source = (t_InputSource) source;
+        ev.repeat = (repeat != 0);
+        ev.code = strtoull(code, nullptr, 16);
+        return true;
+    }
+
+private:
+    t_InputEvent events_[N];
+    uint16_t size_ = 0;
+    uint16_t next_ = 0; // Replay: next event
+    uint32_t dropped_ = 0;
+    uint32_t duration_ = 0; // us
+    int64_t start_ = 0; // us, start of the recording or replay
+    bool recording_ = false;
+    bool replaying_ = false;
+};
+
+#endif // INPUT_TRACE_H
@@ -0,0 +1,107 @@
+/**
+    IrKeymap.h:
+    Compile-time tables which map the codes of an IR remote control
+    to commands. The remote control is selected at build time via IR_REMOTE.
+
+    Copyright (C) 2020 by Ernst Sikora
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IR_KEYMAP_H
+#define IR_KEYMAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "Commands.h"
+
+// Supported remote controls
+#define IR_REMOTE_DEFAULT 1 // 9-key remote control (NEC protocol) used during development
+
+// Remote control used, may be overridden by a build flag or by a #define before including this header
+#ifndef IR_REMOTE
+#define IR_REMOTE IR_REMOTE_DEFAULT
+#endif
+
+// Key of the IR remote control
+typedef struct IrKey {
+    uint64_t code; // Received IR code (values depend on the remote control used)
+    t_CommandId id; // Command triggered by the key
+    bool repeatable; // Command is repeated while the key is held down
+    uint8_t states; // System states in which the command is accepted
+} t_IrKey;
+
+// Keymap of the selected remote control. Entries must be sorted by ascending code (checked at compile time).
+#if IR_REMOTE == IR_REMOTE_DEFAULT
+
+constexpr t_IrKey IR_KEYMAP[] = {
+    {0xFF10EF, t_CommandId::CMD_SLOWER,         true,  CMD_STATE_ON | CMD_STATE_ECO}, // Slower
+    {0xFF28D7, t_CommandId::CMD_MODE_CHANGE,    false, CMD_STATE_ON | CMD_STATE_ECO}, // Mode
+    {0xFF30CF, t_CommandId::CMD_ON_OFF,         false, CMD_STATES_ALL},               // Stand-By/ON
+    {0xFF6897, t_CommandId::CMD_FASTER,         true,  CMD_STATE_ON | CMD_STATE_ECO}, // Faster
+    {0xFF708F, t_CommandId::CMD_BRIGHTNESS_DEC, true,  CMD_STATE_ON | CMD_STATE_ECO}, // Volume -
+    {0xFFA05F, t_CommandId::CMD_RIGHT,          false, CMD_STATE_ON | CMD_STATE_ECO}, // Right
+    {0xFFA857, t_CommandId::CMD_PLAY_PAUSE,     false, CMD_STATE_ON | CMD_STATE_ECO}, // Play/Pause
+    {0xFFC03F, t_CommandId::CMD_LEFT,           false, CMD_STATE_ON | CMD_STATE_ECO}, // Left
+    {0xFFF00F, t_CommandId::CMD_BRIGHTNESS_INC, true,  CMD_STATE_ON | CMD_STATE_ECO}, // Volume +
+};
+
+#else
+#error "IrKeymap.h: unknown IR remote control selected by IR_REMOTE"
+#endif
+
+const size_t IR_KEYMAP_SIZE = sizeof(IR_KEYMAP) / sizeof(IR_KEYMAP[0]);
+
+/**
+ * Compile-time check that the keymap is sorted by code and contains no duplicates.
+ */
+constexpr bool irKeymapSorted(const t_IrKey* keys, size_t numKeys)
+{
+    return (numKeys < 2) || ((keys[0].code < keys[1].code) && irKeymapSorted(keys + 1, numKeys - 1));
+}
+
+static_assert(irKeymapSorted(IR_KEYMAP, IR_KEYMAP_SIZE), "IR_KEYMAP must be sorted by ascending code");
+
+/**
+ * Looks up the key of a received IR code by binary search. Returns nullptr for unknown codes.
+ */
+inline const t_IrKey* irKeyLookup(uint64_t code)
+{
+    size_t lo = 0;
+    size_t hi = IR_KEYMAP_SIZE;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (IR_KEYMAP[mid].code < code)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    if (lo < IR_KEYMAP_SIZE && IR_KEYMAP[lo].code == code)
+    {
+        return &IR_KEYMAP[lo];
+    }
+
+    return nullptr;
+}
+
+#endif // IR_KEYMAP_H
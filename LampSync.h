@@ -0,0 +1,363 @@
+/**
+    LampSync.h:
+    Synchronization of several lamps via ESP-NOW broadcasts. One lamp is the
+    time master, it broadcasts its clock, its frame schedule and the state of
+    its light effect, and it repeats the commands of all lamps.
+
+    Copyright (C) 2020 by Ernst Sikora
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LAMPSYNC_H
+#define LAMPSYNC_H
+
+#include <string.h>
+#include <esp_now.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+
+#include "Commands.h"
+#include "SpscRing.h"
+
+// Packets: identification and types
+const uint16_t SYNC_MAGIC = 0x534C;                  // "LS"
+const uint8_t SYNC_VERSION = 2;                      // Packets of another version are ignored
+const uint8_t SYNC_TYPE_BEACON = 1;                  // Master: clock, frame schedule and effect state
+const uint8_t SYNC_TYPE_COMMAND = 2;                 // Master: command to be processed by all lamps
+const uint8_t SYNC_TYPE_FORWARD = 3;                 // Follower: command received locally, processed by the master
+
+// Beacon flags
+const uint8_t SYNC_FLAG_DIR_LEFT = 0x01;
+const uint8_t SYNC_FLAG_PAUSED = 0x02;
+
+// Clock synchronization
+const int64_t SYNC_AIR_TIME = 500;                   // us, typical delay from sending a packet until its reception
+const int64_t SYNC_OFFSET_RESET = 5000;              // us, larger deviations restart the clock offset, e.g. after a reboot
+const int64_t SYNC_OFFSET_WEIGHT = 8;                // Each beacon moves the clock offset by 1/8 of its deviation
+const int64_t SYNC_MASTER_TIMEOUT = 1000000;         // us, the master is lost, if no beacon is received within this time
+
+// Commands received, until processed by the render task
+const uint16_t SYNC_COMMAND_RING_SIZE = 8;
+
+// Packet header: the clock of the sender at transmission (us since its boot)
+typedef struct __attribute__((packed)) SyncHeader {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t type;
+    int64_t time;
+} t_SyncHeader;
+
+// State of the master lamp, times refer to the clock of the master (us)
+typedef struct SyncState {
+    int64_t frameDeadline = 0; // Deadline of the next frame
+    int64_t nextStepAt = 0; // Time of the next step of the light effect
+    int32_t position = 0; // Number of steps of the light effect since it began, see Effect::position()
+    uint16_t stepTime = 0; // ms
+    uint8_t state = 0; // System state
+    uint8_t effectNr = 0; // Light mode
+    uint8_t brightness = 0;
+    bool dirLeft = true;
+    bool paused = false;
+} t_SyncState;
+
+// Beacon packet
+typedef struct __attribute__((packed)) SyncBeacon {
+    t_SyncHeader header;
+    int64_t frameDeadline;
+    int64_t nextStepAt;
+    int32_t position;
+    uint16_t stepTime;
+    uint8_t state;
+    uint8_t effectNr;
+    uint8_t brightness;
+    uint8_t flags;
+} t_SyncBeacon;
+
+// Command packet
+typedef struct __attribute__((packed)) SyncCommand {
+    t_SyncHeader header;
+    uint8_t id;
+    uint8_t states;
+    uint8_t repeat;
+    uint16_t value;
+} t_SyncCommand;
+
+/**
+ * ESP-NOW transport and shared clock of a group of lamps. All packets are broadcast on the current Wi-Fi channel,
+ * i.e. no pairing is needed. The shared time is the clock of the master, followers estimate the offset of their
+ * own clock from the beacons. Packets are received by the Wi-Fi task, the commands are queued for the render task.
+ * Only one instance may exist, it is registered as the receiver of ESP-NOW.
+ */
+class LampSync
+{
+public:
+    /**
+     * Starts ESP-NOW, which requires Wi-Fi in station mode. Returns false, if ESP-NOW is not available.
+     */
+    bool begin(bool master)
+    {
+        master_ = master;
+        instance() = this;
+
+        esp_now_peer_info_t peer;
+        memset(&peer, 0, sizeof(peer));
+        memset(peer.peer_addr, 0xFF, ESP_NOW_ETH_ALEN);
+        peer.ifidx = WIFI_IF_STA;
+
+        return (esp_now_init() == ESP_OK) && (esp_now_add_peer(&peer) == ESP_OK) &&
+            (esp_now_register_recv_cb(onReceive) == ESP_OK);
+    }
+
+    /**
+     * True, if this lamp is the time master.
+     */
+    bool master() const
+    {
+        return master_;
+    }
+
+    /**
+     * Follower: true, if beacons of the master are being received.
+     */
+    bool following() const
+    {
+        if (master_)
+        {
+            return false;
+        }
+
+        portENTER_CRITICAL(&mux_);
+        int64_t lastBeaconAt = lastBeaconAt_;
+        portEXIT_CRITICAL(&mux_);
+
+        return (lastBeaconAt != 0) && (esp_timer_get_time() - lastBeaconAt < SYNC_MASTER_TIMEOUT);
+    }
+
+    /**
+     * Converts a time of the local clock to the shared clock.
+     */
+    int64_t toShared(int64_t local) const
+    {
+        portENTER_CRITICAL(&mux_);
+        int64_t shared = local + offset_;
+        portEXIT_CRITICAL(&mux_);
+
+        return shared;
+    }
+
+    /**
+     * Converts a time of the shared clock to the local clock.
+     */
+    int64_t toLocal(int64_t shared) const
+    {
+        portENTER_CRITICAL(&mux_);
+        int64_t local = shared - offset_;
+        portEXIT_CRITICAL(&mux_);
+
+        return local;
+    }
+
+    /**
+     * Follower: copies the state of the latest beacon. Returns false, if no beacon has arrived since the
+     * previous call.
+     */
+    bool takeState(t_SyncState& state)
+    {
+        portENTER_CRITICAL(&mux_);
+        bool fresh = stateFresh_;
+        state = state_;
+        stateFresh_ = false;
+        portEXIT_CRITICAL(&mux_);
+
+        return fresh;
+    }
+
+    /**
+     * Master: broadcasts its state.
+     */
+    void publish(const t_SyncState& state)
+    {
+        t_SyncBeacon beacon;
+        beacon.frameDeadline = state.frameDeadline;
+        beacon.nextStepAt = state.nextStepAt;
+        beacon.position = state.position;
+        beacon.stepTime = state.stepTime;
+        beacon.state = state.state;
+        beacon.effectNr = state.effectNr;
+        beacon.brightness = state.brightness;
+        beacon.flags = (state.dirLeft ? SYNC_FLAG_DIR_LEFT : 0) | (state.paused ? SYNC_FLAG_PAUSED : 0);
+
+        send(beacon.header, SYNC_TYPE_BEACON, &beacon, sizeof(beacon));
+    }
+
+    /**
+     * Broadcasts a command: the master repeats the commands it processes, a follower forwards the commands it
+     * received locally to the master.
+     */
+    void sendCommand(const t_Command& cmd)
+    {
+        t_SyncCommand packet;
+        packet.id = cmd.id;
+        packet.states = cmd.states;
+        packet.repeat = cmd.repeat;
+        packet.value = cmd.value;
+
+        send(packet.header, master_ ? SYNC_TYPE_COMMAND : SYNC_TYPE_FORWARD, &packet, sizeof(packet));
+    }
+
+    /**
+     * True, if commands received from another lamp are waiting to be processed.
+     */
+    bool commandsPending() const
+    {
+        return commands_.size() > 0;
+    }
+
+    /**
+     * Takes the oldest command received from another lamp. Returns false, if there is none.
+     */
+    bool receiveCommand(t_Command& cmd)
+    {
+        return commands_.pop(cmd);
+    }
+
+    // Statistics: packets sent and received, packets which could not be sent
+    uint32_t packetsSent = 0;
+    uint32_t packetsReceived = 0;
+    uint32_t sendErrors = 0;
+
+private:
+    bool master_ = false;
+    SpscRing<t_Command, SYNC_COMMAND_RING_SIZE> commands_; // Producer: Wi-Fi task, consumer: render task
+
+    // Written by the Wi-Fi task
+    mutable portMUX_TYPE mux_ = portMUX_INITIALIZER_UNLOCKED;
+    int64_t offset_ = 0; // us, shared clock minus local clock
+    int64_t lastBeaconAt_ = 0; // us, local time of the latest beacon
+    t_SyncState state_;
+    bool stateFresh_ = false;
+
+    /**
+     * Instance receiving the packets.
+     */
+    static LampSync*& instance()
+    {
+        static LampSync* sync = nullptr;
+        return sync;
+    }
+
+    /**
+     * Fills in the header and broadcasts a packet. The time is taken immediately before the transmission.
+     */
+    void send(t_SyncHeader& header, uint8_t type, const void* packet, size_t length)
+    {
+        static const uint8_t BROADCAST[ESP_NOW_ETH_ALEN] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+
+        header.magic = SYNC_MAGIC;
+        header.version = SYNC_VERSION;
+        header.type = type;
+        header.time = esp_timer_get_time();
+
+        if (esp_now_send(BROADCAST, (const uint8_t*) packet, length) == ESP_OK)
+        {
+            packetsSent++;
+        }
+        else
+        {
+            sendErrors++;
+        }
+    }
+
+    /**
+     * ESP-NOW receive callback, called by the Wi-Fi task.
+     */
+    static void onReceive(const uint8_t* mac, const uint8_t* data, int length)
+    {
+        int64_t now = esp_timer_get_time();
+        LampSync* sync = instance();
+        t_SyncHeader header;
+
+        if (sync == nullptr || length < (int) sizeof(header))
+        {
+            return;
+        }
+
+        memcpy(&header, data, sizeof(header));
+
+        if (header.magic != SYNC_MAGIC || header.version != SYNC_VERSION)
+        {
+            return;
+        }
+
+        sync->packetsReceived++;
+
+        if (!sync->master_ && header.type == SYNC_TYPE_BEACON && length == sizeof(t_SyncBeacon))
+        {
+            t_SyncBeacon beacon;
+            memcpy(&beacon, data, sizeof(beacon));
+            sync->receiveBeacon(beacon, now);
+        }
+        else if (header.type == (sync->master_ ? SYNC_TYPE_FORWARD : SYNC_TYPE_COMMAND) &&
+            length == sizeof(t_SyncCommand))
+        {
+            t_SyncCommand packet;
+            memcpy(&packet, data, sizeof(packet));
+
+            t_Command cmd;
+            cmd.id = (t_CommandId) packet.id;
+            cmd.states = packet.states;
+            cmd.repeat = packet.repeat;
+            cmd.value = packet.value;
+            cmd.timestamp = now;
+            sync->commands_.push(cmd);
+        }
+    }
+
+    /**
+     * Follower: adjusts the clock offset and stores the state of the master.
+     */
+    void receiveBeacon(const t_SyncBeacon& beacon, int64_t now)
+    {
+        int64_t sample = beacon.header.time + SYNC_AIR_TIME - now;
+
+        portENTER_CRITICAL(&mux_);
+
+        if (lastBeaconAt_ == 0 || now - lastBeaconAt_ >= SYNC_MASTER_TIMEOUT ||
+            sample - offset_ > SYNC_OFFSET_RESET || offset_ - sample > SYNC_OFFSET_RESET)
+        {
+            offset_ = sample;
+        }
+        else
+        {
+            offset_ += (sample - offset_) / SYNC_OFFSET_WEIGHT;
+        }
+
+        lastBeaconAt_ = now;
+        state_.frameDeadline = beacon.frameDeadline;
+        state_.nextStepAt = beacon.nextStepAt;
+        state_.position = beacon.position;
+        state_.stepTime = beacon.stepTime;
+        state_.state = beacon.state;
+        state_.effectNr = beacon.effectNr;
+        state_.brightness = beacon.brightness;
+        state_.dirLeft = (beacon.flags & SYNC_FLAG_DIR_LEFT) != 0;
+        state_.paused = (beacon.flags & SYNC_FLAG_PAUSED) != 0;
+        stateFresh_ = true;
+
+        portEXIT_CRITICAL(&mux_);
+    }
+};
+
+#endif // LAMPSYNC_H
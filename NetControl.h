@@ -0,0 +1,399 @@
+/**
+    NetControl.h:
+    Network control of the lamp via MQTT and HTTP. Requests are translated into
+    the typed commands of the IR remote and queued for the render task, state
+    changes are published with a rate limit.
+
+    Copyright (C) 2020 by Ernst Sikora
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef NET_CONTROL_H
+#define NET_CONTROL_H
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <WebServer.h>
+#include <PubSubClient.h>
+
+#include "Commands.h"
+#include "SpscRing.h"
+
+// Servers
+const uint16_t CONTROL_HTTP_PORT = 80;
+const uint16_t CONTROL_MQTT_PORT = 1883;
+const int64_t CONTROL_MQTT_RETRY_TIME = 5000000;   // us, time between two attempts to connect to the MQTT broker
+const int64_t CONTROL_PUBLISH_TIME_MIN = 1000000;  // us, minimum time between two publications of the state
+
+// Sizes
+const uint16_t CONTROL_COMMAND_RING_SIZE = 8;      // Commands received, until processed by the render task
+const uint8_t CONTROL_TOPIC_SIZE = 64;             // Base topic plus suffix, including the terminator
+const uint8_t CONTROL_VALUE_SIZE = 128;            // Value of a request, e.g. a URL, including the terminator
+const uint8_t CONTROL_STATE_TEXT_SIZE = 160;       // State as JSON, including the terminator
+const uint8_t CONTROL_COMMANDS_MAX = 2;            // Commands per request
+
+// State of the lamp, as published
+typedef struct ControlState {
+    uint8_t state = 0; // System state: 0 off, 1 on, 2 eco (see t_State)
+    uint8_t effectNr = 0; // Light mode
+    const char* effectName = "";
+    uint8_t brightness = 0;
+    uint16_t stepTime = 0; // ms, speed of the light effect
+    bool paused = false;
+} t_ControlState;
+
+/**
+ * Translates a request, i.e. a key and its value, into commands. Returns the number of commands, zero for an
+ * invalid request. Requests:
+ * - power: on, eco, off. The lamp passes through its states in the order of the on/off key, each command is
+ *   restricted to the state it leaves, i.e. the commands which are not needed are ignored by the render task.
+ * - mode: number of the light mode
+ * - brightness: BRIGHTNESS_MIN ... BRIGHTNESS_MAX of the sketch
+ * - speed: time between two steps of the light effect (ms)
+ * Firmware updates (key "update") are not commands for the render task, see NetControl::takeUpdate().
+ */
+inline uint8_t controlCommands(const char* key, const char* value, t_Command cmds[CONTROL_COMMANDS_MAX])
+{
+    if (strcmp(key, "power") == 0)
+    {
+        // States left by the commands, e.g. "off" from on: on -> eco -> off, from eco: eco -> off
+        uint8_t from[CONTROL_COMMANDS_MAX];
+
+        if (strcmp(value, "on") == 0)
+        {
+            from[0] = CMD_STATE_ECO;
+            from[1] = CMD_STATE_OFF;
+        }
+        else if (strcmp(value, "eco") == 0)
+        {
+            from[0] = CMD_STATE_OFF;
+            from[1] = CMD_STATE_ON;
+        }
+        else if (strcmp(value, "off") == 0)
+        {
+            from[0] = CMD_STATE_ON;
+            from[1] = CMD_STATE_ECO;
+        }
+        else
+        {
+            return 0;
+        }
+
+        for (uint8_t i = 0; i < CONTROL_COMMANDS_MAX; i++)
+        {
+            cmds[i].id = t_CommandId::CMD_ON_OFF;
+            cmds[i].states = from[i];
+        }
+
+        return CONTROL_COMMANDS_MAX;
+    }
+
+    char* end = nullptr;
+    long number = strtol(value, &end, 10);
+
+    if (end == value || *end != '\0' || number < 0 || number > UINT16_MAX)
+    {
+        return 0;
+    }
+
+    if (strcmp(key, "mode") == 0)
+    {
+        cmds[0].id = t_CommandId::CMD_SET_MODE;
+    }
+    else if (strcmp(key, "brightness") == 0)
+    {
+        cmds[0].id = t_CommandId::CMD_SET_BRIGHTNESS;
+    }
+    else if (strcmp(key, "speed") == 0)
+    {
+        cmds[0].id = t_CommandId::CMD_SET_SPEED;
+    }
+    else
+    {
+        return 0;
+    }
+
+    cmds[0].states = CMD_STATE_ON | CMD_STATE_ECO;
+    cmds[0].value = (uint16_t) number;
+    return 1;
+}
+
+/**
+ * MQTT client and HTTP server of the network control, run by a task of its own: the connection to the broker
+ * blocks while it is established. Commands are passed to the render task by a ring buffer, the render task
+ * reports the state of the lamp in each frame. Only one instance may exist.
+ *
+ * MQTT: requests are received on the topics <base>/set/<key>, the state is published as JSON on <base>/state
+ * (retained). HTTP: GET /set?<key>=<value>&... and GET /state. The key "update" requests a firmware update from
+ * the URL given as value, the sketch decides whether the URL is trusted. Requests are not authenticated.
+ */
+class NetControl
+{
+public:
+    NetControl() : mqtt_(socket_), http_(CONTROL_HTTP_PORT) {}
+
+    /**
+     * Starts the HTTP server and, if a broker is given, the MQTT client. Requires a Wi-Fi connection.
+     */
+    void begin(const char* mqttHost, const char* baseTopic)
+    {
+        snprintf(topicState_, sizeof(topicState_), "%s/state", baseTopic);
+        snprintf(topicSet_, sizeof(topicSet_), "%s/set/", baseTopic);
+        mqttOn_ = (mqttHost[0] != '\0');
+
+        if (mqttOn_)
+        {
+            mqtt_.setServer(mqttHost, CONTROL_MQTT_PORT);
+            mqtt_.setCallback([this](char* topic, uint8_t* payload, unsigned int length)
+            {
+                onMessage(topic, payload, length);
+            });
+        }
+
+        http_.on("/set", HTTP_GET, [this]() { onHttpSet(); });
+        http_.on("/state", HTTP_GET, [this]() { onHttpState(); });
+        http_.begin();
+    }
+
+    /**
+     * Control task: serves pending requests, keeps the connection to the broker and publishes the state.
+     */
+    void poll(int64_t now)
+    {
+        http_.handleClient();
+
+        if (!mqttOn_)
+        {
+            return;
+        }
+
+        if (!mqtt_.connected())
+        {
+            if (now - connectAt_ < CONTROL_MQTT_RETRY_TIME && connectAt_ != 0)
+            {
+                return;
+            }
+
+            connectAt_ = now;
+            char topic[CONTROL_TOPIC_SIZE];
+            snprintf(topic, sizeof(topic), "%s#", topicSet_);
+
+            if (!mqtt_.connect(WiFi.getHostname()) || !mqtt_.subscribe(topic))
+            {
+                return;
+            }
+
+            publishAt_ = 0; // Publish the state after each connect
+        }
+
+        mqtt_.loop();
+
+        // Publish a changed state, at most once per CONTROL_PUBLISH_TIME_MIN
+        t_ControlState state;
+        portENTER_CRITICAL(&mux_);
+        bool changed = stateChanged_ || publishAt_ == 0;
+        state = state_;
+        portEXIT_CRITICAL(&mux_);
+
+        if (changed && (publishAt_ == 0 || now - publishAt_ >= CONTROL_PUBLISH_TIME_MIN))
+        {
+            char text[CONTROL_STATE_TEXT_SIZE];
+            formatState(state, text, sizeof(text));
+
+            if (mqtt_.publish(topicState_, text, true))
+            {
+                published++;
+                publishAt_ = now;
+
+                portENTER_CRITICAL(&mux_);
+                stateChanged_ = false;
+                portEXIT_CRITICAL(&mux_);
+            }
+        }
+    }
+
+    /**
+     * Render task: reports the current state of the lamp.
+     */
+    void setState(const t_ControlState& state)
+    {
+        portENTER_CRITICAL(&mux_);
+
+        if (state.state != state_.state || state.effectNr != state_.effectNr || state.brightness != state_.brightness ||
+            state.stepTime != state_.stepTime || state.paused != state_.paused)
+        {
+            state_ = state;
+            stateChanged_ = true;
+        }
+
+        portEXIT_CRITICAL(&mux_);
+    }
+
+    /**
+     * Render task: takes the oldest command received. Returns false, if there is none.
+     */
+    bool receiveCommand(t_Command& cmd)
+    {
+        return commands_.pop(cmd);
+    }
+
+    /**
+     * Control task: takes the URL of a requested firmware update. Returns false, if there is none.
+     */
+    bool takeUpdate(char* url, size_t size)
+    {
+        if (updateUrl_[0] == '\0')
+        {
+            return false;
+        }
+
+        snprintf(url, size, "%s", updateUrl_);
+        updateUrl_[0] = '\0';
+        return true;
+    }
+
+    /**
+     * True, if the client is connected to the MQTT broker.
+     */
+    bool mqttConnected()
+    {
+        return mqttOn_ && mqtt_.connected();
+    }
+
+    /**
+     * Number of commands dropped, since the render task did not take them in time.
+     */
+    uint32_t dropped() const
+    {
+        return commands_.dropped();
+    }
+
+    // Statistics: requests received (valid and invalid), invalid requests, publications of the state
+    uint32_t requests = 0;
+    uint32_t invalid = 0;
+    uint32_t published = 0;
+
+private:
+    WiFiClient socket_;
+    PubSubClient mqtt_;
+    WebServer http_;
+    bool mqttOn_ = false;
+    char topicState_[CONTROL_TOPIC_SIZE] = "";
+    char topicSet_[CONTROL_TOPIC_SIZE] = "";
+    char updateUrl_[CONTROL_VALUE_SIZE] = ""; // Requested firmware update, empty if none
+    int64_t connectAt_ = 0; // us, latest attempt to connect to the broker
+    int64_t publishAt_ = 0; // us, latest publication of the state, zero: not yet published after connecting
+    SpscRing<t_Command, CONTROL_COMMAND_RING_SIZE> commands_; // Producer: control task, consumer: render task
+
+    // Written by the render task
+    portMUX_TYPE mux_ = portMUX_INITIALIZER_UNLOCKED;
+    t_ControlState state_;
+    bool stateChanged_ = false;
+
+    /**
+     * Translates a request into commands and queues them. Returns false, if the request is invalid.
+     */
+    bool request(const char* key, const char* value)
+    {
+        if (strcmp(key, "update") == 0)
+        {
+            requests++;
+            snprintf(updateUrl_, sizeof(updateUrl_), "%s", value);
+            return true;
+        }
+
+        t_Command cmds[CONTROL_COMMANDS_MAX];
+        uint8_t numCmds = controlCommands(key, value, cmds);
+        requests++;
+
+        if (numCmds == 0)
+        {
+            invalid++;
+            return false;
+        }
+
+        for (uint8_t i = 0; i < numCmds; i++)
+        {
+            cmds[i].timestamp = esp_timer_get_time();
+            commands_.push(cmds[i]);
+        }
+
+        return true;
+    }
+
+    /**
+     * MQTT: request received on a topic <base>/set/<key>.
+     */
+    void onMessage(const char* topic, const uint8_t* payload, unsigned int length)
+    {
+        size_t prefixLength = strlen(topicSet_);
+
+        if (strncmp(topic, topicSet_, prefixLength) != 0 || length >= CONTROL_VALUE_SIZE)
+        {
+            requests++;
+            invalid++;
+            return;
+        }
+
+        char value[CONTROL_VALUE_SIZE];
+        memcpy(value, payload, length);
+        value[length] = '\0';
+
+        request(topic + prefixLength, value);
+    }
+
+    /**
+     * HTTP: GET /set?<key>=<value>&..., all requests of the query are processed.
+     */
+    void onHttpSet()
+    {
+        bool valid = (http_.args() > 0);
+
+        for (int i = 0; i < http_.args(); i++)
+        {
+            valid = request(http_.argName(i).c_str(), http_.arg(i).c_str()) && valid;
+        }
+
+        http_.send(valid ? 200 : 400, "text/plain", valid ? "OK\n" : "Invalid request\n");
+    }
+
+    /**
+     * HTTP: GET /state, the latest state reported by the render task.
+     */
+    void onHttpState()
+    {
+        portENTER_CRITICAL(&mux_);
+        t_ControlState state = state_;
+        portEXIT_CRITICAL(&mux_);
+
+        char text[CONTROL_STATE_TEXT_SIZE];
+        formatState(state, text, sizeof(text));
+        http_.send(200, "application/json", text);
+    }
+
+    /**
+     * Writes the state as JSON.
+     */
+    static void formatState(const t_ControlState& state, char* text, size_t size)
+    {
+        static const char* const POWER[] = {"off", "on", "eco"};
+
+        snprintf(text, size, "{\"power\":\"%s\",\"mode\":%u,\"effect\":\"%s\",\"brightness\":%u,\"speed\":%u,"
+            "\"paused\":%s}", POWER[state.state % 3], state.effectNr, state.effectName, state.brightness,
+            state.stepTime, state.paused ? "true" : "false");
+    }
+};
+
+#endif // NET_CONTROL_H
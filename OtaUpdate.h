@@ -0,0 +1,336 @@
+/**
+    OtaUpdate.h:
+    Firmware update via Wi-Fi (OTA): downloads the image into the inactive app
+    partition while the lamp keeps running, and rolls back to the previous
+    image if the new one does not pass its self-check after booting.
+
+    Copyright (C) 2020 by Ernst Sikora
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef OTA_UPDATE_H
+#define OTA_UPDATE_H
+
+#include <Arduino.h>
+#include <HTTPClient.h>
+#include <Preferences.h>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+
+// Flash writes: flash operations stall the caches of both cores, so they are spread over the frames
+const uint16_t OTA_SECTOR_SIZE = 4096;        // Erase unit, also the size of the download buffer
+const uint16_t OTA_WRITE_SIZE = 1024;         // Bytes written per frame
+const uint8_t OTA_ERASE_FRAMES = 10;          // Frames between two sector erases (a sector erase takes tens of ms)
+const uint32_t OTA_WINDOW_TIMEOUT = 100;      // ms, without a frame shown within this time, flash operations proceed
+
+// Download
+const uint16_t OTA_HTTP_TIMEOUT = 10000;      // ms
+const uint8_t OTA_URL_SIZE = 128;             // Maximum URL length plus terminator
+const uint8_t OTA_IMAGE_MAGIC = 0xE9;         // First byte of an ESP32 app image
+
+// Rollback: the new image has to pass its self-check within a limited number of boots
+const char* const OTA_NAMESPACE = "ota";
+const char* const OTA_KEY_PREVIOUS = "previous"; // Label of the partition booted before the update
+const char* const OTA_KEY_BOOTS = "boots";       // Boots of the new image without passing the self-check
+const uint8_t OTA_BOOTS_MAX = 3;
+
+// States of an update
+enum OtaState {OTA_IDLE = 0, OTA_REQUESTED = 1, OTA_DOWNLOADING = 2, OTA_READY = 3, OTA_FAILED = 4};
+typedef enum OtaState t_OtaState;
+
+/**
+ * Background firmware update, run by a low-priority task of its own (see run()). The image is downloaded via HTTP
+ * in sectors into a buffer of OTA_SECTOR_SIZE bytes, each sector is erased and written into the inactive app
+ * partition in small portions, one per frame, right after the transmission to the leds. Once the image has been
+ * verified, it becomes the boot partition and the state changes to OTA_READY, the sketch reboots when it suits.
+ * The image is not authenticated: esp_ota_set_boot_partition() only checks its consistency (checksum and hash), so
+ * the caller has to trust the source of the URL.
+ */
+class OtaUpdate
+{
+public:
+    /**
+     * Requests an update from the given URL (any task). Returns false, if an update is running or the URL is
+     * too long.
+     */
+    bool request(const char* url)
+    {
+        if (strlen(url) >= OTA_URL_SIZE)
+        {
+            return false;
+        }
+
+        portENTER_CRITICAL(&mux_);
+        bool accepted = (state_ == t_OtaState::OTA_IDLE || state_ == t_OtaState::OTA_FAILED);
+
+        if (accepted)
+        {
+            strcpy(url_, url);
+            state_ = t_OtaState::OTA_REQUESTED;
+        }
+
+        portEXIT_CRITICAL(&mux_);
+
+        return accepted;
+    }
+
+    /**
+     * Task function of the update task: waits for a request and performs the update. Does not return.
+     */
+    void run()
+    {
+        task_ = xTaskGetCurrentTaskHandle();
+
+        while (true)
+        {
+            if (state_ != t_OtaState::OTA_REQUESTED)
+            {
+                vTaskDelay(pdMS_TO_TICKS(OTA_WINDOW_TIMEOUT));
+                continue;
+            }
+
+            written_ = 0;
+            size_ = 0;
+            error_ = "";
+            state_ = t_OtaState::OTA_DOWNLOADING;
+            state_ = download() ? t_OtaState::OTA_READY : t_OtaState::OTA_FAILED;
+        }
+    }
+
+    /**
+     * Show task: the transmission of a frame has finished, i.e. a flash operation may follow.
+     */
+    void frameShown()
+    {
+        if (task_ != nullptr && state_ == t_OtaState::OTA_DOWNLOADING)
+        {
+            xTaskNotifyGive(task_);
+        }
+    }
+
+    t_OtaState state() const
+    {
+        return state_;
+    }
+
+    /**
+     * True, while the image is downloaded and written.
+     */
+    bool active() const
+    {
+        return state_ == t_OtaState::OTA_REQUESTED || state_ == t_OtaState::OTA_DOWNLOADING;
+    }
+
+    // Progress: bytes written and size of the image, reason of a failed update
+    uint32_t written() const { return written_; }
+    uint32_t size() const { return size_; }
+    const char* error() const { return error_; }
+
+    /**
+     * Marks the running image as good, i.e. forgets the previous image, no rollback anymore.
+     */
+    static void confirm()
+    {
+        Preferences ota;
+        ota.begin(OTA_NAMESPACE, false);
+        ota.remove(OTA_KEY_PREVIOUS);
+        ota.remove(OTA_KEY_BOOTS);
+        ota.end();
+    }
+
+    /**
+     * Boots the previous image again.
+     */
+    static void rollback()
+    {
+        Preferences ota;
+        char previous[sizeof(esp_partition_t::label)] = "";
+        ota.begin(OTA_NAMESPACE, true);
+        ota.getString(OTA_KEY_PREVIOUS, previous, sizeof(previous));
+        ota.end();
+
+        confirm();
+
+        const esp_partition_t* partition = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY,
+            previous);
+
+        if (partition != nullptr)
+        {
+            esp_ota_set_boot_partition(partition);
+        }
+
+        esp_restart();
+    }
+
+    /**
+     * Called once after boot: counts the boots of a new image, which has not passed its self-check yet, and rolls
+     * back after OTA_BOOTS_MAX boots, e.g. if the image crashes. Returns true, if the running image still has to
+     * pass its self-check, see confirm() and rollback().
+     */
+    static bool bootCheck()
+    {
+        Preferences ota;
+        char previous[sizeof(esp_partition_t::label)] = "";
+        ota.begin(OTA_NAMESPACE, false);
+        ota.getString(OTA_KEY_PREVIOUS, previous, sizeof(previous));
+
+        if (previous[0] == '\0')
+        {
+            ota.end();
+            return false;
+        }
+
+        // Still the previous image, e.g. flashed via USB meanwhile: nothing to check
+        if (strcmp(esp_ota_get_running_partition()->label, previous) == 0)
+        {
+            ota.end();
+            confirm();
+            return false;
+        }
+
+        uint8_t boots = ota.getUChar(OTA_KEY_BOOTS, 0) + 1;
+        ota.putUChar(OTA_KEY_BOOTS, boots);
+        ota.end();
+
+        if (boots > OTA_BOOTS_MAX)
+        {
+            rollback();
+        }
+
+        return true;
+    }
+
+private:
+    volatile t_OtaState state_ = t_OtaState::OTA_IDLE;
+    volatile uint32_t written_ = 0;
+    volatile uint32_t size_ = 0;
+    const char* volatile error_ = "";
+    TaskHandle_t task_ = nullptr;
+    portMUX_TYPE mux_ = portMUX_INITIALIZER_UNLOCKED;
+    char url_[OTA_URL_SIZE] = "";
+    uint8_t buffer_[OTA_SECTOR_SIZE];
+
+    /**
+     * Waits for the given number of frames to be shown, or for the timeout if no frames are shown.
+     */
+    void waitFrames(uint8_t numFrames)
+    {
+        for (uint8_t i = 0; i < numFrames; i++)
+        {
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(OTA_WINDOW_TIMEOUT));
+        }
+    }
+
+    /**
+     * Sets the reason of a failed update. Returns false.
+     */
+    bool fail(const char* error)
+    {
+        error_ = error;
+        return false;
+    }
+
+    /**
+     * Downloads the image, writes it into the inactive app partition and makes it the boot partition, which
+     * verifies the image. Returns false, if the update has failed.
+     */
+    bool download()
+    {
+        const esp_partition_t* partition = esp_ota_get_next_update_partition(nullptr);
+
+        if (partition == nullptr)
+        {
+            return fail("no update partition");
+        }
+
+        HTTPClient http;
+        http.setTimeout(OTA_HTTP_TIMEOUT);
+
+        if (!http.begin(String(url_)) || http.GET() != HTTP_CODE_OK)
+        {
+            http.end();
+            return fail("download failed");
+        }
+
+        int length = http.getSize();
+
+        if (length <= 0 || (uint32_t) length > partition->size)
+        {
+            http.end();
+            return fail("invalid image size");
+        }
+
+        size_ = length;
+        WiFiClient* stream = http.getStreamPtr();
+
+        for (uint32_t offset = 0; offset < (uint32_t) length; offset += OTA_SECTOR_SIZE)
+        {
+            size_t sectorLength = ((uint32_t) length - offset < OTA_SECTOR_SIZE) ? length - offset : OTA_SECTOR_SIZE;
+
+            if (stream->readBytes(buffer_, sectorLength) != sectorLength)
+            {
+                http.end();
+                return fail("download interrupted");
+            }
+
+            if (offset == 0 && buffer_[0] != OTA_IMAGE_MAGIC)
+            {
+                http.end();
+                return fail("not an app image");
+            }
+
+            waitFrames(OTA_ERASE_FRAMES);
+
+            if (esp_partition_erase_range(partition, offset, OTA_SECTOR_SIZE) != ESP_OK)
+            {
+                http.end();
+                return fail("flash erase failed");
+            }
+
+            for (size_t pos = 0; pos < sectorLength; pos += OTA_WRITE_SIZE)
+            {
+                size_t writeLength = (sectorLength - pos < OTA_WRITE_SIZE) ? sectorLength - pos : OTA_WRITE_SIZE;
+                waitFrames(1);
+
+                if (esp_partition_write(partition, offset + pos, buffer_ + pos, writeLength) != ESP_OK)
+                {
+                    http.end();
+                    return fail("flash write failed");
+                }
+
+                written_ = offset + pos + writeLength;
+            }
+        }
+
+        http.end();
+
+        // Remember the running image for a rollback, then boot the new one (verified by esp_ota_set_boot_partition)
+        Preferences ota;
+        ota.begin(OTA_NAMESPACE, false);
+        ota.putString(OTA_KEY_PREVIOUS, esp_ota_get_running_partition()->label);
+        ota.putUChar(OTA_KEY_BOOTS, 0);
+        ota.end();
+
+        if (esp_ota_set_boot_partition(partition) != ESP_OK)
+        {
+            confirm(); // The running image stays
+            return fail("image invalid");
+        }
+
+        return true;
+    }
+};
+
+#endif // OTA_UPDATE_H
@@ -0,0 +1,216 @@
+/**
+    PixelKernels.h:
+    Operations on whole led buffers: fill, scale, fade to black, saturating add
+    and blend. The colors are processed four channels at a time in 32-bit words
+    (SWAR: SIMD within a register).
+
+    Copyright (C) 2020 by Ernst Sikora
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PIXEL_KERNELS_H
+#define PIXEL_KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <FastLED.h>
+
+// Word of four color channels, may alias the bytes of a led buffer
+typedef uint32_t __attribute__((__may_alias__)) t_PixelWord;
+
+// Lane masks: channels 0 and 2 of a word, bit 7 and bits 0 ... 6 of each channel
+const uint32_t PIXEL_LANES_EVEN = 0x00FF00FFUL;
+const uint32_t PIXEL_LANES_ODD  = 0xFF00FF00UL;
+const uint32_t PIXEL_LANES_HIGH = 0x80808080UL;
+const uint32_t PIXEL_LANES_LOW  = 0x7F7F7F7FUL;
+
+/**
+ * Scales the four channels of a word by scale1 / 256 (scale1 = 1 ... 256). Two channels are multiplied at once,
+ * the 16-bit products do not overflow into the neighbouring channel.
+ */
+inline uint32_t pixelScaleWord(uint32_t w, uint32_t scale1)
+{
+    uint32_t even = (((w & PIXEL_LANES_EVEN) * scale1) >> 8) & PIXEL_LANES_EVEN;
+    uint32_t odd = (((w >> 8) & PIXEL_LANES_EVEN) * scale1) & PIXEL_LANES_ODD;
+    return even | odd;
+}
+
+/**
+ * Adds the four channels of two words, saturating at 255. The low seven bits are added without carry between
+ * the channels, the carry out of bit 7 sets the channel to 255.
+ */
+inline uint32_t pixelAddWord(uint32_t a, uint32_t b)
+{
+    uint32_t low = (a & PIXEL_LANES_LOW) + (b & PIXEL_LANES_LOW);
+    uint32_t sum = low ^ ((a ^ b) & PIXEL_LANES_HIGH);
+    uint32_t carry = ((a & b) | ((a | b) & ~sum)) & PIXEL_LANES_HIGH;
+    return sum | ((carry >> 7) * 0xFF);
+}
+
+/**
+ * Blends the four channels of two words: a * (256 - amount) / 256 + b * amount / 256 (amount = 0 ... 256).
+ */
+inline uint32_t pixelBlendWord(uint32_t a, uint32_t b, uint32_t amount)
+{
+    uint32_t keep = 256 - amount;
+    uint32_t even = (((a & PIXEL_LANES_EVEN) * keep + (b & PIXEL_LANES_EVEN) * amount) >> 8) & PIXEL_LANES_EVEN;
+    uint32_t odd = (((a >> 8) & PIXEL_LANES_EVEN) * keep + ((b >> 8) & PIXEL_LANES_EVEN) * amount) & PIXEL_LANES_ODD;
+    return even | odd;
+}
+
+/**
+ * Applies op to all channels of a buffer: single channels up to the first word boundary and after the last one,
+ * whole aligned words in between. The channels are independent, i.e. op(word) also works on a single channel.
+ */
+template <typename Op>
+inline void pixelMap(uint8_t* data, size_t length, Op op)
+{
+    size_t i = 0;
+
+    for (; i < length && ((uintptr_t) (data + i) & 3) != 0; i++)
+    {
+        data[i] = op(data[i]);
+    }
+
+    for (; i + 4 <= length; i += 4)
+    {
+        t_PixelWord* w = (t_PixelWord*) (data + i);
+        *w = op(*w);
+    }
+
+    for (; i < length; i++)
+    {
+        data[i] = op(data[i]);
+    }
+}
+
+/**
+ * Applies op to all channels of a buffer and the corresponding channels of a second buffer. Whole words are
+ * only used if both buffers have the same alignment, otherwise all channels are processed one by one.
+ */
+template <typename Op>
+inline void pixelZip(uint8_t* data, const uint8_t* src, size_t length, Op op)
+{
+    size_t i = 0;
+
+    if ((((uintptr_t) data ^ (uintptr_t) src) & 3) == 0)
+    {
+        for (; i < length && ((uintptr_t) (data + i) & 3) != 0; i++)
+        {
+            data[i] = op(data[i], src[i]);
+        }
+
+        for (; i + 4 <= length; i += 4)
+        {
+            t_PixelWord* w = (t_PixelWord*) (data + i);
+            *w = op(*w, *(const t_PixelWord*) (src + i));
+        }
+    }
+
+    for (; i < length; i++)
+    {
+        data[i] = op(data[i], src[i]);
+    }
+}
+
+/**
+ * Sets all leds to the given color. Three words contain four leds, they are stored repeatedly.
+ */
+inline void pixelFill(CRGB* leds, uint16_t numLeds, CRGB color)
+{
+    uint8_t* data = (uint8_t*) leds;
+    const size_t length = (size_t) numLeds * 3;
+    const uint8_t rgb[3] = {color.r, color.g, color.b};
+
+    if (color.r == color.g && color.g == color.b)
+    {
+        memset(data, color.r, length);
+        return;
+    }
+
+    size_t i = 0;
+
+    for (; i < length && ((uintptr_t) (data + i) & 3) != 0; i++)
+    {
+        data[i] = rgb[i % 3];
+    }
+
+    // Pattern of three words, starting at the channel of the first aligned address
+    uint8_t pattern[12];
+
+    for (uint8_t j = 0; j < sizeof(pattern); j++)
+    {
+        pattern[j] = rgb[(i + j) % 3];
+    }
+
+    uint32_t w0, w1, w2;
+    memcpy(&w0, pattern, 4);
+    memcpy(&w1, pattern + 4, 4);
+    memcpy(&w2, pattern + 8, 4);
+
+    for (; i + 12 <= length; i += 12)
+    {
+        t_PixelWord* w = (t_PixelWord*) (data + i);
+        w[0] = w0;
+        w[1] = w1;
+        w[2] = w2;
+    }
+
+    for (; i < length; i++)
+    {
+        data[i] = rgb[i % 3];
+    }
+}
+
+/**
+ * Scales all leds by (scale + 1) / 256, like nscale8() of FastLED.
+ */
+inline void pixelScale(CRGB* leds, uint16_t numLeds, uint8_t scale)
+{
+    const uint32_t scale1 = (uint32_t) scale + 1;
+
+    pixelMap((uint8_t*) leds, (size_t) numLeds * 3, [scale1](uint32_t w) { return pixelScaleWord(w, scale1); });
+}
+
+/**
+ * Reduces the brightness of all leds by fade / 256, e.g. to draw trails.
+ */
+inline void pixelFadeToBlack(CRGB* leds, uint16_t numLeds, uint8_t fade)
+{
+    pixelScale(leds, numLeds, 255 - fade);
+}
+
+/**
+ * Adds the colors of src to the leds, saturating at full brightness.
+ */
+inline void pixelAdd(CRGB* leds, const CRGB* src, uint16_t numLeds)
+{
+    pixelZip((uint8_t*) leds, (const uint8_t*) src, (size_t) numLeds * 3,
+        [](uint32_t a, uint32_t b) { return pixelAddWord(a, b); });
+}
+
+/**
+ * Blends the colors of src into the leds by amount / 256, i.e. 0 keeps the leds and 256 copies src.
+ */
+inline void pixelBlend(CRGB* leds, const CRGB* src, uint16_t numLeds, uint16_t amount)
+{
+    const uint32_t weight = (amount > 256) ? 256 : amount;
+
+    pixelZip((uint8_t*) leds, (const uint8_t*) src, (size_t) numLeds * 3,
+        [weight](uint32_t a, uint32_t b) { return pixelBlendWord(a, b, weight); });
+}
+
+#endif // PIXEL_KERNELS_H
@@ -0,0 +1,457 @@
+/**
+    PixelStream.h:
+    Realtime pixel streaming via UDP: receives DDP and E1.31 (sACN) packets
+    and decodes their pixel data directly into a framebuffer.
+
+    Copyright (C) 2020 by Ernst Sikora
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PIXEL_STREAM_H
+#define PIXEL_STREAM_H
+
+#include <string.h>
+#include <lwip/sockets.h>
+#include <esp_timer.h>
+#include <FastLED.h>
+
+// DDP (Distributed Display Protocol): UDP port and header
+const uint16_t DDP_PORT = 4048;
+const uint8_t DDP_HEADER_SIZE = 10; // Bytes, without timecode
+const uint8_t DDP_HEADER_SIZE_TIME = 14; // Bytes, with timecode
+const uint8_t DDP_FLAG_VERSION_MASK = 0xC0;
+const uint8_t DDP_FLAG_VERSION_1 = 0x40;
+const uint8_t DDP_FLAG_PUSH = 0x01; // Last packet of a frame, i.e. the frame shall be shown
+const uint8_t DDP_FLAG_QUERY = 0x02;
+const uint8_t DDP_FLAG_TIME = 0x10; // Header contains a timecode
+const uint8_t DDP_SEQ_MASK = 0x0F; // Sequence number 1 ... 15, 0: not used
+
+// E1.31 (sACN): UDP port, header and pixel mapping (170 pixels per universe, starting with E131_UNIVERSE_FIRST)
+const uint16_t E131_PORT = 5568;
+const uint8_t E131_HEADER_SIZE = 126; // Bytes, up to and including the DMX start code
+const uint8_t E131_OFFSET_ID = 4; // ACN packet identifier
+const uint8_t E131_OFFSET_ROOT_VECTOR = 18; // 32 bit, big endian
+const uint8_t E131_OFFSET_FRAMING_VECTOR = 40; // 32 bit, big endian
+const uint8_t E131_OFFSET_SEQUENCE = 111;
+const uint8_t E131_OFFSET_OPTIONS = 112;
+const uint8_t E131_OFFSET_UNIVERSE = 113; // 16 bit, big endian
+const uint8_t E131_OFFSET_DMP_VECTOR = 117;
+const uint8_t E131_OFFSET_COUNT = 123; // Number of DMX property values including the start code, 16 bit, big endian
+const uint8_t E131_OFFSET_START_CODE = 125;
+const uint8_t E131_ID[12] = {'A', 'S', 'C', '-', 'E', '1', '.', '1', '7', 0, 0, 0};
+const uint32_t E131_ROOT_VECTOR_DATA = 0x00000004;
+const uint32_t E131_FRAMING_VECTOR_DATA = 0x00000002;
+const uint8_t E131_DMP_VECTOR_SET_PROPERTY = 0x02;
+const uint8_t E131_START_CODE_DMX = 0x00; // Other start codes carry no levels, e.g. 0xDD: per-channel priorities
+const uint8_t E131_OPTION_PREVIEW = 0x80; // Data for visualization only, not for the leds
+const uint8_t E131_OPTION_TERMINATED = 0x40; // Source stops sending
+const uint32_t E131_MULTICAST_BASE = 0xEFFF0000; // 239.255.<universe high byte>.<universe low byte>
+const uint8_t E131_MULTICAST_MAX = 7; // Multicast groups joined, lwIP supports 8 per interface (one for all hosts)
+const uint16_t E131_UNIVERSE_FIRST = 1;
+const uint16_t E131_UNIVERSE_SIZE = 510; // Bytes of pixel data per universe, i.e. 170 pixels
+
+/**
+ * Receives frames of up to N leds. The network task calls poll(), which writes the pixel data of each packet
+ * directly into the write buffer at the offset given by the packet. A complete frame (DDP push flag, or the
+ * universe containing the last led for E1.31) is published by exchanging buffer pointers. The render task
+ * takes the frame by exchanging it with its own back buffer, so pixel data is never copied.
+ * Packets are only received while their pixel data fits into the framebuffer, excess data is discarded.
+ * E1.31 is received via unicast and via multicast for the first E131_MULTICAST_MAX universes, i.e. longer strips
+ * need a unicast source.
+ */
+template <uint16_t N>
+class PixelStream
+{
+public:
+    /**
+     * Opens the DDP and E1.31 sockets. The two buffers (N leds each) become part of the exchange.
+     * Returns false, if a socket could not be opened.
+     */
+    bool begin(CRGB* bufferA, CRGB* bufferB, uint16_t numLeds)
+    {
+        write_ = bufferA;
+        ready_ = bufferB;
+        numLeds_ = numLeds;
+
+        ddpSocket_ = openSocket(DDP_PORT);
+        e131Socket_ = openSocket(E131_PORT);
+
+        if (e131Socket_ >= 0)
+        {
+            joinUniverses();
+        }
+
+        return ddpSocket_ >= 0 && e131Socket_ >= 0;
+    }
+
+    /**
+     * Network task: waits up to timeout (ms) for packets and processes all packets received.
+     */
+    void poll(uint32_t timeout)
+    {
+        fd_set sockets;
+        FD_ZERO(&sockets);
+        FD_SET(ddpSocket_, &sockets);
+        FD_SET(e131Socket_, &sockets);
+
+        struct timeval tv;
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+
+        int maxSocket = (ddpSocket_ > e131Socket_) ? ddpSocket_ : e131Socket_;
+
+        if (select(maxSocket + 1, &sockets, nullptr, nullptr, &tv) <= 0)
+        {
+            return;
+        }
+
+        if (FD_ISSET(ddpSocket_, &sockets))
+        {
+            while (receiveDdp()) {}
+        }
+
+        if (FD_ISSET(e131Socket_, &sockets))
+        {
+            while (receiveE131()) {}
+        }
+    }
+
+    /**
+     * Render task: exchanges leds with the latest complete frame. Returns false, if there is no new frame.
+     */
+    bool take(CRGB*& leds)
+    {
+        bool fresh;
+
+        portENTER_CRITICAL(&mux_);
+        fresh = fresh_;
+
+        if (fresh)
+        {
+            CRGB* frame = ready_;
+            ready_ = leds;
+            leds = frame;
+            fresh_ = false;
+        }
+
+        portEXIT_CRITICAL(&mux_);
+
+        return fresh;
+    }
+
+    /**
+     * Time (us since boot) of the latest complete frame, zero if no frame has been received yet.
+     */
+    int64_t lastFrameAt() const
+    {
+        // 64 bit are not read atomically, the network task writes on the other core
+        portENTER_CRITICAL(&mux_);
+        int64_t at = lastFrameAt_;
+        portEXIT_CRITICAL(&mux_);
+
+        return at;
+    }
+
+    /**
+     * True, if the source announced the end of the stream (E1.31).
+     */
+    bool terminated() const
+    {
+        return terminated_;
+    }
+
+    uint32_t packets() const { return packets_; } // Packets received
+    uint32_t packetsLost() const { return packetsLost_; } // Gaps in the sequence numbers
+    uint32_t frames() const { return frames_; } // Complete frames received
+    uint32_t framesLate() const { return framesLate_; } // Frames replaced by the next one before the render task took them
+
+private:
+    CRGB* write_ = nullptr; // Frame being received (network task)
+    CRGB* ready_ = nullptr; // Latest complete frame
+    volatile bool fresh_ = false; // The latest complete frame has not been taken yet
+    mutable portMUX_TYPE mux_ = portMUX_INITIALIZER_UNLOCKED;
+    uint16_t numLeds_ = 0;
+
+    int ddpSocket_ = -1;
+    int e131Socket_ = -1;
+    uint8_t header_[E131_HEADER_SIZE]; // Packet header, the pixel data is received into the framebuffer
+    uint8_t ddpSeq_ = 0;
+
+    // E1.31: sequence numbers are counted per universe
+    static const uint16_t NUM_UNIVERSES = ((uint32_t) N * sizeof(CRGB) + E131_UNIVERSE_SIZE - 1) / E131_UNIVERSE_SIZE;
+    uint8_t e131Seq_[NUM_UNIVERSES] = {};
+    bool e131SeqValid_[NUM_UNIVERSES] = {};
+
+    int64_t lastFrameAt_ = 0; // Guarded by mux_
+    volatile bool terminated_ = false;
+    volatile uint32_t packets_ = 0;
+    volatile uint32_t packetsLost_ = 0;
+    volatile uint32_t frames_ = 0;
+    volatile uint32_t framesLate_ = 0;
+
+    /**
+     * Non-blocking UDP socket bound to the given port on all interfaces, -1 on failure.
+     */
+    static int openSocket(uint16_t port)
+    {
+        int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+        if (sock < 0)
+        {
+            return -1;
+        }
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+        if (bind(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0)
+        {
+            close(sock);
+            return -1;
+        }
+
+        fcntl(sock, F_SETFL, O_NONBLOCK);
+
+        return sock;
+    }
+
+    /**
+     * Joins the multicast groups of the universes needed by the led strip.
+     */
+    void joinUniverses()
+    {
+        uint16_t numUniverses = ((uint32_t) numLeds_ * sizeof(CRGB) + E131_UNIVERSE_SIZE - 1) / E131_UNIVERSE_SIZE;
+
+        if (numUniverses > E131_MULTICAST_MAX)
+        {
+            numUniverses = E131_MULTICAST_MAX;
+        }
+
+        for (uint16_t universeNr = 0; universeNr < numUniverses; universeNr++)
+        {
+            struct ip_mreq group;
+            group.imr_multiaddr.s_addr = htonl(E131_MULTICAST_BASE + E131_UNIVERSE_FIRST + universeNr);
+            group.imr_interface.s_addr = htonl(INADDR_ANY);
+            setsockopt(e131Socket_, IPPROTO_IP, IP_ADD_MEMBERSHIP, &group, sizeof(group));
+        }
+    }
+
+    /**
+     * Big endian 32-bit value of the header at the given offset.
+     */
+    uint32_t header32(uint8_t offset) const
+    {
+        return ((uint32_t) header_[offset] << 24) | ((uint32_t) header_[offset + 1] << 16) |
+            ((uint32_t) header_[offset + 2] << 8) | header_[offset + 3];
+    }
+
+    /**
+     * Receives the next datagram: the header into header_ and the pixel data directly into the write buffer at the
+     * given byte offset, at most length bytes. Must follow a peek of the header.
+     */
+    void receiveInto(int sock, uint8_t headerSize, uint32_t offset, uint32_t length)
+    {
+        struct iovec iov[2];
+        iov[0].iov_base = header_;
+        iov[0].iov_len = headerSize;
+        iov[1].iov_base = (uint8_t*) write_ + offset;
+        iov[1].iov_len = length;
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = (length > 0) ? 2 : 1;
+
+        recvmsg(sock, &msg, 0);
+    }
+
+    /**
+     * Discards the next datagram.
+     */
+    void discard(int sock)
+    {
+        recv(sock, header_, 1, 0);
+    }
+
+    /**
+     * Pixel data bytes of a packet which fit into the framebuffer at the given offset.
+     */
+    uint32_t fitting(uint32_t offset, uint32_t length) const
+    {
+        uint32_t capacity = (uint32_t) numLeds_ * sizeof(CRGB);
+
+        if (offset >= capacity)
+        {
+            return 0;
+        }
+
+        return (length > capacity - offset) ? capacity - offset : length;
+    }
+
+    /**
+     * Processes one DDP packet. Returns false, if no packet is pending.
+     */
+    bool receiveDdp()
+    {
+        int size = recv(ddpSocket_, header_, DDP_HEADER_SIZE_TIME, MSG_PEEK);
+
+        if (size < 0)
+        {
+            return false;
+        }
+
+        uint8_t flags = header_[0];
+        uint8_t headerSize = (flags & DDP_FLAG_TIME) ? DDP_HEADER_SIZE_TIME : DDP_HEADER_SIZE;
+
+        if (size < headerSize || (flags & DDP_FLAG_VERSION_MASK) != DDP_FLAG_VERSION_1 || (flags & DDP_FLAG_QUERY))
+        {
+            discard(ddpSocket_);
+            return true;
+        }
+
+        uint32_t offset = ((uint32_t) header_[4] << 24) | ((uint32_t) header_[5] << 16) |
+            ((uint32_t) header_[6] << 8) | header_[7];
+        uint32_t length = ((uint32_t) header_[8] << 8) | header_[9];
+
+        receiveInto(ddpSocket_, headerSize, offset, fitting(offset, length));
+        packets_++;
+
+        // Sequence numbers 1 ... 15, wrapping
+        uint8_t seq = header_[1] & DDP_SEQ_MASK;
+
+        if (seq != 0 && ddpSeq_ != 0)
+        {
+            uint8_t expected = (ddpSeq_ % 15) + 1;
+            packetsLost_ += (seq + 15 - expected) % 15;
+        }
+
+        ddpSeq_ = seq;
+        terminated_ = false;
+
+        if (flags & DDP_FLAG_PUSH)
+        {
+            publish();
+        }
+
+        return true;
+    }
+
+    /**
+     * Processes one E1.31 data packet. Returns false, if no packet is pending.
+     */
+    bool receiveE131()
+    {
+        int size = recv(e131Socket_, header_, E131_HEADER_SIZE, MSG_PEEK);
+
+        if (size < 0)
+        {
+            return false;
+        }
+
+        // Only E1.31 data packets with DMX levels, no previews
+        if (size < E131_HEADER_SIZE || memcmp(header_ + E131_OFFSET_ID, E131_ID, sizeof(E131_ID)) != 0 ||
+            header32(E131_OFFSET_ROOT_VECTOR) != E131_ROOT_VECTOR_DATA ||
+            header32(E131_OFFSET_FRAMING_VECTOR) != E131_FRAMING_VECTOR_DATA ||
+            header_[E131_OFFSET_DMP_VECTOR] != E131_DMP_VECTOR_SET_PROPERTY ||
+            header_[E131_OFFSET_START_CODE] != E131_START_CODE_DMX ||
+            (header_[E131_OFFSET_OPTIONS] & E131_OPTION_PREVIEW))
+        {
+            discard(e131Socket_);
+            return true;
+        }
+
+        uint16_t universe = ((uint16_t) header_[E131_OFFSET_UNIVERSE] << 8) | header_[E131_OFFSET_UNIVERSE + 1];
+        uint16_t count = ((uint16_t) header_[E131_OFFSET_COUNT] << 8) | header_[E131_OFFSET_COUNT + 1];
+
+        if (universe < E131_UNIVERSE_FIRST || universe >= E131_UNIVERSE_FIRST + NUM_UNIVERSES || count < 1)
+        {
+            discard(e131Socket_);
+            return true;
+        }
+
+        uint32_t offset = (uint32_t) (universe - E131_UNIVERSE_FIRST) * E131_UNIVERSE_SIZE;
+        uint32_t length = count - 1;
+
+        if (length > E131_UNIVERSE_SIZE)
+        {
+            length = E131_UNIVERSE_SIZE;
+        }
+
+        // Sequence numbers 0 ... 255, wrapping: packets up to 20 numbers behind are out of order (E1.31 6.7.2)
+        uint16_t universeNr = universe - E131_UNIVERSE_FIRST;
+        uint8_t seq = header_[E131_OFFSET_SEQUENCE];
+
+        if (e131SeqValid_[universeNr])
+        {
+            int8_t diff = (int8_t) (seq - e131Seq_[universeNr]);
+
+            if (diff <= 0 && diff > -20)
+            {
+                discard(e131Socket_);
+                return true;
+            }
+
+            packetsLost_ += (uint8_t) (seq - e131Seq_[universeNr] - 1);
+        }
+
+        receiveInto(e131Socket_, E131_HEADER_SIZE, offset, fitting(offset, length));
+        packets_++;
+
+        e131Seq_[universeNr] = seq;
+        e131SeqValid_[universeNr] = true;
+        terminated_ = (header_[E131_OFFSET_OPTIONS] & E131_OPTION_TERMINATED) != 0;
+
+        // The universe containing the last led completes the frame
+        uint32_t frameEnd = (uint32_t) numLeds_ * sizeof(CRGB);
+
+        if (offset < frameEnd && offset + E131_UNIVERSE_SIZE >= frameEnd)
+        {
+            publish();
+        }
+
+        return true;
+    }
+
+    /**
+     * Makes the received frame the latest complete frame. The next frame is received into the previous one,
+     * i.e. senders are expected to send all leds with each frame.
+     */
+    void publish()
+    {
+        portENTER_CRITICAL(&mux_);
+
+        CRGB* frame = write_;
+        write_ = ready_;
+        ready_ = frame;
+
+        if (fresh_)
+        {
+            framesLate_++;
+        }
+
+        fresh_ = true;
+
+        lastFrameAt_ = esp_timer_get_time();
+
+        portEXIT_CRITICAL(&mux_);
+
+        frames_++;
+    }
+};
+
+#endif // PIXEL_STREAM_H
@@ -0,0 +1,449 @@
+/**
+    Procedural.h:
+    Procedural light effects: noise flow, fire and twinkling leds. The colors are
+    taken from lookup tables, the simulations use fixed-point arithmetic and keep
+    their state between frames, i.e. each frame only advances them by its
+    duration.
+
+    Copyright (C) 2020 by Ernst Sikora
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PROCEDURAL_H
+#define PROCEDURAL_H
+
+#include <FastLED.h>
+
+#include "Effect.h"
+#include "Effects.h"
+#include "PixelKernels.h"
+
+// Light effect "Noise" constants
+const uint16_t RENDER_NOISE_STEP_TIME_INIT = 500; // ms, default speed, i.e. time between two rows of the noise lattice
+const uint8_t RENDER_NOISE_CELL_BITS = 3; // Leds between two columns of the noise lattice: 2^3 = 8
+const uint16_t RENDER_NOISE_CELL_LEDS = 1 << RENDER_NOISE_CELL_BITS;
+
+// Light effect "Fire" constants
+const uint16_t RENDER_FIRE_STEP_TIME_INIT = 100; // ms, default speed
+const uint8_t RENDER_FIRE_TICKS_PER_STEP = 6; // Simulation ticks per step, i.e. 60 per second at default speed
+const uint8_t RENDER_FIRE_TICKS_MAX = 4; // Maximum number of ticks per frame, ticks beyond are dropped after a stall
+const uint8_t RENDER_FIRE_COOLING = 55; // Average cooling per tick, relative to the length of the fire
+const uint8_t RENDER_FIRE_SPARKING = 120; // Probability of a new spark per tick (1/256)
+const uint8_t RENDER_FIRE_SPARK_ZONE = 7; // Number of leds at the base of the fire where sparks appear
+
+// Light effect "Twinkle" constants
+const uint16_t RENDER_TWINKLE_STEP_TIME_INIT = 100; // ms, default speed, i.e. time between two spawns
+const uint8_t RENDER_TWINKLE_RISE_STEPS = 4; // Steps until a twinkling led reaches full brightness
+const uint8_t RENDER_TWINKLE_FALL_STEPS = 12; // Steps until it has faded out again
+const uint8_t RENDER_TWINKLE_DENSITY = 8; // Leds starting to twinkle per step and 1000 leds
+
+/**
+ * Smooth interpolation weight (smoothstep 3t^2 - 2t^3) for t = 0 ... 256, returns 0 ... 256.
+ */
+inline uint16_t noiseSmooth(uint16_t t)
+{
+    uint32_t t32 = (t > 256) ? 256 : t;
+    return (uint16_t) ((t32 * t32 * (3 * 256 - 2 * t32)) >> 16);
+}
+
+/**
+ * Light effect "Noise": slowly flowing blobs of color, i.e. value noise in position and time. The noise lattice
+ * has one column per 8 leds and one row per step. With each step, the lattice values of the next row are drawn,
+ * each frame interpolates the columns between the two current rows and each led between its two columns.
+ */
+template <uint16_t N>
+class EffectNoise : public Effect
+{
+public:
+    EffectNoise() : Effect("Noise", RENDER_NOISE_STEP_TIME_INIT)
+    {
+        // Palette: aqua to purple, getting brighter with the noise value
+        for (uint16_t v = 0; v < 256; v++)
+        {
+            palette_[v] = CHSV(128 + v / 2, 255, 40 + (v * 215) / 255);
+        }
+
+        for (uint8_t offset = 0; offset < RENDER_NOISE_CELL_LEDS; offset++)
+        {
+            weight_[offset] = noiseSmooth(offset << (8 - RENDER_NOISE_CELL_BITS));
+        }
+    }
+
+    void begin(uint16_t numLeds) override
+    {
+        Effect::begin(numLeds);
+        numColumns_ = (numLeds >> RENDER_NOISE_CELL_BITS) + 2;
+        seek(0);
+    }
+
+    bool update(uint32_t dt) override
+    {
+        bool changed = Effect::update(dt);
+
+        if (paused && !changed)
+        {
+            return false;
+        }
+
+        // Time within the current row (0 ... 256), eased like the positions between two columns
+        int32_t stepTimeUs = (int32_t) stepTime * 1000;
+        int32_t remaining = nextStepIn();
+        remaining = (remaining < 0) ? 0 : ((remaining > stepTimeUs) ? stepTimeUs : remaining);
+        uint16_t t = noiseSmooth(((stepTimeUs - remaining) << 8) / stepTimeUs);
+
+        for (uint16_t columnNr = 0; columnNr < numColumns_; columnNr++)
+        {
+            column_[columnNr] = (from_[columnNr] * (256 - t) + to_[columnNr] * t) >> 8;
+        }
+
+        return true;
+    }
+
+    void seek(int32_t position) override
+    {
+        Effect::seek(position);
+        drawRow(from_, position);
+        drawRow(to_, position + 1);
+    }
+
+    void render(LedSpan leds) const override
+    {
+        for (uint16_t ledNr = 0; ledNr < leds.size; ledNr++)
+        {
+            uint16_t columnNr = ledNr >> RENDER_NOISE_CELL_BITS;
+            uint16_t w = weight_[ledNr & (RENDER_NOISE_CELL_LEDS - 1)];
+            uint8_t v = (column_[columnNr] * (256 - w) + column_[columnNr + 1] * w) >> 8;
+
+            leds[ledNr] = palette_[v];
+        }
+    }
+
+protected:
+    void step() override
+    {
+        memcpy(from_, to_, numColumns_);
+        drawRow(to_, position_ + 1);
+    }
+
+private:
+    static const uint16_t NUM_COLUMNS_MAX = (N >> RENDER_NOISE_CELL_BITS) + 2;
+
+    CRGB palette_[256];
+    uint16_t weight_[RENDER_NOISE_CELL_LEDS];
+    uint8_t from_[NUM_COLUMNS_MAX]; // Lattice values of the current row
+    uint8_t to_[NUM_COLUMNS_MAX]; // Lattice values of the next row
+    uint8_t column_[NUM_COLUMNS_MAX]; // Lattice values at the current time
+    uint16_t numColumns_ = 0;
+
+    /**
+     * Draws the lattice values of a row, determined by the row number.
+     */
+    void drawRow(uint8_t* row, int32_t rowNr)
+    {
+        for (uint16_t columnNr = 0; columnNr < numColumns_; columnNr++)
+        {
+            row[columnNr] = stepRandom(rowNr * 7919 + columnNr) >> 24;
+        }
+    }
+};
+
+/**
+ * Light effect "Fire": heat rises from the first led, diffuses and cools down. Sparks near the first led add
+ * heat. The heat of each led is kept and advanced by a fixed number of simulation ticks per step, the colors
+ * are taken from a heat palette (black, red, yellow, white). The random numbers of the ticks are drawn from the
+ * step number, i.e. lamps showing the same steps converge to the same heat field within a few steps, as cooling
+ * and diffusion wear off differences, also after seek().
+ */
+template <uint16_t N>
+class EffectFire : public Effect
+{
+public:
+    EffectFire() : Effect("Fire", RENDER_FIRE_STEP_TIME_INIT)
+    {
+        for (uint16_t heat = 0; heat < 256; heat++)
+        {
+            uint8_t t192 = ((uint16_t) heat * 192) >> 8;
+            uint8_t ramp = (t192 & 0x3F) << 2;
+
+            if (t192 & 0x80)
+            {
+                palette_[heat] = CRGB(255, 255, ramp);
+            }
+            else if (t192 & 0x40)
+            {
+                palette_[heat] = CRGB(255, ramp, 0);
+            }
+            else
+            {
+                palette_[heat] = CRGB(ramp, 0, 0);
+            }
+        }
+    }
+
+    void begin(uint16_t numLeds) override
+    {
+        Effect::begin(numLeds);
+        memset(heat_, 0, sizeof(heat_));
+        startTicks();
+        uint16_t coolingMax = (RENDER_FIRE_COOLING * 10) / (numLeds > 0 ? numLeds : 1) + 2;
+        coolingMax_ = (coolingMax > 255) ? 255 : coolingMax;
+    }
+
+    bool update(uint32_t dt) override
+    {
+        // A step completes the ticks of the previous step, see step()
+        ticksFrame_ = 0;
+        bool changed = Effect::update(dt);
+
+        if (paused)
+        {
+            return changed;
+        }
+
+        // Simulation ticks of the current step which have become due by the end of this frame
+        int32_t stepTimeUs = (int32_t) stepTime * 1000;
+        int32_t remaining = nextStepIn();
+        remaining = (remaining < 0) ? 0 : ((remaining > stepTimeUs) ? stepTimeUs : remaining);
+        uint8_t ticksDue = (uint8_t) (((int64_t) (stepTimeUs - remaining) * RENDER_FIRE_TICKS_PER_STEP) / stepTimeUs);
+
+        return runTicks(ticksDue) || changed;
+    }
+
+    void seek(int32_t position) override
+    {
+        Effect::seek(position);
+        startTicks();
+    }
+
+    void render(LedSpan leds) const override
+    {
+        for (uint16_t ledNr = 0; ledNr < leds.size; ledNr++)
+        {
+            leds[ledNr] = palette_[heat_[ledNr]];
+        }
+    }
+
+protected:
+    void step() override
+    {
+        runTicks(RENDER_FIRE_TICKS_PER_STEP);
+        startTicks();
+    }
+
+private:
+    CRGB palette_[256];
+    uint8_t heat_[N];
+    uint32_t random_ = 1; // State of the random number generator, seeded by the step number
+    uint8_t ticksDone_ = 0; // Ticks of the current step performed
+    uint8_t ticksFrame_ = 0; // Ticks performed in the current frame
+    uint8_t coolingMax_ = 2; // Maximum cooling of a led per tick
+
+    /**
+     * Starts the ticks of the current step.
+     */
+    void startTicks()
+    {
+        random_ = stepRandom(position_) | 1;
+        ticksDone_ = 0;
+    }
+
+    /**
+     * Performs the ticks of the current step up to the given number, at most RENDER_FIRE_TICKS_MAX per frame.
+     * Returns true, if a tick has been performed.
+     */
+    bool runTicks(uint8_t ticksDue)
+    {
+        bool ticked = false;
+
+        while (ticksDone_ < ticksDue && ticksFrame_ < RENDER_FIRE_TICKS_MAX)
+        {
+            tick();
+            ticksDone_++;
+            ticksFrame_++;
+            ticked = true;
+        }
+
+        return ticked;
+    }
+
+    /**
+     * Pseudo-random number (xorshift), faster than random() and repeatable from the start of a step.
+     */
+    uint32_t nextRandom()
+    {
+        random_ ^= random_ << 13;
+        random_ ^= random_ >> 17;
+        random_ ^= random_ << 5;
+        return random_;
+    }
+
+    /**
+     * Advances the simulation: cooling, diffusion away from the base and sparks.
+     */
+    void tick()
+    {
+        // Cooling by random values below coolingMax_ (four leds per random number), followed by the diffusion
+        // in the same pass: the new heat of a led is (a + 2b) / 3 of the cooled heat of the two leds before it.
+        // The multiplication by 171 / 512 avoids the division.
+        uint32_t r = 0;
+        uint16_t cooled1 = 0; // Cooled heat of the previous led
+        uint16_t cooled2 = 0; // Cooled heat of the led before the previous one
+
+        for (uint16_t ledNr = 0; ledNr < numLeds_; ledNr++)
+        {
+            r = ((ledNr & 3) == 0) ? nextRandom() : r >> 8;
+            uint8_t cooling = ((r & 0xFF) * coolingMax_) >> 8;
+            uint16_t cooled = (heat_[ledNr] > cooling) ? heat_[ledNr] - cooling : 0;
+
+            heat_[ledNr] = (ledNr < 2) ? cooled : ((cooled1 + 2 * cooled2) * 171) >> 9;
+            cooled2 = cooled1;
+            cooled1 = cooled;
+        }
+
+        r = nextRandom();
+
+        if ((r & 0xFF) < RENDER_FIRE_SPARKING && numLeds_ > 0)
+        {
+            uint16_t ledNr = ((r >> 8) & 0xFF) % (numLeds_ < RENDER_FIRE_SPARK_ZONE ? numLeds_ : RENDER_FIRE_SPARK_ZONE);
+            uint16_t heat = heat_[ledNr] + 160 + ((r >> 16) & 0x5F);
+            heat_[ledNr] = (heat > 255) ? 255 : heat;
+        }
+    }
+};
+
+// State of a twinkling led
+typedef struct Twinkle {
+    uint16_t ledNr = 0; // Position on the led strip
+    uint16_t level = 0; // Brightness (8.8 fixed-point)
+    uint8_t color = 0; // Index into the palette
+    bool rising = false;
+} t_Twinkle;
+
+/**
+ * Light effect "Twinkle": random leds light up and fade out again in warm colors. With each step, new leds start
+ * twinkling. Each frame advances the brightness of the twinkling leds by the frame duration, only these leds are
+ * kept in a list and updated.
+ */
+template <uint16_t N>
+class EffectTwinkle : public Effect
+{
+public:
+    EffectTwinkle() : Effect("Twinkle", RENDER_TWINKLE_STEP_TIME_INIT)
+    {
+        // Palette: warm white to gold, brightness curve: quadratic, i.e. a slow start like a candle
+        for (uint16_t i = 0; i < 256; i++)
+        {
+            palette_[i] = CHSV(20 + i / 8, 80 + i / 2, 255);
+            curve_[i] = (i * i + 255) >> 8;
+        }
+    }
+
+    void begin(uint16_t numLeds) override
+    {
+        Effect::begin(numLeds);
+        memset(lit_, 0, sizeof(lit_));
+        numActive_ = 0;
+    }
+
+    bool update(uint32_t dt) override
+    {
+        bool changed = Effect::update(dt);
+
+        if (paused || numActive_ == 0)
+        {
+            return changed;
+        }
+
+        // Brightness change within this frame (8.8 fixed-point)
+        const uint32_t stepTimeUs = (uint32_t) stepTime * 1000;
+        const uint32_t rise = ((uint64_t) dt * (255 << 8)) / (stepTimeUs * RENDER_TWINKLE_RISE_STEPS);
+        const uint32_t fall = ((uint64_t) dt * (255 << 8)) / (stepTimeUs * RENDER_TWINKLE_FALL_STEPS);
+
+        // Advance the twinkling leds, those which have faded out are removed from the list
+        uint16_t numKept = 0;
+
+        for (uint16_t i = 0; i < numActive_; i++)
+        {
+            t_Twinkle tw = active_[i];
+
+            if (tw.rising)
+            {
+                uint32_t level = tw.level + rise;
+                tw.rising = (level < (255 << 8));
+                tw.level = tw.rising ? level : (255 << 8);
+            }
+            else if (tw.level > fall)
+            {
+                tw.level -= fall;
+            }
+            else
+            {
+                lit_[tw.ledNr] = false;
+                continue;
+            }
+
+            active_[numKept++] = tw;
+        }
+
+        numActive_ = numKept;
+
+        return true;
+    }
+
+    void render(LedSpan leds) const override
+    {
+        pixelFill(leds.data, leds.size, CRGB(0, 0, 0));
+
+        for (uint16_t i = 0; i < numActive_; i++)
+        {
+            const t_Twinkle& tw = active_[i];
+            CRGB c = palette_[tw.color];
+            leds[tw.ledNr] = c.nscale8(curve_[tw.level >> 8]);
+        }
+    }
+
+protected:
+    void step() override
+    {
+        // Leds starting to twinkle, determined by the step number (see stepRandom)
+        uint16_t count = ((uint32_t) numLeds_ * RENDER_TWINKLE_DENSITY + 999) / 1000;
+        uint32_t r = stepRandom(position_);
+
+        for (uint16_t i = 0; i < count && numLeds_ > 0; i++)
+        {
+            r = stepRandom(r);
+            uint16_t ledNr = (r >> 8) % numLeds_;
+
+            if (!lit_[ledNr])
+            {
+                t_Twinkle& tw = active_[numActive_++];
+                tw.ledNr = ledNr;
+                tw.level = 0;
+                tw.color = r & 0xFF;
+                tw.rising = true;
+                lit_[ledNr] = true;
+            }
+        }
+    }
+
+private:
+    CRGB palette_[256];
+    uint8_t curve_[256];
+    bool lit_[N]; // Led is twinkling, i.e. in the list
+    t_Twinkle active_[N]; // Twinkling leds
+    uint16_t numActive_ = 0; // Number of twinkling leds
+};
+
+#endif // PROCEDURAL_H
@@ -0,0 +1,206 @@
+/**
+    SpritePool.h:
+    Fixed-capacity pool of sprites moving along the led strip with
+    sub-pixel resolution.
+
+    Copyright (C) 2020 by Ernst Sikora
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SPRITE_POOL_H
+#define SPRITE_POOL_H
+
+#include <FastLED.h>
+
+#include "Effect.h"
+#include "PixelKernels.h"
+
+// Sprites: fixed-point resolution of position and velocity, i.e. 256 units per led
+const uint8_t SPRITE_FRAC_BITS = 8;
+const int32_t SPRITE_ONE_LED = 1 << SPRITE_FRAC_BITS;
+
+// Sprite moving along the led strip
+typedef struct LedSprite {
+    int16_t activateAt = -1; // Step at which a scheduled sprite shall be activated
+    int32_t pos = 0; // Current position of the sprite in 1/256 leds (24.8 fixed-point)
+    int16_t vel = 0; // Velocity of the sprite in 1/256 leds per step (8.8 fixed-point), positive or negative
+    CRGB color = CRGB(255, 255, 255); // Color of the sprite
+} t_LedSprite;
+
+/**
+ * Pool of up to N sprites. Free slots are kept on a free list and active sprites in a dense list, so spawning
+ * and removing a sprite is O(1) and moving and drawing cost is proportional to the number of active sprites only.
+ * Sprites are drawn anti-aliased with additive blending.
+ */
+template <uint16_t N>
+class SpritePool
+{
+public:
+    SpritePool()
+    {
+        clear();
+    }
+
+    /**
+     * Inserts a sprite which is active immediately. Returns false, if the pool is exhausted.
+     */
+    bool spawn(const t_LedSprite& sprite)
+    {
+        if (numFree_ == 0)
+        {
+            return false;
+        }
+
+        uint16_t id = freeList_[--numFree_];
+        sprites_[id] = sprite;
+        active_[numActive_++] = id;
+        return true;
+    }
+
+    /**
+     * Inserts a sprite which becomes active when activate() is called with its activation step.
+     * Returns false, if the pool is exhausted.
+     */
+    bool schedule(const t_LedSprite& sprite)
+    {
+        if (numFree_ == 0)
+        {
+            return false;
+        }
+
+        uint16_t id = freeList_[--numFree_];
+        sprites_[id] = sprite;
+        pending_[numPending_++] = id;
+        return true;
+    }
+
+    /**
+     * Activates the scheduled sprites of the given step number.
+     */
+    void activate(int16_t stepNr)
+    {
+        uint16_t i = 0;
+
+        while (i < numPending_)
+        {
+            uint16_t id = pending_[i];
+
+            if (sprites_[id].activateAt == stepNr)
+            {
+                active_[numActive_++] = id;
+                pending_[i] = pending_[--numPending_];
+            }
+            else
+            {
+                i++;
+            }
+        }
+    }
+
+    /**
+     * Moves all active sprites by scale (1/256) of their velocity, e.g. by the fraction of a step elapsed
+     * within the current frame. Removes sprites that moved outside a led strip with numLeds leds.
+     */
+    void move(uint16_t numLeds, uint16_t scale)
+    {
+        const int32_t posMax = (int32_t) numLeds << SPRITE_FRAC_BITS;
+        uint16_t i = 0;
+
+        while (i < numActive_)
+        {
+            uint16_t id = active_[i];
+            t_LedSprite& sp = sprites_[id];
+
+            // Rounded to nearest, symmetrically for both directions (a plain shift rounds negative values down)
+            int32_t delta = (int32_t) sp.vel * scale;
+            int32_t half = SPRITE_ONE_LED / 2;
+            sp.pos += (delta >= 0) ? (delta + half) >> SPRITE_FRAC_BITS : -((half - delta) >> SPRITE_FRAC_BITS);
+
+            if (sp.pos <= -SPRITE_ONE_LED || sp.pos >= posMax)
+            {
+                // Remove by moving the last active sprite into this slot of the dense list
+                active_[i] = active_[--numActive_];
+                freeList_[numFree_++] = id;
+            }
+            else
+            {
+                i++;
+            }
+        }
+    }
+
+    /**
+     * Sets all led colors to black and adds the colors of all active sprites. A sprite between two leds
+     * is split between both of them according to its sub-pixel position.
+     */
+    void draw(LedSpan leds) const
+    {
+        pixelFill(leds.data, leds.size, CRGB(0, 0, 0));
+
+        for (uint16_t i = 0; i < numActive_; i++)
+        {
+            const t_LedSprite& sp = sprites_[active_[i]];
+
+            int32_t ledNr = sp.pos >> SPRITE_FRAC_BITS; // Arithmetic shift, i.e. rounds towards minus infinity
+            uint8_t frac = sp.pos & (SPRITE_ONE_LED - 1);
+
+            if (ledNr >= 0 && ledNr < leds.size)
+            {
+                CRGB c = sp.color;
+                leds[ledNr] += c.nscale8(255 - frac);
+            }
+
+            if (frac != 0 && ledNr + 1 >= 0 && ledNr + 1 < leds.size)
+            {
+                CRGB c = sp.color;
+                leds[ledNr + 1] += c.nscale8(frac);
+            }
+        }
+    }
+
+    /**
+     * Removes all sprites.
+     */
+    void clear()
+    {
+        for (uint16_t i = 0; i < N; i++)
+        {
+            freeList_[i] = N - 1 - i;
+        }
+
+        numFree_ = N;
+        numActive_ = 0;
+        numPending_ = 0;
+    }
+
+    /**
+     * Number of sprites currently shown.
+     */
+    uint16_t numActive() const
+    {
+        return numActive_;
+    }
+
+private:
+    t_LedSprite sprites_[N];
+    uint16_t freeList_[N]; // Stack of free slots
+    uint16_t active_[N]; // Dense list of active sprites
+    uint16_t pending_[N]; // Scheduled sprites waiting for activation
+    uint16_t numFree_ = 0;
+    uint16_t numActive_ = 0;
+    uint16_t numPending_ = 0;
+};
+
+#endif // SPRITE_POOL_H
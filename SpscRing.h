@@ -0,0 +1,99 @@
+/**
+    SpscRing.h:
+    Lock-free ring buffer for passing items from exactly one producer
+    task (or ISR) to exactly one consumer task.
+
+    Copyright (C) 2020 by Ernst Sikora
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <stdint.h>
+#include <atomic>
+
+/**
+ * Fixed-capacity single-producer/single-consumer ring buffer. The capacity N must be a power of two.
+ * Head and tail are free-running counters, i.e. the number of stored items is head - tail.
+ * Only the producer writes the head and only the consumer writes the tail, so no locks are needed.
+ */
+template <typename T, uint16_t N>
+class SpscRing
+{
+    static_assert(N > 0 && (N & (N - 1)) == 0, "Capacity of SpscRing must be a power of two");
+
+public:
+    /**
+     * Producer: appends an item. Returns false and counts the item as dropped, if the ring is full.
+     */
+    bool push(const T& item)
+    {
+        uint16_t head = head_.load(std::memory_order_relaxed);
+        uint16_t tail = tail_.load(std::memory_order_acquire);
+
+        if ((uint16_t) (head - tail) >= N)
+        {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        items_[head & (N - 1)] = item;
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Consumer: removes the oldest item. Returns false, if the ring is empty.
+     */
+    bool pop(T& item)
+    {
+        uint16_t tail = tail_.load(std::memory_order_relaxed);
+        uint16_t head = head_.load(std::memory_order_acquire);
+
+        if (head == tail)
+        {
+            return false;
+        }
+
+        item = items_[tail & (N - 1)];
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Number of items currently stored. Exact only when called by the producer or the consumer.
+     */
+    uint16_t size() const
+    {
+        return (uint16_t) (head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire));
+    }
+
+    /**
+     * Number of items dropped by push() because the ring was full.
+     */
+    uint32_t dropped() const
+    {
+        return dropped_.load(std::memory_order_relaxed);
+    }
+
+private:
+    T items_[N];
+    std::atomic<uint16_t> head_{0};
+    std::atomic<uint16_t> tail_{0};
+    std::atomic<uint32_t> dropped_{0};
+};
+
+#endif // SPSC_RING_H
@@ -0,0 +1,94 @@
+/**
+    StatusLed.h:
+    Status LED (a single WS2812 / SK6812 led) driven by the CPU on its own
+    output pin, independently of the led strip and its led library.
+
+    Copyright (C) 2020 by Ernst Sikora
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STATUS_LED_H
+#define STATUS_LED_H
+
+#include <Arduino.h>
+#include <FastLED.h>
+#include <soc/gpio_struct.h>
+
+// Bit timing of the led (ns)
+const uint16_t STATUS_LED_T0H = 300;     // High time of a 0 bit
+const uint16_t STATUS_LED_T1H = 600;     // High time of a 1 bit
+const uint16_t STATUS_LED_PERIOD = 1250; // Duration of a bit
+
+/**
+ * Status LED, transmitted only when its color or brightness changes. FastLED's ESP32 driver starts transmitting
+ * once all of its controllers have been handed their data, i.e. a controller of the status LED would have to be
+ * transmitted with every frame of the led strip. Instead, the 24 bits (30 us) of the single led are clocked out
+ * by the CPU with the interrupts of the calling core disabled. Must not be called while the led strip is
+ * transmitting on the same core, because the RMT interrupt refilling the strip data would be delayed.
+ * The pin must be below 32. Two transmissions have to be at least 80 us apart (reset time of the led).
+ */
+class StatusLed
+{
+public:
+    void begin(uint8_t pin)
+    {
+        pinMask_ = 1UL << pin;
+        pinMode(pin, OUTPUT);
+        digitalWrite(pin, LOW);
+    }
+
+    /**
+     * Transmits the color scaled by the brightness. The bit timing follows the current CPU clock, which is
+     * reduced in idle mode.
+     */
+    void show(const CRGB& color, uint8_t br)
+    {
+        uint8_t data[3] = {scale8_video(color.g, br), scale8_video(color.r, br), scale8_video(color.b, br)};
+        uint32_t cyclesPerUs = ESP.getCpuFreqMHz();
+        uint32_t t0h = cyclesPerUs * STATUS_LED_T0H / 1000;
+        uint32_t t1h = cyclesPerUs * STATUS_LED_T1H / 1000;
+        uint32_t period = cyclesPerUs * STATUS_LED_PERIOD / 1000;
+
+        portENTER_CRITICAL(&mux_);
+        uint32_t bitStart = ESP.getCycleCount() - period;
+
+        for (uint8_t i = 0; i < sizeof(data); i++)
+        {
+            for (uint8_t mask = 0x80; mask != 0; mask >>= 1)
+            {
+                uint32_t high = (data[i] & mask) ? t1h : t0h;
+
+                while (ESP.getCycleCount() - bitStart < period) {}
+
+                bitStart = ESP.getCycleCount();
+                GPIO.out_w1ts = pinMask_;
+
+                while (ESP.getCycleCount() - bitStart < high) {}
+
+                GPIO.out_w1tc = pinMask_;
+            }
+        }
+
+        while (ESP.getCycleCount() - bitStart < period) {}
+
+        portEXIT_CRITICAL(&mux_);
+    }
+
+private:
+    uint32_t pinMask_ = 0;
+    portMUX_TYPE mux_ = portMUX_INITIALIZER_UNLOCKED;
+};
+
+#endif // STATUS_LED_H
@@ -0,0 +1,58 @@
+/**
+    Bench.h:
+    Time measurement shared by the host benchmarks.
+
+    Copyright (C) 2020 by Ernst Sikora
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+#include <chrono>
+
+// Benchmark constants
+const double BENCH_TIME_MIN = 0.05; // s, minimum measuring time per case
+
+/**
+ * Calls frame() repeatedly for at least the minimum measuring time and returns the mean time per call (ns).
+ */
+template <typename F>
+static double measure(F frame)
+{
+    typedef std::chrono::steady_clock Clock;
+
+    uint32_t numFrames = 0;
+    uint32_t batch = 1;
+    Clock::time_point start = Clock::now();
+    double elapsed = 0;
+
+    while (elapsed < BENCH_TIME_MIN)
+    {
+        for (uint32_t i = 0; i < batch; i++)
+        {
+            frame();
+        }
+
+        numFrames += batch;
+        batch *= 2;
+        elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+    return elapsed * 1e9 / numFrames;
+}
+
+#endif // BENCH_H
@@ -0,0 +1,186 @@
+/**
+    KernelBench.cpp:
+    Host benchmark of the pixel kernels. Checks each kernel against a scalar
+    reference implementation, also for buffers which do not start at a word
+    boundary, and measures the time per led of both.
+    
+    Build and run from the repository directory:
+        g++ -O2 -std=gnu++11 -I bench/host -I . bench/KernelBench.cpp -o KernelBench
+        ./KernelBench
+
+    Copyright (C) 2020 by Ernst Sikora
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <vector>
+
+#include "Bench.h"
+#include "PixelKernels.h"
+
+// Benchmark constants
+const uint16_t BENCH_NUM_LEDS[] = {29, 600, 10000}; // Buffer lengths measured
+const uint16_t BENCH_CHECK_LEDS_MAX = 67; // Buffer lengths 0 ... 67 are checked
+const uint8_t BENCH_CHECK_OFFSETS = 4; // Byte offsets of the buffers checked
+
+// Checksum of all results, prevents the compiler from removing the kernels
+static uint32_t benchChecksum = 0;
+
+// Reference implementations: one channel at a time
+
+static void refFill(CRGB* leds, uint16_t numLeds, CRGB color)
+{
+    for (uint16_t ledNr = 0; ledNr < numLeds; ledNr++)
+    {
+        leds[ledNr] = color;
+    }
+}
+
+static void refScale(CRGB* leds, uint16_t numLeds, uint8_t scale)
+{
+    for (uint16_t ledNr = 0; ledNr < numLeds; ledNr++)
+    {
+        leds[ledNr].nscale8(scale);
+    }
+}
+
+static void refAdd(CRGB* leds, const CRGB* src, uint16_t numLeds)
+{
+    for (uint16_t ledNr = 0; ledNr < numLeds; ledNr++)
+    {
+        leds[ledNr] += src[ledNr];
+    }
+}
+
+static uint8_t refBlend8(uint8_t a, uint8_t b, uint16_t amount)
+{
+    return (a * (256 - amount) + b * amount) >> 8;
+}
+
+static void refBlend(CRGB* leds, const CRGB* src, uint16_t numLeds, uint16_t amount)
+{
+    for (uint16_t ledNr = 0; ledNr < numLeds; ledNr++)
+    {
+        leds[ledNr].r = refBlend8(leds[ledNr].r, src[ledNr].r, amount);
+        leds[ledNr].g = refBlend8(leds[ledNr].g, src[ledNr].g, amount);
+        leds[ledNr].b = refBlend8(leds[ledNr].b, src[ledNr].b, amount);
+    }
+}
+
+/**
+ * Fills a buffer with random colors.
+ */
+static void randomize(uint8_t* data, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        data[i] = random(0, 256);
+    }
+}
+
+/**
+ * Runs a kernel and its reference on copies of the same random buffers, for all lengths up to the check maximum
+ * and for all byte offsets of both buffers. Returns the number of results which differ.
+ */
+template <typename K, typename R>
+static uint32_t check(const char* name, K kernel, R reference)
+{
+    const size_t size = BENCH_CHECK_LEDS_MAX * 3 + BENCH_CHECK_OFFSETS;
+    alignas(4) uint8_t a[size], b[size], src[size];
+    uint32_t errors = 0;
+
+    for (uint16_t numLeds = 0; numLeds <= BENCH_CHECK_LEDS_MAX; numLeds++)
+    {
+        for (uint8_t offset = 0; offset < BENCH_CHECK_OFFSETS; offset++)
+        {
+            for (uint8_t srcOffset = 0; srcOffset < BENCH_CHECK_OFFSETS; srcOffset++)
+            {
+                randomize(a, size);
+                randomize(src, size);
+                memcpy(b, a, size);
+
+                kernel((CRGB*) (a + offset), (const CRGB*) (src + srcOffset), numLeds);
+                reference((CRGB*) (b + offset), (const CRGB*) (src + srcOffset), numLeds);
+
+                errors += (memcmp(a, b, size) != 0);
+            }
+        }
+    }
+
+    printf("%-12s %s\n", name, errors == 0 ? "ok" : "FAILED");
+
+    return errors;
+}
+
+/**
+ * Measures a kernel and its reference on aligned buffers and prints the time per led.
+ */
+template <typename K, typename R>
+static void bench(const char* name, K kernel, R reference)
+{
+    for (uint16_t numLeds : BENCH_NUM_LEDS)
+    {
+        std::vector<CRGB> leds(numLeds);
+        std::vector<CRGB> src(numLeds);
+        randomize((uint8_t*) src.data(), numLeds * 3);
+
+        double nsKernel = measure([&]()
+        {
+            kernel(leds.data(), src.data(), numLeds);
+            benchChecksum += leds[numLeds / 2].g;
+        });
+
+        double nsReference = measure([&]()
+        {
+            reference(leds.data(), src.data(), numLeds);
+            benchChecksum += leds[numLeds / 2].g;
+        });
+
+        printf("%-12s %6u %10.2f %10.2f %8.1f\n", name, numLeds, nsKernel / numLeds, nsReference / numLeds,
+            nsReference / nsKernel);
+    }
+}
+
+int main()
+{
+    const CRGB color(255, 128, 7);
+
+    // Kernels and references with a common signature: leds, source, number of leds
+    auto fill = [&](CRGB* leds, const CRGB*, uint16_t n) { pixelFill(leds, n, color); };
+    auto fillRef = [&](CRGB* leds, const CRGB*, uint16_t n) { refFill(leds, n, color); };
+    auto scale = [](CRGB* leds, const CRGB*, uint16_t n) { pixelScale(leds, n, 200); };
+    auto scaleRef = [](CRGB* leds, const CRGB*, uint16_t n) { refScale(leds, n, 200); };
+    auto add = [](CRGB* leds, const CRGB* src, uint16_t n) { pixelAdd(leds, src, n); };
+    auto addRef = [](CRGB* leds, const CRGB* src, uint16_t n) { refAdd(leds, src, n); };
+    auto blend = [](CRGB* leds, const CRGB* src, uint16_t n) { pixelBlend(leds, src, n, 97); };
+    auto blendRef = [](CRGB* leds, const CRGB* src, uint16_t n) { refBlend(leds, src, n, 97); };
+
+    uint32_t errors = 0;
+    errors += check("Fill", fill, fillRef);
+    errors += check("Scale", scale, scaleRef);
+    errors += check("Add", add, addRef);
+    errors += check("Blend", blend, blendRef);
+
+    printf("\n%-12s %6s %10s %10s %8s\n", "Kernel", "Leds", "ns/led", "ref ns/led", "speedup");
+
+    bench("Fill", fill, fillRef);
+    bench("Scale", scale, scaleRef);
+    bench("Add", add, addRef);
+    bench("Blend", blend, blendRef);
+
+    printf("Checksum: %u\n", benchChecksum);
+
+    return errors == 0 ? 0 : 1;
+}
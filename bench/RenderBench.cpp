@@ -0,0 +1,204 @@
+/**
+    RenderBench.cpp:
+    Host benchmark of the light effects. Measures the time per frame and per
+    led for several strip lengths and sprite densities, and checks the
+    procedural effects against their cost budget per led.
+    
+    Build and run from the repository directory:
+        g++ -O2 -std=gnu++11 -I bench/host -I . bench/RenderBench.cpp -o RenderBench
+        ./RenderBench
+
+    Copyright (C) 2020 by Ernst Sikora
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <vector>
+
+#include "Bench.h"
+#include "Compositor.h"
+#include "Effects.h"
+#include "Procedural.h"
+
+// Benchmark constants
+const uint16_t BENCH_NUM_LEDS[] = {29, 1000, 10000}; // Strip lengths measured
+const uint16_t BENCH_NUM_SPRITES[] = {1, 8, 32, 128}; // Sprite densities measured
+const uint32_t BENCH_TIME_FRAME = 20000; // us, frame duration passed to update(), i.e. 50 frames per second
+
+// Cost budget of an effect: time per led (update and render of one frame) on the longest strip measured
+typedef struct BenchBudget {
+    const char* name; // Name of the effect
+    double nsLed; // ns per led, upper limit
+} t_BenchBudget;
+
+// Published cost budgets of the procedural effects (host figures, see README). Fire: four simulation ticks per
+// frame, i.e. the most it catches up within one frame.
+const t_BenchBudget BENCH_BUDGETS[] = {
+    {"Noise", 4.0},
+    {"Fire", 12.0},
+    {"Twinkle", 2.0}
+};
+
+// Checksum of all rendered frames, prevents the compiler from removing the rendering
+static uint32_t benchChecksum = 0;
+
+// Number of effects exceeding their budget
+static uint16_t benchOverBudget = 0;
+
+/**
+ * Adds the colors of the first, middle and last led to the checksum. Summing all leds would dominate the
+ * time measured for the simple effects.
+ */
+static void consume(LedSpan leds)
+{
+    const uint16_t ledNrs[] = {0, (uint16_t) (leds.size / 2), (uint16_t) (leds.size - 1)};
+
+    for (uint16_t ledNr : ledNrs)
+    {
+        benchChecksum += leds[ledNr].r + leds[ledNr].g + leds[ledNr].b;
+    }
+}
+
+/**
+ * Prints one result line.
+ */
+static void report(const char* name, uint16_t numLeds, uint16_t numSprites, double nsFrame, const char* budget = "")
+{
+    printf("%-10s %6u %8u %12.0f %10.2f %s\n", name, numLeds, numSprites, nsFrame, nsFrame / numLeds, budget);
+}
+
+/**
+ * Checks the time per led against the budget of the effect, if it has one. Returns the text of the budget column.
+ */
+static const char* checkBudget(const char* name, uint16_t numLeds, double nsFrame)
+{
+    static char text[32];
+
+    if (numLeds != BENCH_NUM_LEDS[sizeof(BENCH_NUM_LEDS) / sizeof(BENCH_NUM_LEDS[0]) - 1])
+    {
+        return "";
+    }
+
+    for (const t_BenchBudget& budget : BENCH_BUDGETS)
+    {
+        if (strcmp(budget.name, name) == 0)
+        {
+            bool over = (nsFrame / numLeds > budget.nsLed);
+            benchOverBudget += over ? 1 : 0;
+            snprintf(text, sizeof(text), "%5.2f %s", budget.nsLed, over ? "OVER" : "ok");
+            return text;
+        }
+    }
+
+    return "";
+}
+
+/**
+ * Measures update and render of an effect. Renders each frame, i.e. the worst case of the render task.
+ */
+static void benchEffect(Effect& effect, LedSpan leds)
+{
+    effect.begin(leds.size);
+
+    double ns = measure([&]()
+    {
+        effect.update(BENCH_TIME_FRAME);
+        effect.render(leds);
+        consume(leds);
+    });
+
+    report(effect.name(), leds.size, 0, ns, checkBudget(effect.name(), leds.size, ns));
+}
+
+/**
+ * Measures moving and drawing a pool with the given number of sprites. Sprites leaving the strip are
+ * replaced, so the density stays constant.
+ */
+static void benchSprites(LedSpan leds, uint16_t numSprites)
+{
+    static SpritePool<RENDER_SPRITES_NUM_SPRITES_MAX> pool;
+    pool.clear();
+
+    double ns = measure([&]()
+    {
+        while (pool.numActive() < numSprites)
+        {
+            t_LedSprite sp;
+            sp.pos = (int32_t) random(0, leds.size) << SPRITE_FRAC_BITS;
+            sp.vel = (2 * random(0, 2) - 1) * SPRITE_ONE_LED;
+            sp.color = CHSV(random(0, 255), random(128, 255), random(128, 255));
+            pool.spawn(sp);
+        }
+
+        pool.move(leds.size, SPRITE_ONE_LED / 5);
+        pool.draw(leds);
+        consume(leds);
+    });
+
+    report("SpritePool", leds.size, numSprites, ns);
+}
+
+int main()
+{
+    EffectConstant effectConstant;
+    EffectGradient effectGradient;
+    EffectChase effectChase;
+    EffectSprite effectSprite;
+
+    // Sprites added to a gradient, the largest strip determines the size of the scratch buffers
+    EffectGradient layerGradient;
+    EffectSprite layerSprites;
+    static EffectLayers<10000, 2> effectLayered("Layered", RENDER_SPRITES_STEP_TIME_INIT);
+    effectLayered.add(&layerGradient, t_BlendMode::BLEND_NORMAL, LAYER_OPAQUE);
+    effectLayered.add(&layerSprites, t_BlendMode::BLEND_ADD, LAYER_OPAQUE);
+
+    // Procedural effects, the largest strip determines the size of their state
+    static EffectNoise<10000> effectNoise;
+    static EffectFire<10000> effectFire;
+    static EffectTwinkle<10000> effectTwinkle;
+
+    Effect* const effects[] = {&effectConstant, &effectGradient, &effectChase, &effectSprite, &effectLayered,
+        &effectNoise, &effectFire, &effectTwinkle};
+
+    printf("%-10s %6s %8s %12s %10s %s\n", "Effect", "Leds", "Sprites", "ns/frame", "ns/led", "budget");
+
+    for (uint16_t numLeds : BENCH_NUM_LEDS)
+    {
+        std::vector<CRGB> buffer(numLeds);
+        LedSpan leds(buffer.data(), numLeds);
+
+        for (Effect* effect : effects)
+        {
+            // Step with each frame, i.e. worst case
+            effect->stepTime = BENCH_TIME_FRAME / 1000;
+            benchEffect(*effect, leds);
+        }
+
+        for (uint16_t numSprites : BENCH_NUM_SPRITES)
+        {
+            benchSprites(leds, numSprites);
+        }
+    }
+
+    printf("Checksum: %u\n", benchChecksum);
+
+    if (benchOverBudget > 0)
+    {
+        printf("%u effect(s) over budget\n", benchOverBudget);
+        return 1;
+    }
+
+    return 0;
+}
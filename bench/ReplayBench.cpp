@@ -0,0 +1,265 @@
+/**
+    ReplayBench.cpp:
+    Host replay of an input trace (see InputTrace.h), e.g. printed by the 'd'
+    request of the sketch. The raw input events are translated into commands
+    like on the device (IR keymap, button gestures), the light effects advance frame by frame and the time
+    of update and render is collected in a histogram. The checksum of all
+    frames shows whether two builds render the same.
+    The harness applies the commands which affect the light effects (on/off,
+    mode, speed, direction, pause), the output stage is not part of it.
+    
+    Build and run from the repository directory:
+        g++ -O2 -std=gnu++11 -I bench/host -I . bench/ReplayBench.cpp -o ReplayBench
+        ./ReplayBench trace.txt [number of leds]
+
+    Copyright (C) 2020 by Ernst Sikora
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+
+#include "ButtonGestures.h"
+#include "Compositor.h"
+#include "Effects.h"
+#include "Histogram.h"
+#include "InputTrace.h"
+#include "Procedural.h"
+
+// Replay constants
+const uint16_t REPLAY_NUM_LEDS_DEFAULT = 1000; // Strip length, unless given as argument
+const uint16_t REPLAY_NUM_LEDS_MAX = 10000;
+const uint32_t REPLAY_TIME_FRAME = 20000; // us, frame duration, i.e. 50 frames per second
+const uint16_t REPLAY_EVENTS_MAX = 4096; // Capacity of the trace
+const uint8_t REPLAY_NUM_BUCKETS = 24; // Histogram buckets (powers of two of ns)
+
+// System states of the sketch, in the order of the bits of the command states (CMD_STATE_OFF ...)
+enum ReplayState {OFF = 0, ON = 1, ECO = 2};
+typedef enum ReplayState t_ReplayState;
+
+/**
+ * Loads a trace printed by the sketch: a line "trace <events> <duration>", one line per event and a line "end".
+ * Returns false, if the file cannot be read or contains an invalid line.
+ */
+static bool loadTrace(const char* path, InputTrace<REPLAY_EVENTS_MAX>& trace)
+{
+    FILE* file = fopen(path, "r");
+
+    if (file == nullptr)
+    {
+        return false;
+    }
+
+    char line[INPUT_EVENT_TEXT_SIZE * 2];
+    bool valid = true;
+    trace.clear(0);
+
+    while (valid && fgets(line, sizeof(line), file) != nullptr)
+    {
+        unsigned long duration = 0;
+        t_InputEvent ev;
+
+        if (sscanf(line, "trace %*u %lu", &duration) == 1)
+        {
+            trace.clear(duration);
+        }
+        else if (strncmp(line, "end", 3) == 0)
+        {
+            break;
+        }
+        else if (line[0] != '\r' && line[0] != '\n')
+        {
+            valid = trace.parse(line, ev) && trace.append(ev);
+        }
+    }
+
+    fclose(file);
+    return valid;
+}
+
+int main(int argc, char* argv[])
+{
+    static InputTrace<REPLAY_EVENTS_MAX> trace;
+
+    if (argc < 2 || !loadTrace(argv[1], trace))
+    {
+        fprintf(stderr, "Usage: ReplayBench trace.txt [number of leds]\n");
+        return 2;
+    }
+
+    uint16_t numLeds = (argc > 2) ? (uint16_t) atoi(argv[2]) : REPLAY_NUM_LEDS_DEFAULT;
+    numLeds = (numLeds < 1) ? 1 : ((numLeds > REPLAY_NUM_LEDS_MAX) ? REPLAY_NUM_LEDS_MAX : numLeds);
+
+    // Light effects in the order of the sketch, without the clip (no flash partition on the host)
+    EffectConstant effectConstant;
+    EffectGradient effectGradient;
+    EffectChase effectChase;
+    EffectSprite effectSprite;
+
+    EffectGradient layerGradient;
+    EffectSprite layerSprites;
+    static EffectLayers<REPLAY_NUM_LEDS_MAX, 2> effectLayered("Layered", RENDER_SPRITES_STEP_TIME_INIT);
+    effectLayered.add(&layerGradient, t_BlendMode::BLEND_NORMAL, LAYER_OPAQUE);
+    effectLayered.add(&layerSprites, t_BlendMode::BLEND_ADD, LAYER_OPAQUE);
+
+    static EffectNoise<REPLAY_NUM_LEDS_MAX> effectNoise;
+    static EffectFire<REPLAY_NUM_LEDS_MAX> effectFire;
+    static EffectTwinkle<REPLAY_NUM_LEDS_MAX> effectTwinkle;
+
+    Effect* const effects[] = {&effectConstant, &effectGradient, &effectChase, &effectSprite, &effectLayered,
+        &effectNoise, &effectFire, &effectTwinkle};
+    const uint8_t numEffects = sizeof(effects) / sizeof(effects[0]);
+
+    std::vector<CRGB> buffer(numLeds);
+    LedSpan leds(buffer.data(), numLeds);
+
+    // State after power on: off, default effect "Chase"
+    t_ReplayState state = t_ReplayState::OFF;
+    uint8_t effectNr = 2;
+    Effect* effect = effects[effectNr];
+    effect->begin(numLeds);
+
+    const t_IrKey* irKeyLast = nullptr;
+    ButtonGestures gestures;
+    std::vector<t_Command> cmds;
+    Histogram<REPLAY_NUM_BUCKETS> frameTime;
+    uint32_t numCommands = 0;
+    uint32_t checksum = 0;
+
+    typedef std::chrono::steady_clock Clock;
+    trace.startReplay(0);
+
+    for (int64_t now = 0; trace.replaying(); now += REPLAY_TIME_FRAME)
+    {
+        // Commands of the events and gestures due in this frame, like handleInput() of the sketch
+        t_InputEvent ev;
+        t_Command cmd;
+        cmds.clear();
+
+        while (trace.next(now, ev))
+        {
+            if (ev.source == t_InputSource::INPUT_IR)
+            {
+                if (inputCommand(ev, irKeyLast, cmd))
+                {
+                    cmds.push_back(cmd);
+                }
+
+                continue;
+            }
+
+            while (gestures.next(ev.time, cmd))
+            {
+                cmds.push_back(cmd);
+            }
+
+            gestures.edge(ev.source == t_InputSource::INPUT_BUTTON_DOWN, ev.time);
+        }
+
+        while (gestures.next(now, cmd))
+        {
+            cmds.push_back(cmd);
+        }
+
+        for (const t_Command& cmd : cmds)
+        {
+            if ((cmd.states & (1 << state)) == 0)
+            {
+                continue;
+            }
+
+            numCommands++;
+
+            switch (cmd.id)
+            {
+                case t_CommandId::CMD_ON_OFF:
+                    // Off, on, eco, off: the effect restarts when switched on and when switched to eco
+                    state = (t_ReplayState) ((state + 1) % 3);
+
+                    if (state != t_ReplayState::OFF)
+                    {
+                        effect->begin(numLeds);
+                    }
+
+                    break;
+
+                case t_CommandId::CMD_MODE_CHANGE:
+                    effectNr = (effectNr + 1) % numEffects;
+                    effect = effects[effectNr];
+                    effect->resetSpeed();
+                    effect->begin(numLeds);
+                    break;
+
+                case t_CommandId::CMD_PLAY_PAUSE:
+                    effect->paused = effect->pausable() && !effect->paused;
+                    break;
+
+                case t_CommandId::CMD_SLOWER:
+                    effect->stepTime = std::min<uint16_t>(effect->stepTime + RENDER_STEP_TIME_STEP,
+                        RENDER_STEP_TIME_MAX);
+                    break;
+
+                case t_CommandId::CMD_FASTER:
+                    effect->stepTime = std::max<uint16_t>(effect->stepTime - RENDER_STEP_TIME_STEP,
+                        RENDER_STEP_TIME_MIN);
+                    effect->paused = false;
+                    break;
+
+                case t_CommandId::CMD_LEFT:
+                case t_CommandId::CMD_RIGHT:
+                    if (effect->reversible() && (effect->dirLeft != (cmd.id == t_CommandId::CMD_LEFT) || effect->paused))
+                    {
+                        effect->dirLeft = (cmd.id == t_CommandId::CMD_LEFT);
+                        effect->paused = false;
+                        effect->stepNow();
+                    }
+
+                    break;
+
+                default:
+                    break;
+            }
+        }
+
+        if (state == t_ReplayState::OFF)
+        {
+            continue;
+        }
+
+        Clock::time_point start = Clock::now();
+
+        if (effect->update(REPLAY_TIME_FRAME))
+        {
+            effect->render(leds);
+        }
+
+        frameTime.record((uint32_t) std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count());
+
+        for (uint16_t ledNr = 0; ledNr < numLeds; ledNr++)
+        {
+            checksum = checksum * 31 + leds[ledNr].r + (leds[ledNr].g << 8) + (leds[ledNr].b << 16);
+        }
+    }
+
+    printf("Events: %u, commands %u, duration %lu us, leds %u\n", trace.size(), numCommands,
+        (unsigned long) trace.duration(), numLeds);
+    printf("Frame: n %u, mean %u ns, max %u ns, p50 < %llu ns, p99 < %llu ns\n", frameTime.count(), frameTime.mean(),
+        frameTime.max(), (unsigned long long) frameTime.percentile(50), (unsigned long long) frameTime.percentile(99));
+    printf("Checksum: %08X\n", checksum);
+
+    return 0;
+}
@@ -0,0 +1,122 @@
+/**
+    FastLED.h:
+    Minimal host replacement of the FastLED and Arduino functions used by the
+    light effects, so that the effects can be compiled and measured on a PC.
+    Colors are close to, but not bit-exact with FastLED.
+
+    Copyright (C) 2020 by Ernst Sikora
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BENCH_HOST_FASTLED_H
+#define BENCH_HOST_FASTLED_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint8_t byte;
+
+inline uint8_t qadd8(uint8_t i, uint8_t j)
+{
+    unsigned int t = i + j;
+    return t > 255 ? 255 : t;
+}
+
+inline uint8_t scale8(uint8_t i, uint8_t scale)
+{
+    return ((uint16_t) i * (1 + (uint16_t) scale)) >> 8;
+}
+
+struct CHSV
+{
+    uint8_t h, s, v;
+
+    CHSV() : h(0), s(0), v(0) {}
+    CHSV(uint8_t h, uint8_t s, uint8_t v) : h(h), s(s), v(v) {}
+};
+
+struct CRGB
+{
+    uint8_t r, g, b;
+
+    CRGB() : r(0), g(0), b(0) {}
+    CRGB(uint8_t r, uint8_t g, uint8_t b) : r(r), g(g), b(b) {}
+
+    CRGB(const CHSV& hsv)
+    {
+        setHSV(hsv.h, hsv.s, hsv.v);
+    }
+
+    /**
+     * Spectrum conversion with six sectors of the hue circle.
+     */
+    CRGB& setHSV(uint8_t hue, uint8_t sat, uint8_t val)
+    {
+        uint16_t h6 = (uint16_t) hue * 6;
+        uint8_t sector = h6 >> 8;
+        uint8_t frac = h6 & 0xFF;
+
+        uint8_t lo = scale8(val, 255 - sat);
+        uint8_t down = scale8(val, 255 - scale8(sat, frac));
+        uint8_t up = scale8(val, 255 - scale8(sat, 255 - frac));
+
+        switch (sector)
+        {
+            case 0:  r = val;  g = up;   b = lo;   break;
+            case 1:  r = down; g = val;  b = lo;   break;
+            case 2:  r = lo;   g = val;  b = up;   break;
+            case 3:  r = lo;   g = down; b = val;  break;
+            case 4:  r = up;   g = lo;   b = val;  break;
+            default: r = val;  g = lo;   b = down; break;
+        }
+
+        return *this;
+    }
+
+    CRGB& operator+=(const CRGB& rhs)
+    {
+        r = qadd8(r, rhs.r);
+        g = qadd8(g, rhs.g);
+        b = qadd8(b, rhs.b);
+        return *this;
+    }
+
+    CRGB& nscale8(uint8_t scale)
+    {
+        r = scale8(r, scale);
+        g = scale8(g, scale);
+        b = scale8(b, scale);
+        return *this;
+    }
+};
+
+inline void fill_solid(CRGB* leds, int numLeds, const CRGB& color)
+{
+    for (int i = 0; i < numLeds; i++)
+    {
+        leds[i] = color;
+    }
+}
+
+/**
+ * Arduino random number in the range [min, max).
+ */
+inline long random(long min, long max)
+{
+    return (max > min) ? min + rand() % (max - min) : min;
+}
+
+#endif // BENCH_HOST_FASTLED_H
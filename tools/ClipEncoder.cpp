@@ -0,0 +1,265 @@
+/**
+    ClipEncoder.cpp:
+    Encodes animation clips for the clip partition of the lamp. Each input file
+    contains the raw frames of one clip, 3 bytes (red, green, blue) per led.
+    
+    Build and run from the repository directory:
+        g++ -O2 -std=gnu++11 -I . tools/ClipEncoder.cpp -o ClipEncoder
+        ./ClipEncoder clips.bin 29 40 clip1.rgb clip2.rgb
+
+    Copyright (C) 2020 by Ernst Sikora
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "ClipFormat.h"
+
+/**
+ * Appends a 16-bit value, little endian.
+ */
+static void put16(std::vector<uint8_t>& out, uint16_t value)
+{
+    out.push_back(value & 0xFF);
+    out.push_back(value >> 8);
+}
+
+/**
+ * Appends a 32-bit value, little endian.
+ */
+static void put32(std::vector<uint8_t>& out, uint32_t value)
+{
+    put16(out, value & 0xFFFF);
+    put16(out, value >> 16);
+}
+
+/**
+ * Overwrites a 32-bit value, little endian.
+ */
+static void set32(std::vector<uint8_t>& out, size_t pos, uint32_t value)
+{
+    for (uint8_t i = 0; i < 4; i++)
+    {
+        out[pos + i] = (value >> (8 * i)) & 0xFF;
+    }
+}
+
+/**
+ * Reads a whole file. Returns false, if it cannot be read.
+ */
+static bool readFile(const char* path, std::vector<uint8_t>& data)
+{
+    FILE* file = fopen(path, "rb");
+
+    if (file == nullptr)
+    {
+        return false;
+    }
+
+    uint8_t buffer[4096];
+    size_t length;
+
+    while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    {
+        data.insert(data.end(), buffer, buffer + length);
+    }
+
+    fclose(file);
+
+    return true;
+}
+
+/**
+ * Appends the runs of leds whose palette index differs from the previous frame. Unchanged leds between two runs
+ * are included, if that is shorter than starting a new run.
+ */
+static void encodeFrame(std::vector<uint8_t>& out, const std::vector<uint8_t>& frame,
+    const std::vector<uint8_t>& previous, bool first)
+{
+    const uint16_t numLeds = frame.size();
+    size_t numRunsPos = out.size();
+    uint16_t numRuns = 0;
+    put16(out, 0);
+
+    uint16_t ledNr = 0;
+
+    while (ledNr < numLeds)
+    {
+        if (!first && frame[ledNr] == previous[ledNr])
+        {
+            ledNr++;
+            continue;
+        }
+
+        // Extend the run until the gap of unchanged leds exceeds the size of a run header
+        uint16_t start = ledNr;
+        uint16_t end = ledNr + 1;
+
+        for (uint16_t nr = end; nr < numLeds && (uint32_t) (nr - end) <= CLIP_RUN_HEADER_SIZE; nr++)
+        {
+            if (first || frame[nr] != previous[nr])
+            {
+                end = nr + 1;
+            }
+        }
+
+        put16(out, start);
+        put16(out, end - start);
+        out.insert(out.end(), frame.begin() + start, frame.begin() + end);
+        numRuns++;
+        ledNr = end;
+    }
+
+    out[numRunsPos] = numRuns & 0xFF;
+    out[numRunsPos + 1] = numRuns >> 8;
+}
+
+/**
+ * Encodes the raw frames of one clip. Returns false, if the clip has more colors than the palette can hold.
+ */
+static bool encodeClip(std::vector<uint8_t>& out, const std::vector<uint8_t>& raw, uint16_t numLeds,
+    uint16_t frameTime)
+{
+    const size_t frameSize = numLeds * CLIP_COLOR_SIZE;
+    const uint16_t numFrames = raw.size() / frameSize;
+    std::vector<uint32_t> palette;
+    std::vector<std::vector<uint8_t>> frames(numFrames, std::vector<uint8_t>(numLeds));
+
+    // Palette of all colors of the clip, in order of appearance
+    for (uint16_t frameNr = 0; frameNr < numFrames; frameNr++)
+    {
+        for (uint16_t ledNr = 0; ledNr < numLeds; ledNr++)
+        {
+            const uint8_t* rgb = &raw[frameNr * frameSize + ledNr * CLIP_COLOR_SIZE];
+            uint32_t color = ((uint32_t) rgb[0] << 16) | ((uint32_t) rgb[1] << 8) | rgb[2];
+            size_t index = 0;
+
+            while (index < palette.size() && palette[index] != color)
+            {
+                index++;
+            }
+
+            if (index == palette.size())
+            {
+                if (palette.size() == CLIP_PALETTE_SIZE_MAX)
+                {
+                    return false;
+                }
+
+                palette.push_back(color);
+            }
+
+            frames[frameNr][ledNr] = index;
+        }
+    }
+
+    put16(out, numLeds);
+    put16(out, numFrames);
+    put16(out, frameTime);
+    put16(out, palette.size());
+    put32(out, 0);
+
+    for (uint32_t color : palette)
+    {
+        out.push_back(color >> 16);
+        out.push_back((color >> 8) & 0xFF);
+        out.push_back(color & 0xFF);
+    }
+
+    for (uint16_t frameNr = 0; frameNr < numFrames; frameNr++)
+    {
+        encodeFrame(out, frames[frameNr], frames[frameNr > 0 ? frameNr - 1 : 0], frameNr == 0);
+    }
+
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 5)
+    {
+        fprintf(stderr, "Usage: %s <output> <number of leds> <frame time ms> <clip> ...\n", argv[0]);
+        return 1;
+    }
+
+    const char* outPath = argv[1];
+    const long numLeds = strtol(argv[2], nullptr, 10);
+    const long frameTime = strtol(argv[3], nullptr, 10);
+    const uint16_t numClips = argc - 4;
+
+    if (numLeds <= 0 || numLeds > 0xFFFF || frameTime <= 0 || frameTime > 0xFFFF)
+    {
+        fprintf(stderr, "Invalid number of leds or frame time\n");
+        return 1;
+    }
+
+    // Bank header and clip table, the table is filled in once the clips are encoded
+    std::vector<uint8_t> bank;
+    put32(bank, CLIP_BANK_MAGIC);
+    put16(bank, CLIP_BANK_VERSION);
+    put16(bank, numClips);
+    put32(bank, 0);
+    put32(bank, 0);
+    bank.resize(CLIP_BANK_HEADER_SIZE + numClips * CLIP_ENTRY_SIZE, 0);
+
+    for (uint16_t clipNr = 0; clipNr < numClips; clipNr++)
+    {
+        const char* path = argv[4 + clipNr];
+        std::vector<uint8_t> raw;
+
+        if (!readFile(path, raw))
+        {
+            fprintf(stderr, "%s: cannot be read\n", path);
+            return 1;
+        }
+
+        size_t numFrames = raw.size() / (numLeds * CLIP_COLOR_SIZE);
+
+        if (numFrames == 0 || numFrames > 0xFFFF || raw.size() % (numLeds * CLIP_COLOR_SIZE) != 0)
+        {
+            fprintf(stderr, "%s: size is not a multiple of %ld leds or has too many frames\n", path, numLeds);
+            return 1;
+        }
+
+        size_t offset = bank.size();
+
+        if (!encodeClip(bank, raw, numLeds, frameTime))
+        {
+            fprintf(stderr, "%s: more than %u colors\n", path, CLIP_PALETTE_SIZE_MAX);
+            return 1;
+        }
+
+        set32(bank, CLIP_BANK_HEADER_SIZE + clipNr * CLIP_ENTRY_SIZE, offset);
+        set32(bank, CLIP_BANK_HEADER_SIZE + clipNr * CLIP_ENTRY_SIZE + 4, bank.size() - offset);
+
+        printf("%s: %zu frames, %zu bytes (raw %zu bytes)\n", path, numFrames, bank.size() - offset, raw.size());
+    }
+
+    FILE* file = fopen(outPath, "wb");
+
+    if (file == nullptr || fwrite(bank.data(), 1, bank.size(), file) != bank.size())
+    {
+        fprintf(stderr, "%s: cannot be written\n", outPath);
+        return 1;
+    }
+
+    fclose(file);
+    printf("%s: %u clips, %zu bytes\n", outPath, numClips, bank.size());
+
+    return 0;
+}